@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <linux/udmabuf.h>
+
+#include <dmabuf.h>
+
+/* Memfd-backed dmabufs, as another pipeline stage would provide them. */
+int dmabuf_create(struct dmabuf *dmabuf, unsigned int size)
+{
+	struct udmabuf_create create = { 0 };
+	long page_size = sysconf(_SC_PAGESIZE);
+	int udmabuf_fd;
+	int ret;
+
+	if (!dmabuf || !size)
+		return -EINVAL;
+
+	dmabuf->fd = -1;
+	dmabuf->data = MAP_FAILED;
+	dmabuf->size = (size + page_size - 1) / page_size * page_size;
+
+	dmabuf->memfd = memfd_create("dmabuf", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (dmabuf->memfd < 0)
+		return -errno;
+
+	ret = ftruncate(dmabuf->memfd, dmabuf->size);
+	if (ret)
+		goto error;
+
+	/* Exporting a memfd requires that it cannot shrink. */
+	ret = fcntl(dmabuf->memfd, F_ADD_SEALS, F_SEAL_SHRINK);
+	if (ret)
+		goto error;
+
+	dmabuf->data = mmap(NULL, dmabuf->size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, dmabuf->memfd, 0);
+	if (dmabuf->data == MAP_FAILED)
+		goto error;
+
+	udmabuf_fd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	if (udmabuf_fd < 0) {
+		/* Only the loopback backend accepts the memfd itself. */
+		fprintf(stderr, "Missing udmabuf support, using memfd\n");
+		dmabuf->fd = dup(dmabuf->memfd);
+		if (dmabuf->fd < 0)
+			goto error;
+
+		return 0;
+	}
+
+	create.memfd = dmabuf->memfd;
+	create.flags = UDMABUF_FLAGS_CLOEXEC;
+	create.offset = 0;
+	create.size = dmabuf->size;
+
+	dmabuf->fd = ioctl(udmabuf_fd, UDMABUF_CREATE, &create);
+
+	close(udmabuf_fd);
+
+	if (dmabuf->fd < 0)
+		goto error;
+
+	return 0;
+
+error:
+	ret = -errno;
+
+	dmabuf_destroy(dmabuf);
+
+	return ret;
+}
+
+void dmabuf_destroy(struct dmabuf *dmabuf)
+{
+	if (!dmabuf)
+		return;
+
+	if (dmabuf->data != MAP_FAILED)
+		munmap(dmabuf->data, dmabuf->size);
+
+	if (dmabuf->fd >= 0)
+		close(dmabuf->fd);
+
+	if (dmabuf->memfd >= 0)
+		close(dmabuf->memfd);
+
+	dmabuf->data = MAP_FAILED;
+	dmabuf->fd = -1;
+	dmabuf->memfd = -1;
+}
@@ -0,0 +1,18 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#ifndef _DMABUF_H_
+#define _DMABUF_H_
+
+struct dmabuf {
+	int fd;
+	int memfd;
+	void *data;
+	unsigned int size;
+};
+
+int dmabuf_create(struct dmabuf *dmabuf, unsigned int size);
+void dmabuf_destroy(struct dmabuf *dmabuf);
+
+#endif
@@ -7,11 +7,77 @@
 #include <wchar.h>
 #include <string.h>
 #include <math.h>
+#include <unistd.h>
 #include <cairo.h>
 
+#include <sys/mman.h>
+
 #include <draw.h>
 
-struct draw_buffer *draw_buffer_create(unsigned int width, unsigned int height)
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE	23
+#endif
+
+static size_t draw_memory_size(size_t size, bool pinned)
+{
+	size_t align = pinned ? DRAW_HUGE_PAGE_SIZE : sysconf(_SC_PAGESIZE);
+
+	return (size + align - 1) & ~(align - 1);
+}
+
+/* Pinned memory is backed by huge pages when available, faulted in upfront
+ * and locked, so that the first frames do not pay for it. */
+void *draw_memory_alloc(size_t size, bool pinned)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	size_t page_size;
+	size_t offset;
+	void *data;
+
+	size = draw_memory_size(size, pinned);
+
+	if (!pinned) {
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+		return data == MAP_FAILED ? NULL : data;
+	}
+
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    flags | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	if (data == MAP_FAILED) {
+		/* No reserved huge pages, fallback to transparent ones, which
+		 * have to be requested before the memory is faulted in. */
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (data == MAP_FAILED)
+			return NULL;
+
+		madvise(data, size, MADV_HUGEPAGE);
+
+		if (madvise(data, size, MADV_POPULATE_WRITE)) {
+			page_size = sysconf(_SC_PAGESIZE);
+
+			for (offset = 0; offset < size; offset += page_size)
+				((volatile uint8_t *)data)[offset] = 0;
+		}
+	}
+
+	if (mlock(data, size)) {
+		munmap(data, size);
+		return NULL;
+	}
+
+	return data;
+}
+
+void draw_memory_free(void *data, size_t size, bool pinned)
+{
+	if (!data)
+		return;
+
+	munmap(data, draw_memory_size(size, pinned));
+}
+
+struct draw_buffer *draw_buffer_create(unsigned int width, unsigned int height,
+				       bool pinned)
 {
 	struct draw_buffer *buffer = NULL;
 	unsigned int stride;
@@ -32,7 +98,8 @@ struct draw_buffer *draw_buffer_create(unsigned int width, unsigned int height)
 	buffer->stride = stride;
 
 	buffer->size = size;
-	buffer->data = calloc(1, size);
+	buffer->pinned = pinned;
+	buffer->data = draw_memory_alloc(size, pinned);
 
 	if (!buffer->data)
 		goto error;
@@ -51,8 +118,7 @@ void draw_buffer_destroy(struct draw_buffer *buffer)
 	if (!buffer)
 		return;
 
-	if (buffer->data)
-		free(buffer->data);
+	draw_memory_free(buffer->data, buffer->size, buffer->pinned);
 
 	free(buffer);
 }
@@ -254,3 +320,18 @@ void draw_mandelbrot_init(struct draw_mandelbrot *mandelbrot)
 	mandelbrot->view_height = mandelbrot->view_width * 720. / 1280.;
 	mandelbrot->iterations_zoom = 200.;
 }
+
+void draw_mandelbrot_seek(struct draw_mandelbrot *mandelbrot,
+			  unsigned int frame)
+{
+	unsigned int i;
+
+	if (!mandelbrot)
+		return;
+
+	/* Replay the zoom steps to get the exact same view. */
+	draw_mandelbrot_init(mandelbrot);
+
+	for (i = 0; i < frame; i++)
+		draw_mandelbrot_zoom(mandelbrot);
+}
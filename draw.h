@@ -5,9 +5,16 @@
 #ifndef _DRAW_H_
 #define _DRAW_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DRAW_HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+
 struct draw_buffer {
 	void *data;
 	unsigned int size;
+	bool pinned;
 
 	unsigned int width;
 	unsigned int height;
@@ -36,7 +43,10 @@ static inline uint32_t *draw_buffer_pixel(struct draw_buffer *buffer,
 	return (uint32_t *)(buffer->data + offset);
 }
 
-struct draw_buffer *draw_buffer_create(unsigned int width, unsigned int height);
+void *draw_memory_alloc(size_t size, bool pinned);
+void draw_memory_free(void *data, size_t size, bool pinned);
+struct draw_buffer *draw_buffer_create(unsigned int width, unsigned int height,
+				       bool pinned);
 void draw_buffer_destroy(struct draw_buffer *buffer);
 void draw_png(struct draw_buffer *buffer, char *path);
 void draw_gradient(struct draw_buffer *buffer);
@@ -48,5 +58,7 @@ void draw_mandelbrot(struct draw_mandelbrot *mandelbrot,
 		     struct draw_buffer *buffer);
 void draw_mandelbrot_zoom(struct draw_mandelbrot *mandelbrot);
 void draw_mandelbrot_init(struct draw_mandelbrot *mandelbrot);
+void draw_mandelbrot_seek(struct draw_mandelbrot *mandelbrot,
+			  unsigned int frame);
 
 #endif
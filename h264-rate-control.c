@@ -15,6 +15,7 @@
 
 #include <v4l2-encoder.h>
 #include <h264-rate-control.h>
+#include <probe.h>
 
 #define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
 
@@ -145,6 +146,7 @@ void h264_rate_control_feedback(struct v4l2_encoder *encoder,
 	/* Collect statistics. */
 
 	rc->qp_sum += qp_average;
+	rc->qp_count++;
 
 	/* Calculate how many bits are used per non-zero coefficient, with an
 	 * upscaling factor for precision. */
@@ -201,6 +203,7 @@ void h264_rate_control_step(struct v4l2_encoder *encoder)
 			rc->qp = rc->qp_sum / setup->gop_size;
 
 		rc->qp_sum = 0;
+		rc->qp_count = 0;
 
 		/* Apply intra QP delta privilege. */
 		if (rc->qp > setup->qp_intra_delta)
@@ -232,6 +235,10 @@ void h264_rate_control_step(struct v4l2_encoder *encoder)
 
 	if (rc->intra_request)
 		rc->intra_request = false;
+
+	PROBE3(rate_control_step,
+	       encoder->h264_src_controls.encode_params.frame_num, rc->qp,
+	       rc->bits_target / 8);
 }
 
 int h264_rate_control_intra_request(struct v4l2_encoder *encoder)
@@ -247,11 +254,102 @@ int h264_rate_control_intra_request(struct v4l2_encoder *encoder)
 	return 0;
 }
 
+static void h264_rate_control_budget(struct v4l2_encoder_setup *setup,
+				     struct h264_rate_control *rc)
+{
+	unsigned int cp_count;
+
+	rc->bits_per_frame = setup->bitrate * setup->fps_den / setup->fps_num;
+	rc->bits_per_gop = rc->bits_per_frame * setup->gop_size;
+
+	/* Checkpoints */
+
+	cp_count = setup->height_mbs - 1;
+	if (cp_count > ARRAY_SIZE(rc->cp_target))
+		cp_count = ARRAY_SIZE(rc->cp_target);
+
+	rc->cp_count = cp_count;
+	rc->cp_distance_mbs = setup->width_mbs * setup->height_mbs /
+			      (cp_count + 1);
+}
+
+/* The QP and coefficient statistics carry over to the new picture size, the
+ * next frame starts a GOP from the current QP. */
+int h264_rate_control_reconfigure(struct v4l2_encoder *encoder)
+{
+	struct h264_rate_control *rc;
+
+	if (!encoder)
+		return -EINVAL;
+
+	rc = &encoder->rc;
+
+	h264_rate_control_budget(&encoder->setup, rc);
+
+	rc->cp_enabled = false;
+	rc->intra_request = true;
+
+	return 0;
+}
+
+/* Budgets are rescaled in place so that the current GOP goes on with the
+ * same QP and statistics, without an intra frame. */
+int h264_rate_control_update(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_setup *setup;
+	struct h264_rate_control *rc;
+	unsigned int bits_per_frame;
+	unsigned int gop_left;
+	int64_t bits_left;
+
+	if (!encoder)
+		return -EINVAL;
+
+	setup = &encoder->setup;
+	rc = &encoder->rc;
+
+	bits_per_frame = rc->bits_per_frame;
+
+	h264_rate_control_budget(setup, rc);
+
+	if (bits_per_frame) {
+		rc->bits_left = (uint64_t)rc->bits_left * rc->bits_per_frame /
+				bits_per_frame;
+		rc->bits_target = (uint64_t)rc->bits_target *
+				  rc->bits_per_frame / bits_per_frame;
+	}
+
+	/* A GOP already longer than the new size ends with this frame, its
+	 * QP sum is scaled to the new size for the next GOP average. */
+	if (encoder->gop_index >= setup->gop_size) {
+		if (rc->qp_count)
+			rc->qp_sum = (uint64_t)rc->qp_sum * setup->gop_size /
+				     rc->qp_count;
+
+		encoder->gop_index = 0;
+		rc->gop_left = 0;
+	} else if (encoder->gop_index) {
+		gop_left = setup->gop_size - encoder->gop_index;
+
+		bits_left = (int64_t)rc->bits_left +
+			    ((int64_t)gop_left - rc->gop_left) *
+			    rc->bits_per_frame;
+		rc->bits_left = bits_left > 0 ? bits_left : 0;
+		rc->gop_left = gop_left;
+	}
+
+	if (rc->qp < setup->qp_min)
+		rc->qp = setup->qp_min;
+	else if (rc->qp > setup->qp_max)
+		rc->qp = setup->qp_max;
+
+	return 0;
+}
+
 int h264_rate_control_setup(struct v4l2_encoder *encoder)
 {
 	struct v4l2_encoder_setup *setup;
 	struct h264_rate_control *rc;
-	unsigned int cp_count;
 
 	if (!encoder)
 		return -EINVAL;
@@ -264,20 +362,9 @@ int h264_rate_control_setup(struct v4l2_encoder *encoder)
 	/* Start with intra request to ensure GOP start. */
 	rc->intra_request = true;
 
-	rc->bits_per_frame = setup->bitrate * setup->fps_den / setup->fps_num;
-	rc->bits_per_gop = rc->bits_per_frame * setup->gop_size;
+	h264_rate_control_budget(setup, rc);
 
 	rc->qp = hantro_qp_inital_estimate(setup, rc);
 
-	/* Checkpoints */
-
-	cp_count = setup->height_mbs - 1;
-	if (cp_count > ARRAY_SIZE(rc->cp_target))
-		cp_count = ARRAY_SIZE(rc->cp_target);
-
-	rc->cp_count = cp_count;
-	rc->cp_distance_mbs = setup->width_mbs * setup->height_mbs /
-			      (cp_count + 1);
-
 	return 0;
 }
@@ -29,6 +29,7 @@ struct h264_rate_control {
 
 	unsigned int qp;
 	unsigned int qp_sum;
+	unsigned int qp_count;
 	bool qp_intra_privilege;
 
 	bool intra_request;
@@ -40,6 +41,8 @@ void h264_rate_control_feedback(struct v4l2_encoder *encoder,
 				unsigned int qp_sum);
 void h264_rate_control_step(struct v4l2_encoder *encoder);
 int h264_rate_control_intra_request(struct v4l2_encoder *encoder);
+int h264_rate_control_reconfigure(struct v4l2_encoder *encoder);
+int h264_rate_control_update(struct v4l2_encoder *encoder);
 int h264_rate_control_setup(struct v4l2_encoder *encoder);
 
 #endif
@@ -7,6 +7,7 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -18,9 +19,12 @@
 #include <v4l2-encoder.h>
 #include <bitstream.h>
 #include <unit.h>
+#include <probe.h>
 
 #define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
 
+#define H264_LEVEL_IDC	31
+
 static void bitstream_sps(struct bitstream *bitstream,
 			  struct v4l2_encoder *encoder)
 {
@@ -168,7 +172,7 @@ int h264_complete(struct v4l2_encoder *encoder)
 	unsigned int bytes_used;
 	unsigned int capture_index;
 
-	capture_index = encoder->capture_buffers_index;
+	capture_index = encoder->capture_buffers_done_index;
 	capture_buffer = &encoder->capture_buffers[capture_index];
 
 	/* Feedback */
@@ -180,16 +184,39 @@ int h264_complete(struct v4l2_encoder *encoder)
 				   encode_feedback->rlc_count,
 				   encode_feedback->qp_sum);
 
-	/* Slice */
+	PROBE4(rate_control_feedback, capture_buffer->frame_num, capture_index,
+	       encoder->rc.qp, bytes_used);
 
-	if (encoder->bitstream_fd >= 0)
-		write(encoder->bitstream_fd, capture_buffer->mmap_data[0],
-		      capture_buffer->buffer.m.planes[0].bytesused);
+	return 0;
+}
 
-	/* GOP */
+int h264_slice_write(struct v4l2_encoder *encoder,
+		     struct v4l2_encoder_buffer *capture_buffer)
+{
+	unsigned int size = capture_buffer->buffer.m.planes[0].bytesused;
+	unsigned int offset = 0;
+	ssize_t count;
 
-	encoder->gop_index++;
-	encoder->gop_index %= encoder->setup.gop_size;
+	PROBE3(bitstream_write, capture_buffer->frame_num,
+	       capture_buffer->buffer.index, size);
+
+	if (encoder->bitstream_fd < 0)
+		return 0;
+
+	while (offset < size) {
+		count = write(encoder->bitstream_fd,
+			      capture_buffer->mmap_data[0] + offset,
+			      size - offset);
+		if (count < 0 && errno == EINTR)
+			continue;
+
+		if (count <= 0) {
+			fprintf(stderr, "Failed to write bitstream\n");
+			return count ? -errno : -EIO;
+		}
+
+		offset += count;
+	}
 
 	return 0;
 }
@@ -271,20 +298,95 @@ int h264_prepare(struct v4l2_encoder *encoder)
 	encode_rc->mad_threshold = 0;
 	encode_rc->mad_qp_delta = 0;
 
+	/* GOP */
+
+	/* Advance at prepare time so that the next frame can be prepared
+	 * before this one completes. */
+	encoder->gop_index++;
+	encoder->gop_index %= encoder->setup.gop_size;
+
 	return 0;
 }
 
+/* Coded pictures never exceed the raw picture size divided by MinCR, which
+ * is 4 for levels 3.1 to 4 and 2 otherwise (table A-1). */
+unsigned int h264_capture_size_max(struct v4l2_encoder *encoder)
+{
+	unsigned int macroblocks = encoder->setup.width_mbs *
+				   encoder->setup.height_mbs;
+	unsigned int min_cr;
+	unsigned int size;
+
+	if (H264_LEVEL_IDC >= 31 && H264_LEVEL_IDC <= 40)
+		min_cr = 4;
+	else
+		min_cr = 2;
+
+	/* 384 bytes per 4:2:0 macroblock, with room for the slice header. */
+	size = macroblocks * 384 / min_cr + 1024;
+
+	return (size + 4095) & ~4095;
+}
+
+/* Intra frames take a large share of the GOP budget, twice that budget
+ * leaves room for rate control overshoot. */
+unsigned int h264_capture_size(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_setup *setup = &encoder->setup;
+	unsigned int size_max = h264_capture_size_max(encoder);
+	uint64_t size;
+
+	size = setup->bitrate * setup->fps_den / setup->fps_num;
+	size = size * setup->gop_size / 8 * 2;
+	size = (size + 4095) & ~4095;
+
+	if (size > size_max)
+		return size_max;
+
+	return size;
+}
+
+static void h264_parameter_sets_write(struct v4l2_encoder *encoder)
+{
+	struct bitstream *bitstream;
+	struct unit *unit;
+
+	bitstream = bitstream_create();
+
+	/* Bitstream SPS */
+
+	bitstream_sps(bitstream, encoder);
+
+	unit = unit_pack(bitstream);
+
+	if (encoder->bitstream_fd >= 0)
+		write(encoder->bitstream_fd, unit->buffer, unit->length);
+
+	unit_destroy(unit);
+
+	/* Bitstream PPS */
+
+	bitstream_pps(bitstream, encoder);
+
+	unit = unit_pack(bitstream);
+
+	if (encoder->bitstream_fd >= 0)
+		write(encoder->bitstream_fd, unit->buffer, unit->length);
+
+	unit_destroy(unit);
+
+	bitstream_destroy(bitstream);
+}
+
 int h264_setup(struct v4l2_encoder *encoder)
 {
 	struct v4l2_ctrl_h264_sps *sps = &encoder->sps;
 	struct v4l2_ctrl_h264_pps *pps = &encoder->pps;
-	struct bitstream *bitstream;
-	struct unit *unit;
 
 	/* SPS */
 
 	sps->profile_idc = 100;
-	sps->level_idc = 31;
+	sps->level_idc = H264_LEVEL_IDC;
 	sps->seq_parameter_set_id = 0;
 	sps->chroma_format_idc = 1; /* YUV 4:2:0 */
 
@@ -317,37 +419,29 @@ int h264_setup(struct v4l2_encoder *encoder)
 
 	/* Bitstream */
 
-	bitstream = bitstream_create();
-
-	/* Bitstream SPS */
-
-	bitstream_sps(bitstream, encoder);
+	h264_parameter_sets_write(encoder);
 
-	unit = unit_pack(bitstream);
-
-	if (encoder->bitstream_fd >= 0)
-		write(encoder->bitstream_fd, unit->buffer, unit->length);
-
-	unit_destroy(unit);
-
-	/* Bitstream PPS */
-
-	bitstream_pps(bitstream, encoder);
+	/* Rate control */
 
-	unit = unit_pack(bitstream);
+	h264_rate_control_setup(encoder);
 
-	if (encoder->bitstream_fd >= 0)
-		write(encoder->bitstream_fd, unit->buffer, unit->length);
+	return 0;
+}
 
-	unit_destroy(unit);
+/* The new parameter sets directly precede the IDR frame that uses them, since
+ * nothing is in flight when reconfiguring. */
+int h264_reconfigure(struct v4l2_encoder *encoder)
+{
+	struct v4l2_ctrl_h264_sps *sps = &encoder->sps;
 
-	bitstream_destroy(bitstream);
+	sps->pic_width_in_mbs_minus1 = encoder->setup.width_mbs - 1;
+	sps->pic_height_in_map_units_minus1 = encoder->setup.height_mbs - 1;
 
-	/* Rate control */
+	h264_parameter_sets_write(encoder);
 
-	h264_rate_control_setup(encoder);
+	encoder->gop_index = 0;
 
-	return 0;
+	return h264_rate_control_reconfigure(encoder);
 }
 
 int h264_teardown(struct v4l2_encoder *encoder)
@@ -8,8 +8,13 @@
 #include <v4l2-encoder.h>
 
 int h264_complete(struct v4l2_encoder *encoder);
+int h264_slice_write(struct v4l2_encoder *encoder,
+		     struct v4l2_encoder_buffer *capture_buffer);
 int h264_prepare(struct v4l2_encoder *encoder);
+unsigned int h264_capture_size_max(struct v4l2_encoder *encoder);
+unsigned int h264_capture_size(struct v4l2_encoder *encoder);
 int h264_setup(struct v4l2_encoder *encoder);
+int h264_reconfigure(struct v4l2_encoder *encoder);
 int h264_teardown(struct v4l2_encoder *encoder);
 
 #endif
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <histogram.h>
+
+static unsigned int histogram_bucket(uint64_t value)
+{
+	unsigned int shift;
+	unsigned int msb;
+
+	if (value < HISTOGRAM_SUB_COUNT)
+		return value;
+
+	msb = 63 - __builtin_clzll(value);
+	shift = msb - HISTOGRAM_SUB_BITS;
+
+	return (shift + 1) * HISTOGRAM_SUB_COUNT +
+	       (value >> shift) - HISTOGRAM_SUB_COUNT;
+}
+
+/* Highest value that falls in the bucket. */
+static uint64_t histogram_bucket_value(unsigned int bucket)
+{
+	unsigned int shift;
+	uint64_t value;
+
+	if (bucket < HISTOGRAM_SUB_COUNT)
+		return bucket;
+
+	shift = bucket / HISTOGRAM_SUB_COUNT - 1;
+	value = (uint64_t)(bucket % HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_COUNT)
+		<< shift;
+
+	return value + ((1ULL << shift) - 1);
+}
+
+void histogram_record(struct histogram *histogram, uint64_t value)
+{
+	uint64_t max;
+
+	atomic_fetch_add_explicit(&histogram->buckets[histogram_bucket(value)],
+				  1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&histogram->sum, value,
+				  memory_order_relaxed);
+	atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+
+	max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+	while (value > max &&
+	       !atomic_compare_exchange_weak_explicit(&histogram->max, &max,
+						      value,
+						      memory_order_relaxed,
+						      memory_order_relaxed))
+		continue;
+}
+
+uint64_t histogram_count(struct histogram *histogram)
+{
+	return atomic_load_explicit(&histogram->count, memory_order_relaxed);
+}
+
+uint64_t histogram_mean(struct histogram *histogram)
+{
+	uint64_t count = histogram_count(histogram);
+
+	if (!count)
+		return 0;
+
+	return atomic_load_explicit(&histogram->sum, memory_order_relaxed) /
+	       count;
+}
+
+uint64_t histogram_max(struct histogram *histogram)
+{
+	return atomic_load_explicit(&histogram->max, memory_order_relaxed);
+}
+
+/* Buckets are summed as they are read, so the total may lag behind values
+ * recorded meanwhile. */
+uint64_t histogram_percentile(struct histogram *histogram, double percentile)
+{
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t total = 0;
+	uint64_t target;
+	uint64_t sum = 0;
+	uint64_t value;
+	unsigned int i;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		counts[i] = atomic_load_explicit(&histogram->buckets[i],
+						 memory_order_relaxed);
+		total += counts[i];
+	}
+
+	if (!total)
+		return 0;
+
+	target = total * percentile / 100.0;
+	if (target < 1)
+		target = 1;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		sum += counts[i];
+		if (sum >= target)
+			break;
+	}
+
+	if (i == HISTOGRAM_BUCKETS)
+		i--;
+
+	value = histogram_bucket_value(i);
+
+	/* Never report above what was actually recorded. */
+	if (value > histogram_max(histogram))
+		return histogram_max(histogram);
+
+	return value;
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Log-linear buckets: 16 linear steps per power of two, so that any
+ * recorded value is known within 1/16 of itself. */
+#define HISTOGRAM_SUB_BITS	4
+#define HISTOGRAM_SUB_COUNT	(1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS	((64 - HISTOGRAM_SUB_BITS + 1) * \
+				 HISTOGRAM_SUB_COUNT)
+
+/* Values are recorded without locks from any thread. */
+struct histogram {
+	atomic_uint_fast64_t buckets[HISTOGRAM_BUCKETS];
+	atomic_uint_fast64_t count;
+	atomic_uint_fast64_t sum;
+	atomic_uint_fast64_t max;
+};
+
+void histogram_record(struct histogram *histogram, uint64_t value);
+uint64_t histogram_count(struct histogram *histogram);
+uint64_t histogram_mean(struct histogram *histogram);
+uint64_t histogram_max(struct histogram *histogram);
+uint64_t histogram_percentile(struct histogram *histogram, double percentile);
+
+#endif
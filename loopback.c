@@ -0,0 +1,1360 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include <linux/videodev2.h>
+#include <linux/media.h>
+
+#include <v4l2.h>
+#include <loopback.h>
+
+#define LOOPBACK_FILES_MAX	256
+
+/* Fds handed out by loopback instances, looked up on every call. */
+struct loopback_file {
+	int fd;
+	struct loopback *loopback;
+	struct loopback_request *request;
+};
+
+static struct loopback_file loopback_files[LOOPBACK_FILES_MAX];
+static atomic_uint loopback_files_count;
+static pthread_mutex_t loopback_files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t loopback_cores_time[LOOPBACK_CORES_MAX];
+static pthread_mutex_t loopback_cores_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t loopback_time(void)
+{
+	struct timespec timespec;
+
+	clock_gettime(CLOCK_MONOTONIC, &timespec);
+
+	return timespec.tv_sec * 1000000000ULL + timespec.tv_nsec;
+}
+
+static int loopback_file_register(int fd, struct loopback *loopback,
+				  struct loopback_request *request)
+{
+	unsigned int i;
+	int ret = -ENOMEM;
+
+	pthread_mutex_lock(&loopback_files_lock);
+
+	for (i = 0; i < LOOPBACK_FILES_MAX; i++) {
+		if (loopback_files[i].loopback)
+			continue;
+
+		loopback_files[i].fd = fd;
+		loopback_files[i].loopback = loopback;
+		loopback_files[i].request = request;
+
+		atomic_fetch_add(&loopback_files_count, 1);
+		ret = 0;
+		break;
+	}
+
+	pthread_mutex_unlock(&loopback_files_lock);
+
+	return ret;
+}
+
+static void loopback_file_unregister(int fd)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&loopback_files_lock);
+
+	for (i = 0; i < LOOPBACK_FILES_MAX; i++) {
+		if (!loopback_files[i].loopback || loopback_files[i].fd != fd)
+			continue;
+
+		memset(&loopback_files[i], 0, sizeof(loopback_files[i]));
+
+		atomic_fetch_sub(&loopback_files_count, 1);
+		break;
+	}
+
+	pthread_mutex_unlock(&loopback_files_lock);
+}
+
+static bool loopback_file_find(int fd, struct loopback_file *file)
+{
+	bool found = false;
+	unsigned int i;
+
+	/* Keep the real hardware path free of any locking. */
+	if (!atomic_load(&loopback_files_count))
+		return false;
+
+	pthread_mutex_lock(&loopback_files_lock);
+
+	for (i = 0; i < LOOPBACK_FILES_MAX; i++) {
+		if (!loopback_files[i].loopback || loopback_files[i].fd != fd)
+			continue;
+
+		*file = loopback_files[i];
+		found = true;
+		break;
+	}
+
+	pthread_mutex_unlock(&loopback_files_lock);
+
+	return found;
+}
+
+/* Arm a timer fd to become readable at an absolute time, 0 disarms it. */
+static void loopback_timer_set(int fd, uint64_t time)
+{
+	struct itimerspec itimerspec = { 0 };
+
+	itimerspec.it_value.tv_sec = time / 1000000000ULL;
+	itimerspec.it_value.tv_nsec = time % 1000000000ULL;
+
+	timerfd_settime(fd, TFD_TIMER_ABSTIME, &itimerspec, NULL);
+}
+
+static void loopback_fifo_push(unsigned int *fifo, unsigned int *index,
+			       unsigned int *count, unsigned int value)
+{
+	fifo[(*index + *count) % LOOPBACK_BUFFERS_MAX] = value;
+	(*count)++;
+}
+
+static unsigned int loopback_fifo_pop(unsigned int *fifo, unsigned int *index,
+				      unsigned int *count)
+{
+	unsigned int value = fifo[*index];
+
+	*index = (*index + 1) % LOOPBACK_BUFFERS_MAX;
+	(*count)--;
+
+	return value;
+}
+
+static struct loopback_queue *loopback_queue_get(struct loopback *loopback,
+						 unsigned int type)
+{
+	if (type == loopback->output.type)
+		return &loopback->output;
+	else if (type == loopback->capture.type)
+		return &loopback->capture;
+
+	return NULL;
+}
+
+static unsigned int loopback_macroblocks(struct loopback *loopback)
+{
+	struct v4l2_pix_format_mplane *pix_mp =
+		&loopback->output.format.fmt.pix_mp;
+
+	return ((pix_mp->width + 15) / 16) * ((pix_mp->height + 15) / 16);
+}
+
+static void loopback_video_timer_update(struct loopback *loopback)
+{
+	if (loopback->output.done_count || loopback->capture.done_count)
+		loopback_timer_set(loopback->video_fd, 1);
+	else if (loopback->jobs && loopback->jobs->started)
+		loopback_timer_set(loopback->video_fd,
+				   loopback->jobs->complete_time);
+	else
+		loopback_timer_set(loopback->video_fd, 0);
+}
+
+/* Produce a slice NAL unit sized after a rough bits per macroblock model.
+ * The payload is filler that is not meant to be decoded. */
+static void loopback_encode(struct loopback *loopback,
+			    struct loopback_request *request)
+{
+	struct loopback_buffer *capture_buffer = request->capture_buffer;
+	struct v4l2_ctrl_h264_encode_feedback *encode_feedback =
+		&request->encode_feedback;
+	unsigned int macroblocks = loopback_macroblocks(loopback);
+	bool intra = request->encode_params.slice_type ==
+		     V4L2_H264_SLICE_TYPE_I;
+	unsigned int qp = request->encode_rc.qp;
+	uint8_t *data = capture_buffer->planes_data[0];
+	uint32_t seed = request->encode_params.frame_num + 1;
+	unsigned int size;
+	double bits;
+	unsigned int i;
+
+	if (qp > 51)
+		qp = 51;
+
+	bits = 8. * exp2((51. - qp) / 6.) * macroblocks;
+	if (intra)
+		bits *= 4;
+
+	size = bits / 8;
+	if (size < 8)
+		size = 8;
+	/* Slices that do not fit are truncated and flagged. */
+	if (size > capture_buffer->planes_length[0]) {
+		size = capture_buffer->planes_length[0];
+		capture_buffer->error = true;
+	}
+
+	/* Start code and NALU header */
+	data[0] = 0;
+	data[1] = 0;
+	data[2] = 0;
+	data[3] = 1;
+	data[4] = (3 << 5) | (intra ? 5 : 1);
+
+	/* Avoid zero bytes so that no start code is emulated. */
+	for (i = 5; i < size - 1; i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = (seed >> 16) | 1;
+	}
+
+	data[size - 1] = 0x80;
+
+	capture_buffer->bytesused = size;
+
+	encode_feedback->qp_sum = qp * macroblocks;
+	encode_feedback->rlc_count = size * 8 / 4;
+}
+
+static void loopback_job_complete(struct loopback *loopback,
+				  struct loopback_request *request)
+{
+	struct loopback_buffer *output_buffer = request->output_buffer;
+	struct loopback_buffer *capture_buffer = request->capture_buffer;
+
+	loopback_encode(loopback, request);
+
+	capture_buffer->timestamp = output_buffer->timestamp;
+
+	output_buffer->done = true;
+	loopback_fifo_push(loopback->output.done, &loopback->output.done_index,
+			   &loopback->output.done_count, output_buffer->index);
+
+	capture_buffer->done = true;
+	loopback_fifo_push(loopback->capture.done,
+			   &loopback->capture.done_index,
+			   &loopback->capture.done_count, capture_buffer->index);
+
+	request->output_buffer = NULL;
+	request->capture_buffer = NULL;
+	request->complete = true;
+}
+
+static void loopback_schedule(struct loopback *loopback, uint64_t time)
+{
+	struct loopback_queue *capture = &loopback->capture;
+	struct loopback_request *request;
+	unsigned int index;
+	uint64_t *core_time;
+	uint64_t duration;
+
+	if (!loopback->output.streaming || !capture->streaming)
+		return;
+
+	for (request = loopback->jobs; request; request = request->job_next) {
+		if (request->started)
+			continue;
+
+		/* Jobs start in order, each with the next capture buffer. */
+		if (!capture->ready_count)
+			break;
+
+		index = loopback_fifo_pop(capture->ready, &capture->ready_index,
+					  &capture->ready_count);
+		request->capture_buffer = &capture->buffers[index];
+
+		duration = loopback->setup.latency +
+			   loopback->setup.latency_mb *
+			   loopback_macroblocks(loopback);
+
+		if (request->encode_params.slice_type == V4L2_H264_SLICE_TYPE_I)
+			duration = duration * loopback->setup.intra_cost / 100;
+
+		pthread_mutex_lock(&loopback_cores_lock);
+
+		core_time = &loopback_cores_time[loopback->setup.core];
+		if (*core_time < time)
+			*core_time = time;
+
+		*core_time += duration;
+		request->complete_time = *core_time;
+
+		pthread_mutex_unlock(&loopback_cores_lock);
+
+		request->started = true;
+
+		loopback_timer_set(request->fd, request->complete_time);
+	}
+
+	loopback_video_timer_update(loopback);
+}
+
+static void loopback_update(struct loopback *loopback, uint64_t time)
+{
+	struct loopback_request *request;
+
+	while (loopback->jobs && loopback->jobs->started &&
+	       loopback->jobs->complete_time <= time) {
+		request = loopback->jobs;
+		loopback->jobs = request->job_next;
+		request->job_next = NULL;
+
+		loopback_job_complete(loopback, request);
+	}
+
+	loopback_video_timer_update(loopback);
+}
+
+static void loopback_jobs_cancel(struct loopback *loopback)
+{
+	struct loopback_request *request;
+
+	while (loopback->jobs) {
+		request = loopback->jobs;
+		loopback->jobs = request->job_next;
+
+		request->job_next = NULL;
+		request->output_buffer = NULL;
+		request->capture_buffer = NULL;
+		request->complete = true;
+
+		loopback_timer_set(request->fd, 1);
+	}
+}
+
+static struct loopback_request *loopback_request_find(struct loopback *loopback,
+						      int fd)
+{
+	struct loopback_request *request;
+
+	for (request = loopback->requests; request; request = request->next)
+		if (request->fd == fd)
+			return request;
+
+	return NULL;
+}
+
+static void loopback_request_destroy(struct loopback *loopback,
+				     struct loopback_request *request)
+{
+	struct loopback_request **link;
+
+	for (link = &loopback->jobs; *link; link = &(*link)->job_next) {
+		if (*link == request) {
+			*link = request->job_next;
+			break;
+		}
+	}
+
+	for (link = &loopback->requests; *link; link = &(*link)->next) {
+		if (*link == request) {
+			*link = request->next;
+			break;
+		}
+	}
+
+	loopback_file_unregister(request->fd);
+	close(request->fd);
+
+	free(request);
+}
+
+static void loopback_format_adjust(struct loopback_queue *queue,
+				   struct v4l2_format *format)
+{
+	struct v4l2_pix_format_mplane *pix_mp = &format->fmt.pix_mp;
+	unsigned int width, height;
+	unsigned int stride;
+
+	if (pix_mp->width < 16)
+		pix_mp->width = 16;
+	if (pix_mp->height < 16)
+		pix_mp->height = 16;
+	if (pix_mp->width > 4096)
+		pix_mp->width = 4096;
+	if (pix_mp->height > 4096)
+		pix_mp->height = 4096;
+
+	width = (pix_mp->width + 15) & ~15;
+	height = (pix_mp->height + 15) & ~15;
+	stride = width;
+
+	format->type = queue->type;
+	pix_mp->field = V4L2_FIELD_NONE;
+
+	if (queue->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+		pix_mp->pixelformat = V4L2_PIX_FMT_H264_SLICE;
+		pix_mp->num_planes = 1;
+		pix_mp->plane_fmt[0].bytesperline = 0;
+
+		if (!pix_mp->plane_fmt[0].sizeimage)
+			pix_mp->plane_fmt[0].sizeimage = width * height * 3 / 4;
+		if (pix_mp->plane_fmt[0].sizeimage < 4096)
+			pix_mp->plane_fmt[0].sizeimage = 4096;
+
+		return;
+	}
+
+	switch (pix_mp->pixelformat) {
+	case V4L2_PIX_FMT_YUV420M:
+		pix_mp->num_planes = 3;
+		pix_mp->plane_fmt[0].bytesperline = stride;
+		pix_mp->plane_fmt[0].sizeimage = stride * height;
+		pix_mp->plane_fmt[1].bytesperline = stride / 2;
+		pix_mp->plane_fmt[1].sizeimage = stride * height / 4;
+		pix_mp->plane_fmt[2].bytesperline = stride / 2;
+		pix_mp->plane_fmt[2].sizeimage = stride * height / 4;
+		break;
+	default:
+		pix_mp->pixelformat = V4L2_PIX_FMT_NV12M;
+		pix_mp->num_planes = 2;
+		pix_mp->plane_fmt[0].bytesperline = stride;
+		pix_mp->plane_fmt[0].sizeimage = stride * height;
+		pix_mp->plane_fmt[1].bytesperline = stride;
+		pix_mp->plane_fmt[1].sizeimage = stride * height / 2;
+		break;
+	}
+}
+
+static void loopback_buffer_free(struct loopback_buffer *buffer)
+{
+	unsigned int i;
+
+	for (i = 0; i < buffer->planes_count; i++) {
+		if (buffer->planes_data[i])
+			munmap(buffer->planes_data[i], buffer->planes_length[i]);
+
+		if (buffer->planes_fd[i] >= 0)
+			close(buffer->planes_fd[i]);
+	}
+
+	memset(buffer, 0, sizeof(*buffer));
+}
+
+static void loopback_buffers_free(struct loopback_queue *queue)
+{
+	unsigned int i;
+
+	for (i = 0; i < queue->buffers_count; i++)
+		loopback_buffer_free(&queue->buffers[i]);
+
+	queue->buffers_count = 0;
+	queue->ready_index = 0;
+	queue->ready_count = 0;
+	queue->done_index = 0;
+	queue->done_count = 0;
+}
+
+static int loopback_buffer_alloc(struct loopback_queue *queue,
+				 struct v4l2_format *format, unsigned int index)
+{
+	struct v4l2_pix_format_mplane *pix_mp = &format->fmt.pix_mp;
+	struct loopback_buffer *buffer = &queue->buffers[index];
+	unsigned int length;
+	unsigned int i;
+
+	buffer->index = index;
+	buffer->planes_count = pix_mp->num_planes;
+
+	for (i = 0; i < buffer->planes_count; i++) {
+		buffer->planes_fd[i] = -1;
+		buffer->planes_length[i] = pix_mp->plane_fmt[i].sizeimage;
+	}
+
+	/* Imported planes are never touched. */
+	if (queue->memory != V4L2_MEMORY_MMAP)
+		return 0;
+
+	/* Planes are backed by memfds so that mappings work as usual. */
+	for (i = 0; i < buffer->planes_count; i++) {
+		length = pix_mp->plane_fmt[i].sizeimage;
+
+		buffer->planes_fd[i] = memfd_create("loopback", MFD_CLOEXEC);
+		if (buffer->planes_fd[i] < 0)
+			return -errno;
+
+		if (ftruncate(buffer->planes_fd[i], length))
+			return -errno;
+
+		buffer->planes_data[i] = mmap(NULL, length,
+					      PROT_READ | PROT_WRITE,
+					      MAP_SHARED, buffer->planes_fd[i],
+					      0);
+		if (buffer->planes_data[i] == MAP_FAILED) {
+			buffer->planes_data[i] = NULL;
+			return -errno;
+		}
+
+		buffer->planes_length[i] = length;
+	}
+
+	return 0;
+}
+
+static int loopback_buffers_alloc(struct loopback_queue *queue,
+				  struct v4l2_format *format, unsigned int count)
+{
+	int ret;
+
+	if (count > LOOPBACK_BUFFERS_MAX)
+		count = LOOPBACK_BUFFERS_MAX;
+
+	for (; queue->buffers_count < count; queue->buffers_count++) {
+		ret = loopback_buffer_alloc(queue, format, queue->buffers_count);
+		if (ret) {
+			/* Account for the partial buffer so that it gets
+			 * freed. */
+			queue->buffers_count++;
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static unsigned int loopback_buffers_capabilities(struct loopback_queue *queue)
+{
+	unsigned int capabilities = V4L2_BUF_CAP_SUPPORTS_MMAP |
+				    V4L2_BUF_CAP_SUPPORTS_REMOVE_BUFS;
+
+	if (queue->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+		capabilities |= V4L2_BUF_CAP_SUPPORTS_DMABUF |
+				V4L2_BUF_CAP_SUPPORTS_USERPTR |
+				V4L2_BUF_CAP_SUPPORTS_REQUESTS;
+
+	return capabilities;
+}
+
+static off_t loopback_buffer_offset(struct loopback_queue *queue,
+				    unsigned int index, unsigned int plane)
+{
+	unsigned int id = queue->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+
+	return ((id * LOOPBACK_BUFFERS_MAX + index) * VIDEO_MAX_PLANES +
+		plane) * sysconf(_SC_PAGESIZE);
+}
+
+static void loopback_buffer_fill(struct loopback_queue *queue,
+				 struct loopback_buffer *buffer,
+				 struct v4l2_buffer *v4l2_buffer)
+{
+	unsigned int i;
+
+	v4l2_buffer->index = buffer->index;
+	v4l2_buffer->length = buffer->planes_count;
+	v4l2_buffer->field = V4L2_FIELD_NONE;
+	v4l2_buffer->flags = V4L2_BUF_FLAG_TIMESTAMP_COPY;
+
+	if (buffer->queued)
+		v4l2_buffer->flags |= V4L2_BUF_FLAG_QUEUED;
+	if (buffer->done)
+		v4l2_buffer->flags |= V4L2_BUF_FLAG_DONE;
+	if (buffer->error)
+		v4l2_buffer->flags |= V4L2_BUF_FLAG_ERROR;
+
+	v4l2_buffer->timestamp.tv_sec = buffer->timestamp / 1000000000ULL;
+	v4l2_buffer->timestamp.tv_usec =
+		(buffer->timestamp % 1000000000ULL) / 1000;
+
+	for (i = 0; i < buffer->planes_count; i++) {
+		struct v4l2_plane *plane = &v4l2_buffer->m.planes[i];
+
+		plane->length = buffer->planes_length[i];
+
+		if (queue->memory == V4L2_MEMORY_MMAP)
+			plane->m.mem_offset =
+				loopback_buffer_offset(queue, buffer->index, i);
+
+		if (queue->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+			plane->bytesused = buffer->bytesused;
+		else
+			plane->bytesused = buffer->planes_length[i];
+	}
+}
+
+static struct loopback_buffer *loopback_buffer_get(struct loopback *loopback,
+						   struct v4l2_buffer *v4l2_buffer,
+						   struct loopback_queue **queue)
+{
+	*queue = loopback_queue_get(loopback, v4l2_buffer->type);
+	if (!*queue)
+		return NULL;
+
+	if (v4l2_buffer->index >= (*queue)->buffers_count ||
+	    !(*queue)->buffers[v4l2_buffer->index].planes_count)
+		return NULL;
+
+	if (!v4l2_buffer->m.planes ||
+	    v4l2_buffer->length < (*queue)->buffers[v4l2_buffer->index].planes_count)
+		return NULL;
+
+	return &(*queue)->buffers[v4l2_buffer->index];
+}
+
+static int loopback_controls(struct loopback_request *request,
+			     struct v4l2_ext_controls *ext_controls, bool set,
+			     bool try)
+{
+	struct v4l2_ext_control *control;
+	void *data;
+	unsigned int size;
+	unsigned int i;
+
+	for (i = 0; i < ext_controls->count; i++) {
+		control = &ext_controls->controls[i];
+
+		switch (control->id) {
+		case V4L2_CID_STATELESS_H264_ENCODE_PARAMS:
+			data = &request->encode_params;
+			size = sizeof(request->encode_params);
+			break;
+		case V4L2_CID_STATELESS_H264_ENCODE_RC:
+			data = &request->encode_rc;
+			size = sizeof(request->encode_rc);
+			break;
+		case V4L2_CID_STATELESS_H264_ENCODE_FEEDBACK:
+			/* Read-only, filled by the hardware. */
+			if (set) {
+				ext_controls->error_idx = i;
+				return -EACCES;
+			}
+
+			data = &request->encode_feedback;
+			size = sizeof(request->encode_feedback);
+			break;
+		default:
+			ext_controls->error_idx = i;
+			return -EINVAL;
+		}
+
+		if (control->size != size || !control->ptr) {
+			ext_controls->error_idx = i;
+			return -EINVAL;
+		}
+
+		if (try)
+			continue;
+
+		if (set)
+			memcpy(data, control->ptr, size);
+		else
+			memcpy(control->ptr, data, size);
+	}
+
+	return 0;
+}
+
+static int loopback_ext_controls(struct loopback *loopback,
+				 struct v4l2_ext_controls *ext_controls,
+				 bool set, bool try)
+{
+	struct loopback_request *request;
+
+	/* Controls are only meaningful as part of a request. */
+	if (ext_controls->which != V4L2_CTRL_WHICH_REQUEST_VAL)
+		return try ? 0 : -EINVAL;
+
+	request = loopback_request_find(loopback, ext_controls->request_fd);
+	if (!request)
+		return -EINVAL;
+
+	if (set && !try && request->queued)
+		return -EBUSY;
+
+	if (!set && !request->complete)
+		return -EACCES;
+
+	return loopback_controls(request, ext_controls, set, try);
+}
+
+static int loopback_video_ioctl(struct loopback *loopback,
+				unsigned long request, void *data,
+				uint64_t time)
+{
+	struct loopback_queue *queue;
+	struct loopback_buffer *buffer;
+	struct loopback_request *loopback_request;
+	int ret;
+
+	switch (request) {
+	case VIDIOC_QUERYCAP: {
+		struct v4l2_capability *capability = data;
+
+		memset(capability, 0, sizeof(*capability));
+		strncpy((char *)capability->driver, "loopback",
+			sizeof(capability->driver) - 1);
+		strncpy((char *)capability->card, "Loopback H.264 encoder",
+			sizeof(capability->card) - 1);
+		strncpy((char *)capability->bus_info, "platform:loopback",
+			sizeof(capability->bus_info) - 1);
+
+		capability->device_caps = V4L2_CAP_VIDEO_M2M_MPLANE |
+					  V4L2_CAP_STREAMING;
+		capability->capabilities = capability->device_caps |
+					   V4L2_CAP_DEVICE_CAPS;
+
+		return 0;
+	}
+	case VIDIOC_ENUM_FMT: {
+		struct v4l2_fmtdesc *fmtdesc = data;
+		static const uint32_t output_formats[] = {
+			V4L2_PIX_FMT_NV12M,
+			V4L2_PIX_FMT_YUV420M,
+		};
+
+		if (fmtdesc->type == loopback->capture.type &&
+		    fmtdesc->index == 0)
+			fmtdesc->pixelformat = V4L2_PIX_FMT_H264_SLICE;
+		else if (fmtdesc->type == loopback->output.type &&
+			 fmtdesc->index < 2)
+			fmtdesc->pixelformat = output_formats[fmtdesc->index];
+		else
+			return -EINVAL;
+
+		return 0;
+	}
+	case VIDIOC_G_FMT:
+	case VIDIOC_S_FMT:
+	case VIDIOC_TRY_FMT: {
+		struct v4l2_format *format = data;
+
+		queue = loopback_queue_get(loopback, format->type);
+		if (!queue)
+			return -EINVAL;
+
+		if (request == VIDIOC_G_FMT) {
+			*format = queue->format;
+			return 0;
+		}
+
+		loopback_format_adjust(queue, format);
+
+		if (request == VIDIOC_S_FMT) {
+			if (queue->buffers_count)
+				return -EBUSY;
+
+			queue->format = *format;
+		}
+
+		return 0;
+	}
+	case VIDIOC_REQBUFS: {
+		struct v4l2_requestbuffers *requestbuffers = data;
+
+		queue = loopback_queue_get(loopback, requestbuffers->type);
+		if (!queue)
+			return -EINVAL;
+
+		if (requestbuffers->memory != V4L2_MEMORY_MMAP &&
+		    ((requestbuffers->memory != V4L2_MEMORY_DMABUF &&
+		      requestbuffers->memory != V4L2_MEMORY_USERPTR) ||
+		     queue != &loopback->output))
+			return -EINVAL;
+
+		if (queue->streaming)
+			return -EBUSY;
+
+		loopback_buffers_free(queue);
+
+		queue->memory = requestbuffers->memory;
+
+		ret = loopback_buffers_alloc(queue, &queue->format,
+					     requestbuffers->count);
+		if (ret) {
+			loopback_buffers_free(queue);
+			return ret;
+		}
+
+		requestbuffers->count = queue->buffers_count;
+		requestbuffers->capabilities =
+			loopback_buffers_capabilities(queue);
+
+		return 0;
+	}
+	case VIDIOC_CREATE_BUFS: {
+		struct v4l2_create_buffers *create_buffers = data;
+		unsigned int i, j;
+
+		queue = loopback_queue_get(loopback,
+					   create_buffers->format.type);
+		if (!queue)
+			return -EINVAL;
+
+		if (create_buffers->count &&
+		    create_buffers->memory != queue->memory)
+			return -EINVAL;
+
+		create_buffers->capabilities =
+			loopback_buffers_capabilities(queue);
+		create_buffers->index = queue->buffers_count;
+
+		if (!create_buffers->count)
+			return 0;
+
+		/* Buffers may be sized differently from the current format. */
+		if (create_buffers->format.fmt.pix_mp.num_planes !=
+		    queue->format.fmt.pix_mp.num_planes ||
+		    !create_buffers->format.fmt.pix_mp.plane_fmt[0].sizeimage)
+			return -EINVAL;
+
+		/* Holes left by removed buffers are filled first. */
+		for (i = 0, j = 0; i < queue->buffers_count; i++) {
+			j = queue->buffers[i].planes_count ? 0 : j + 1;
+			if (j == create_buffers->count)
+				break;
+		}
+
+		if (i < queue->buffers_count) {
+			create_buffers->index = i + 1 - j;
+
+			for (i = create_buffers->index; j; i++, j--) {
+				ret = loopback_buffer_alloc(queue,
+							    &create_buffers->format,
+							    i);
+				if (ret) {
+					loopback_buffer_free(&queue->buffers[i]);
+					return ret;
+				}
+			}
+
+			return 0;
+		}
+
+		ret = loopback_buffers_alloc(queue, &create_buffers->format,
+					     queue->buffers_count +
+					     create_buffers->count);
+		if (ret)
+			return ret;
+
+		create_buffers->count = queue->buffers_count -
+					create_buffers->index;
+
+		return 0;
+	}
+	case VIDIOC_REMOVE_BUFS: {
+		struct v4l2_remove_buffers *remove_buffers = data;
+		unsigned int i;
+
+		queue = loopback_queue_get(loopback, remove_buffers->type);
+		if (!queue)
+			return -EINVAL;
+
+		if (!remove_buffers->count)
+			return 0;
+
+		if (remove_buffers->index + remove_buffers->count >
+		    queue->buffers_count)
+			return -EINVAL;
+
+		for (i = 0; i < remove_buffers->count; i++)
+			if (queue->buffers[remove_buffers->index + i].queued)
+				return -EBUSY;
+
+		for (i = 0; i < remove_buffers->count; i++)
+			loopback_buffer_free(&queue->buffers[remove_buffers->index + i]);
+
+		while (queue->buffers_count &&
+		       !queue->buffers[queue->buffers_count - 1].planes_count)
+			queue->buffers_count--;
+
+		return 0;
+	}
+	case VIDIOC_QUERYBUF: {
+		struct v4l2_buffer *v4l2_buffer = data;
+
+		buffer = loopback_buffer_get(loopback, v4l2_buffer, &queue);
+		if (!buffer)
+			return -EINVAL;
+
+		loopback_buffer_fill(queue, buffer, v4l2_buffer);
+
+		return 0;
+	}
+	case VIDIOC_EXPBUF: {
+		struct v4l2_exportbuffer *exportbuffer = data;
+		int fd;
+
+		queue = loopback_queue_get(loopback, exportbuffer->type);
+		if (!queue || queue->memory != V4L2_MEMORY_MMAP ||
+		    exportbuffer->index >= queue->buffers_count)
+			return -EINVAL;
+
+		buffer = &queue->buffers[exportbuffer->index];
+		if (exportbuffer->plane >= buffer->planes_count)
+			return -EINVAL;
+
+		fd = fcntl(buffer->planes_fd[exportbuffer->plane],
+			   (exportbuffer->flags & O_CLOEXEC) ?
+			   F_DUPFD_CLOEXEC : F_DUPFD, 0);
+		if (fd < 0)
+			return -errno;
+
+		exportbuffer->fd = fd;
+
+		return 0;
+	}
+	case VIDIOC_QBUF: {
+		struct v4l2_buffer *v4l2_buffer = data;
+
+		buffer = loopback_buffer_get(loopback, v4l2_buffer, &queue);
+		if (!buffer || v4l2_buffer->memory != queue->memory)
+			return -EINVAL;
+
+		if (buffer->queued)
+			return -EBUSY;
+
+		buffer->error = false;
+
+		if (queue->memory == V4L2_MEMORY_DMABUF) {
+			unsigned int i;
+
+			for (i = 0; i < buffer->planes_count; i++)
+				if (fcntl(v4l2_buffer->m.planes[i].m.fd,
+					  F_GETFD) < 0)
+					return -EBADF;
+		} else if (queue->memory == V4L2_MEMORY_USERPTR) {
+			unsigned int i;
+
+			for (i = 0; i < buffer->planes_count; i++)
+				if (!v4l2_buffer->m.planes[i].m.userptr ||
+				    v4l2_buffer->m.planes[i].length <
+				    buffer->planes_length[i])
+					return -EINVAL;
+		}
+
+		if (queue == &loopback->capture) {
+			buffer->queued = true;
+			loopback_fifo_push(queue->ready, &queue->ready_index,
+					   &queue->ready_count, buffer->index);
+
+			loopback_schedule(loopback, time);
+
+			return 0;
+		}
+
+		/* Output buffers only go to the hardware with a request. */
+		if (!(v4l2_buffer->flags & V4L2_BUF_FLAG_REQUEST_FD))
+			return -EBADR;
+
+		loopback_request = loopback_request_find(loopback,
+							 v4l2_buffer->request_fd);
+		if (!loopback_request)
+			return -EINVAL;
+
+		if (loopback_request->queued || loopback_request->output_buffer)
+			return -EBUSY;
+
+		buffer->queued = true;
+		buffer->timestamp = v4l2_buffer->timestamp.tv_sec *
+				    1000000000ULL +
+				    v4l2_buffer->timestamp.tv_usec * 1000ULL;
+
+		loopback_request->output_buffer = buffer;
+
+		return 0;
+	}
+	case VIDIOC_DQBUF: {
+		struct v4l2_buffer *v4l2_buffer = data;
+		unsigned int index;
+
+		queue = loopback_queue_get(loopback, v4l2_buffer->type);
+		if (!queue)
+			return -EINVAL;
+
+		if (!queue->done_count)
+			return -EAGAIN;
+
+		index = queue->done[queue->done_index];
+		buffer = &queue->buffers[index];
+
+		if (!v4l2_buffer->m.planes ||
+		    v4l2_buffer->length < buffer->planes_count)
+			return -EINVAL;
+
+		loopback_fifo_pop(queue->done, &queue->done_index,
+				  &queue->done_count);
+
+		buffer->queued = false;
+		buffer->done = false;
+
+		loopback_buffer_fill(queue, buffer, v4l2_buffer);
+
+		loopback_video_timer_update(loopback);
+
+		return 0;
+	}
+	case VIDIOC_STREAMON:
+	case VIDIOC_STREAMOFF: {
+		unsigned int *type = data;
+		unsigned int i;
+
+		queue = loopback_queue_get(loopback, *type);
+		if (!queue)
+			return -EINVAL;
+
+		queue->streaming = request == VIDIOC_STREAMON;
+
+		if (queue->streaming) {
+			loopback_schedule(loopback, time);
+			return 0;
+		}
+
+		/* Stopping either queue cancels everything in flight. */
+		loopback_jobs_cancel(loopback);
+
+		for (i = 0; i < queue->buffers_count; i++) {
+			queue->buffers[i].queued = false;
+			queue->buffers[i].done = false;
+		}
+
+		queue->ready_count = 0;
+		queue->done_count = 0;
+
+		loopback_video_timer_update(loopback);
+
+		return 0;
+	}
+	case VIDIOC_S_EXT_CTRLS:
+		return loopback_ext_controls(loopback, data, true, false);
+	case VIDIOC_G_EXT_CTRLS:
+		return loopback_ext_controls(loopback, data, false, false);
+	case VIDIOC_TRY_EXT_CTRLS:
+		return loopback_ext_controls(loopback, data, true, true);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static int loopback_media_ioctl(struct loopback *loopback,
+				unsigned long request, void *data)
+{
+	struct loopback_request *loopback_request;
+	int ret;
+
+	switch (request) {
+	case MEDIA_IOC_DEVICE_INFO: {
+		struct media_device_info *device_info = data;
+
+		memset(device_info, 0, sizeof(*device_info));
+		strncpy(device_info->driver, "loopback",
+			sizeof(device_info->driver) - 1);
+		strncpy(device_info->model, "Loopback H.264 encoder",
+			sizeof(device_info->model) - 1);
+
+		return 0;
+	}
+	case MEDIA_IOC_REQUEST_ALLOC:
+		loopback_request = calloc(1, sizeof(*loopback_request));
+		if (!loopback_request)
+			return -ENOMEM;
+
+		/* The timer becomes readable when the request completes. */
+		loopback_request->fd = timerfd_create(CLOCK_MONOTONIC,
+						      TFD_NONBLOCK |
+						      TFD_CLOEXEC);
+		if (loopback_request->fd < 0) {
+			ret = -errno;
+			free(loopback_request);
+			return ret;
+		}
+
+		ret = loopback_file_register(loopback_request->fd, loopback,
+					     loopback_request);
+		if (ret) {
+			close(loopback_request->fd);
+			free(loopback_request);
+			return ret;
+		}
+
+		loopback_request->loopback = loopback;
+		loopback_request->next = loopback->requests;
+		loopback->requests = loopback_request;
+
+		*(int *)data = loopback_request->fd;
+
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+static int loopback_request_ioctl(struct loopback *loopback,
+				  struct loopback_request *loopback_request,
+				  unsigned long request, uint64_t time)
+{
+	struct loopback_request **link;
+
+	switch (request) {
+	case MEDIA_REQUEST_IOC_QUEUE:
+		if (loopback_request->queued)
+			return -EBUSY;
+
+		if (!loopback_request->output_buffer)
+			return -ENOENT;
+
+		loopback_request->queued = true;
+		loopback_request->started = false;
+		loopback_request->complete = false;
+
+		for (link = &loopback->jobs; *link; link = &(*link)->job_next);
+		*link = loopback_request;
+
+		loopback_schedule(loopback, time);
+
+		return 0;
+	case MEDIA_REQUEST_IOC_REINIT:
+		if (loopback_request->queued && !loopback_request->complete)
+			return -EBUSY;
+
+		/* An unqueued request gives its buffer back. */
+		if (loopback_request->output_buffer)
+			loopback_request->output_buffer->queued = false;
+
+		loopback_request->output_buffer = NULL;
+		loopback_request->capture_buffer = NULL;
+		loopback_request->queued = false;
+		loopback_request->started = false;
+		loopback_request->complete = false;
+
+		memset(&loopback_request->encode_feedback, 0,
+		       sizeof(loopback_request->encode_feedback));
+
+		loopback_timer_set(loopback_request->fd, 0);
+
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+int loopback_ioctl(int fd, unsigned long request, void *data)
+{
+	struct loopback_file file;
+	struct loopback *loopback;
+	uint64_t time;
+	int ret;
+
+	if (!loopback_file_find(fd, &file))
+		return ioctl(fd, request, data);
+
+	loopback = file.loopback;
+	time = loopback_time();
+
+	pthread_mutex_lock(&loopback->lock);
+
+	loopback_update(loopback, time);
+
+	if (file.request)
+		ret = loopback_request_ioctl(loopback, file.request, request,
+					     time);
+	else if (fd == loopback->media_fd)
+		ret = loopback_media_ioctl(loopback, request, data);
+	else
+		ret = loopback_video_ioctl(loopback, request, data, time);
+
+	pthread_mutex_unlock(&loopback->lock);
+
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	return ret;
+}
+
+void *loopback_mmap(void *address, size_t length, int protection, int flags,
+		    int fd, off_t offset)
+{
+	struct loopback_file file;
+	struct loopback *loopback;
+	struct loopback_queue *queue;
+	struct loopback_buffer *buffer;
+	unsigned int index, plane;
+	void *data = MAP_FAILED;
+
+	if (!loopback_file_find(fd, &file) || file.request)
+		return mmap(address, length, protection, flags, fd, offset);
+
+	loopback = file.loopback;
+
+	offset /= sysconf(_SC_PAGESIZE);
+	plane = offset % VIDEO_MAX_PLANES;
+	index = offset / VIDEO_MAX_PLANES % LOOPBACK_BUFFERS_MAX;
+
+	pthread_mutex_lock(&loopback->lock);
+
+	if (offset / VIDEO_MAX_PLANES / LOOPBACK_BUFFERS_MAX)
+		queue = &loopback->capture;
+	else
+		queue = &loopback->output;
+
+	if (index >= queue->buffers_count) {
+		errno = EINVAL;
+		goto complete;
+	}
+
+	buffer = &queue->buffers[index];
+
+	if (plane >= buffer->planes_count ||
+	    length > buffer->planes_length[plane]) {
+		errno = EINVAL;
+		goto complete;
+	}
+
+	data = mmap(address, length, protection, flags,
+		    buffer->planes_fd[plane], 0);
+
+complete:
+	pthread_mutex_unlock(&loopback->lock);
+
+	return data;
+}
+
+int loopback_close(int fd)
+{
+	struct loopback_file file;
+	struct loopback *loopback;
+
+	if (!loopback_file_find(fd, &file) || !file.request)
+		return close(fd);
+
+	loopback = file.loopback;
+
+	pthread_mutex_lock(&loopback->lock);
+	loopback_request_destroy(loopback, file.request);
+	pthread_mutex_unlock(&loopback->lock);
+
+	return 0;
+}
+
+/* Requests complete at a modelled time, which can be long before their
+ * completion is noticed. Other fds report 0. */
+uint64_t loopback_request_complete_time(int fd)
+{
+	struct loopback_file file;
+	struct loopback *loopback;
+	uint64_t time = 0;
+
+	if (!loopback_file_find(fd, &file) || !file.request)
+		return 0;
+
+	loopback = file.loopback;
+
+	pthread_mutex_lock(&loopback->lock);
+
+	loopback_update(loopback, loopback_time());
+
+	if (file.request->complete)
+		time = file.request->complete_time;
+
+	pthread_mutex_unlock(&loopback->lock);
+
+	return time;
+}
+
+struct loopback *loopback_create(struct loopback_setup *setup)
+{
+	struct loopback *loopback;
+	int ret;
+
+	if (!setup || setup->core >= LOOPBACK_CORES_MAX)
+		return NULL;
+
+	loopback = calloc(1, sizeof(*loopback));
+	if (!loopback)
+		return NULL;
+
+	loopback->setup = *setup;
+
+	if (!loopback->setup.intra_cost)
+		loopback->setup.intra_cost = 100;
+
+	pthread_mutex_init(&loopback->lock, NULL);
+
+	loopback->media_fd = eventfd(0, EFD_CLOEXEC);
+	loopback->video_fd = timerfd_create(CLOCK_MONOTONIC,
+					    TFD_NONBLOCK | TFD_CLOEXEC);
+	if (loopback->media_fd < 0 || loopback->video_fd < 0)
+		goto error;
+
+	loopback->output.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	loopback->output.memory = V4L2_MEMORY_MMAP;
+	loopback->output.format.fmt.pix_mp.width = 1280;
+	loopback->output.format.fmt.pix_mp.height = 720;
+	loopback_format_adjust(&loopback->output, &loopback->output.format);
+
+	loopback->capture.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	loopback->capture.memory = V4L2_MEMORY_MMAP;
+	loopback->capture.format.fmt.pix_mp.width = 1280;
+	loopback->capture.format.fmt.pix_mp.height = 720;
+	loopback_format_adjust(&loopback->capture, &loopback->capture.format);
+
+	ret = loopback_file_register(loopback->media_fd, loopback, NULL);
+	if (ret)
+		goto error;
+
+	ret = loopback_file_register(loopback->video_fd, loopback, NULL);
+	if (ret) {
+		loopback_file_unregister(loopback->media_fd);
+		goto error;
+	}
+
+	return loopback;
+
+error:
+	if (loopback->media_fd >= 0)
+		close(loopback->media_fd);
+
+	if (loopback->video_fd >= 0)
+		close(loopback->video_fd);
+
+	pthread_mutex_destroy(&loopback->lock);
+	free(loopback);
+
+	return NULL;
+}
+
+void loopback_destroy(struct loopback *loopback)
+{
+	if (!loopback)
+		return;
+
+	pthread_mutex_lock(&loopback->lock);
+
+	while (loopback->requests)
+		loopback_request_destroy(loopback, loopback->requests);
+
+	loopback_buffers_free(&loopback->output);
+	loopback_buffers_free(&loopback->capture);
+
+	pthread_mutex_unlock(&loopback->lock);
+
+	loopback_file_unregister(loopback->media_fd);
+	close(loopback->media_fd);
+
+	loopback_file_unregister(loopback->video_fd);
+	close(loopback->video_fd);
+
+	pthread_mutex_destroy(&loopback->lock);
+	free(loopback);
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#ifndef _LOOPBACK_H_
+#define _LOOPBACK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+
+#include <linux/videodev2.h>
+
+#define LOOPBACK_BUFFERS_MAX	16
+#define LOOPBACK_CORES_MAX	16
+
+struct loopback;
+struct loopback_request;
+
+struct loopback_setup {
+	/* Fixed time spent on each frame. */
+	uint64_t latency;
+	/* Time spent on each macroblock. */
+	uint64_t latency_mb;
+	/* Intra frame cost relative to inter frames, in percent. */
+	unsigned int intra_cost;
+
+	/* Instances sharing a core run one frame at a time. */
+	unsigned int core;
+};
+
+struct loopback_buffer {
+	unsigned int index;
+
+	int planes_fd[VIDEO_MAX_PLANES];
+	void *planes_data[VIDEO_MAX_PLANES];
+	unsigned int planes_length[VIDEO_MAX_PLANES];
+	unsigned int planes_count;
+	unsigned int bytesused;
+
+	uint64_t timestamp;
+	bool queued;
+	bool done;
+	bool error;
+};
+
+struct loopback_queue {
+	unsigned int type;
+	unsigned int memory;
+	struct v4l2_format format;
+	bool streaming;
+
+	struct loopback_buffer buffers[LOOPBACK_BUFFERS_MAX];
+	unsigned int buffers_count;
+
+	/* Buffers ready for the hardware and ready to dequeue, in order. */
+	unsigned int ready[LOOPBACK_BUFFERS_MAX];
+	unsigned int ready_index;
+	unsigned int ready_count;
+	unsigned int done[LOOPBACK_BUFFERS_MAX];
+	unsigned int done_index;
+	unsigned int done_count;
+};
+
+struct loopback_request {
+	struct loopback *loopback;
+	int fd;
+
+	bool queued;
+	bool started;
+	bool complete;
+
+	struct loopback_buffer *output_buffer;
+	struct loopback_buffer *capture_buffer;
+
+	struct v4l2_ctrl_h264_encode_params encode_params;
+	struct v4l2_ctrl_h264_encode_rc encode_rc;
+	struct v4l2_ctrl_h264_encode_feedback encode_feedback;
+
+	uint64_t complete_time;
+
+	struct loopback_request *next;
+	struct loopback_request *job_next;
+};
+
+struct loopback {
+	int media_fd;
+	int video_fd;
+
+	struct loopback_setup setup;
+	pthread_mutex_t lock;
+
+	struct loopback_queue output;
+	struct loopback_queue capture;
+
+	struct loopback_request *requests;
+
+	/* Queued requests, in order. */
+	struct loopback_request *jobs;
+};
+
+struct loopback *loopback_create(struct loopback_setup *setup);
+void loopback_destroy(struct loopback *loopback);
+int loopback_ioctl(int fd, unsigned long request, void *data);
+void *loopback_mmap(void *address, size_t length, int protection, int flags,
+		    int fd, off_t offset);
+int loopback_close(int fd);
+uint64_t loopback_request_complete_time(int fd);
+
+#endif
@@ -9,6 +9,7 @@
 #include <errno.h>
 
 #include <sys/ioctl.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -17,12 +18,14 @@
 #include <linux/media.h>
 
 #include <v4l2.h>
+#include <loopback.h>
+#include <session.h>
 
 int media_device_info(int media_fd, struct media_device_info *device_info)
 {
 	int ret;
 
-	ret = ioctl(media_fd, MEDIA_IOC_DEVICE_INFO, device_info);
+	ret = v4l2_ioctl(media_fd, MEDIA_IOC_DEVICE_INFO, device_info);
 	if (ret)
 		return -errno;
 
@@ -33,26 +36,31 @@ int media_topology_get(int media_fd, struct media_v2_topology *topology)
 {
 	int ret;
 
-	ret = ioctl(media_fd, MEDIA_IOC_G_TOPOLOGY, topology);
+	ret = v4l2_ioctl(media_fd, MEDIA_IOC_G_TOPOLOGY, topology);
 	if (ret)
 		return -errno;
 
 	return 0;
 }
 
-struct media_v2_entity *media_topology_entity_find_by_function(struct media_v2_topology *topology,
-							       unsigned int function)
+struct media_v2_entity *media_topology_entity_find_next_by_function(struct media_v2_topology *topology,
+								    struct media_v2_entity *entity,
+								    unsigned int function)
 {
 	struct media_v2_entity *entities;
-	unsigned int i;
+	unsigned int i = 0;
 
 	if (!topology || !topology->num_entities || !topology->ptr_entities)
 		return NULL;
 
 	entities = (struct media_v2_entity *)topology->ptr_entities;
 
-	for (i = 0; i < topology->num_entities; i++) {
-		struct media_v2_entity *entity = &entities[i];
+	/* Resume the search after the previous match. */
+	if (entity)
+		i = entity - entities + 1;
+
+	for (; i < topology->num_entities; i++) {
+		entity = &entities[i];
 
 		if (entity->function == function)
 			return entity;
@@ -61,6 +69,13 @@ struct media_v2_entity *media_topology_entity_find_by_function(struct media_v2_t
 	return NULL;
 }
 
+struct media_v2_entity *media_topology_entity_find_by_function(struct media_v2_topology *topology,
+							       unsigned int function)
+{
+	return media_topology_entity_find_next_by_function(topology, NULL,
+							   function);
+}
+
 struct media_v2_interface *media_topology_interface_find_by_id(struct media_v2_topology *topology,
 							       unsigned int id)
 {
@@ -187,18 +202,23 @@ int media_request_alloc(int media_fd)
 	int request_fd;
 	int ret;
 
-	ret = ioctl(media_fd, MEDIA_IOC_REQUEST_ALLOC, &request_fd);
+	ret = v4l2_ioctl(media_fd, MEDIA_IOC_REQUEST_ALLOC, &request_fd);
 	if (ret)
 		return -errno;
 
 	return request_fd;
 }
 
+void media_request_free(int request_fd)
+{
+	loopback_close(request_fd);
+}
+
 int media_request_queue(int request_fd)
 {
 	int ret;
 
-	ret = ioctl(request_fd, MEDIA_REQUEST_IOC_QUEUE, NULL);
+	ret = v4l2_ioctl(request_fd, MEDIA_REQUEST_IOC_QUEUE, NULL);
 	if (ret)
 		return -errno;
 
@@ -209,27 +229,53 @@ int media_request_reinit(int request_fd)
 {
 	int ret;
 
-	ret = ioctl(request_fd, MEDIA_REQUEST_IOC_REINIT, NULL);
+	ret = v4l2_ioctl(request_fd, MEDIA_REQUEST_IOC_REINIT, NULL);
 	if (ret)
 		return -errno;
 
 	return 0;
 }
 
+/* Only loopback requests report when they completed, 0 otherwise. */
+uint64_t media_request_complete_time(int request_fd)
+{
+	return loopback_request_complete_time(request_fd);
+}
+
 int media_request_poll(int request_fd, struct timeval *timeout)
 {
-	fd_set except_fds;
+	struct pollfd pollfd = { 0 };
+	int timeout_ms = -1;
+	uint64_t start;
 	int ret;
 
-	FD_ZERO(&except_fds);
-	FD_SET(request_fd, &except_fds);
+	/* Unlike select(), poll() is not limited to FD_SETSIZE fds. */
+	pollfd.fd = request_fd;
+	/* Loopback requests signal completion as readable instead. */
+	pollfd.events = POLLPRI | POLLIN;
 
-	ret = select(request_fd + 1, NULL, NULL, &except_fds, timeout);
-	if (ret < 0)
-		return -errno;
+	if (timeout)
+		timeout_ms = timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
 
-	if (!FD_ISSET(request_fd, &except_fds))
+	start = v4l2_ioctl_stats_start();
+
+	ret = poll(&pollfd, 1, timeout_ms);
+	if (ret < 0) {
+		ret = -errno;
+		v4l2_ioctl_stats_record(V4L2_IOCTL_REQUEST_POLL, start, -ret);
+		session_poll(ret, start);
+		return ret;
+	}
+
+	/* Polling a request that is not complete yet counts as EAGAIN. */
+	if (!(pollfd.revents & (POLLPRI | POLLIN))) {
+		v4l2_ioctl_stats_record(V4L2_IOCTL_REQUEST_POLL, start, EAGAIN);
+		session_poll(-EAGAIN, start);
 		return 0;
+	}
+
+	v4l2_ioctl_stats_record(V4L2_IOCTL_REQUEST_POLL, start, 0);
+	session_poll(ret, start);
 
 	return ret;
 }
@@ -7,10 +7,14 @@
 #define _MEDIA_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
 int media_device_info(int media_fd, struct media_device_info *device_info);
 int media_topology_get(int media_fd, struct media_v2_topology *topology);
+struct media_v2_entity *media_topology_entity_find_next_by_function(struct media_v2_topology *topology,
+								    struct media_v2_entity *entity,
+								    unsigned int function);
 struct media_v2_entity *media_topology_entity_find_by_function(struct media_v2_topology *topology,
 							       unsigned int function);
 struct media_v2_interface *media_topology_interface_find_by_id(struct media_v2_topology *topology,
@@ -27,8 +31,10 @@ struct media_v2_link *media_topology_link_find_by_entity(struct media_v2_topolog
 							 unsigned int entity_id,
 							 unsigned int pad_flags);
 int media_request_alloc(int media_fd);
+void media_request_free(int request_fd);
 int media_request_queue(int request_fd);
 int media_request_reinit(int request_fd);
 int media_request_poll(int request_fd, struct timeval *timeout);
+uint64_t media_request_complete_time(int request_fd);
 
 #endif
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <metrics.h>
+
+/* Readers give up on a segment that never settles, such as one left behind
+ * by a process that died in the middle of an update. */
+#define METRICS_READ_TRIES	1000
+
+struct metrics *metrics_create(unsigned int index)
+{
+	struct metrics *metrics;
+	struct metrics_data *data;
+	int fd;
+
+	metrics = calloc(1, sizeof(*metrics));
+	if (!metrics)
+		return NULL;
+
+	snprintf(metrics->name, sizeof(metrics->name), "/%s%d-%u",
+		 METRICS_PREFIX, getpid(), index);
+
+	fd = shm_open(metrics->name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto error;
+
+	if (ftruncate(fd, sizeof(*data)))
+		goto error_unlink;
+
+	data = mmap(NULL, sizeof(*data), PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+	if (data == MAP_FAILED)
+		goto error_unlink;
+
+	close(fd);
+
+	data->version = METRICS_VERSION;
+	data->size = sizeof(*data);
+	data->pid = getpid();
+	data->index = index;
+	atomic_init(&data->sequence, 0);
+
+	/* Readers only trust the segment once the magic is there. */
+	atomic_thread_fence(memory_order_release);
+	data->magic = METRICS_MAGIC;
+
+	metrics->data = data;
+
+	return metrics;
+
+error_unlink:
+	close(fd);
+	shm_unlink(metrics->name);
+
+error:
+	free(metrics);
+
+	return NULL;
+}
+
+void metrics_destroy(struct metrics *metrics)
+{
+	if (!metrics)
+		return;
+
+	munmap(metrics->data, sizeof(*metrics->data));
+	shm_unlink(metrics->name);
+	free(metrics);
+}
+
+/* Single writer, so that the sequence is updated without atomic
+ * read-modify-write or system calls. */
+void metrics_write_begin(struct metrics *metrics)
+{
+	unsigned int sequence;
+
+	sequence = atomic_load_explicit(&metrics->data->sequence,
+					memory_order_relaxed);
+	atomic_store_explicit(&metrics->data->sequence, sequence + 1,
+			      memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+void metrics_write_end(struct metrics *metrics)
+{
+	unsigned int sequence;
+
+	sequence = atomic_load_explicit(&metrics->data->sequence,
+					memory_order_relaxed);
+	atomic_store_explicit(&metrics->data->sequence, sequence + 1,
+			      memory_order_release);
+}
+
+unsigned int metrics_latency_bucket(uint64_t latency)
+{
+	uint64_t us = latency / 1000;
+	unsigned int bucket;
+
+	bucket = us ? 64 - __builtin_clzll(us) : 0;
+	if (bucket >= METRICS_LATENCY_BUCKETS)
+		bucket = METRICS_LATENCY_BUCKETS - 1;
+
+	return bucket;
+}
+
+struct metrics_data *metrics_map(const char *name)
+{
+	struct metrics_data *data;
+	struct stat stat;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &stat) || stat.st_size < (off_t)sizeof(*data)) {
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, sizeof(*data), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED)
+		return NULL;
+
+	if (data->magic != METRICS_MAGIC || data->version != METRICS_VERSION ||
+	    data->size != sizeof(*data)) {
+		metrics_unmap(data);
+		return NULL;
+	}
+
+	return data;
+}
+
+void metrics_unmap(struct metrics_data *data)
+{
+	if (!data)
+		return;
+
+	munmap(data, sizeof(*data));
+}
+
+bool metrics_read(struct metrics_data *data, struct metrics_data *copy)
+{
+	unsigned int sequence;
+	unsigned int i;
+
+	for (i = 0; i < METRICS_READ_TRIES; i++) {
+		sequence = atomic_load_explicit(&data->sequence,
+						memory_order_acquire);
+		if (sequence & 1)
+			continue;
+
+		memcpy(copy, data, sizeof(*copy));
+		atomic_thread_fence(memory_order_acquire);
+
+		if (atomic_load_explicit(&data->sequence,
+					 memory_order_relaxed) == sequence)
+			return true;
+	}
+
+	return false;
+}
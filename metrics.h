@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#define METRICS_PREFIX		"v4l2-hantro-h264-encoder-"
+#define METRICS_MAGIC		0x4d323634
+#define METRICS_VERSION		1
+#define METRICS_LATENCY_BUCKETS	32
+
+/* Published in shared memory, the layout changes with the version. */
+struct metrics_data {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	int32_t pid;
+	uint32_t index;
+
+	/* Odd while the encoder is updating the fields below. */
+	atomic_uint sequence;
+
+	unsigned int width;
+	unsigned int height;
+	unsigned int fps_num;
+	unsigned int fps_den;
+	uint64_t bitrate;
+
+	/* Monotonic clock, in nanoseconds. */
+	uint64_t start_time;
+	uint64_t update_time;
+
+	uint64_t frames;
+	uint64_t bytes;
+
+	unsigned int qp;
+	unsigned int qp_average;
+	unsigned int bits_target;
+	unsigned int bits_left;
+
+	/* Frames by latency to feedback, bucket n is under 2^n us. */
+	uint64_t latency[METRICS_LATENCY_BUCKETS];
+};
+
+struct metrics {
+	char name[64];
+	struct metrics_data *data;
+};
+
+struct metrics *metrics_create(unsigned int index);
+void metrics_destroy(struct metrics *metrics);
+void metrics_write_begin(struct metrics *metrics);
+void metrics_write_end(struct metrics *metrics);
+unsigned int metrics_latency_bucket(uint64_t latency);
+struct metrics_data *metrics_map(const char *name);
+void metrics_unmap(struct metrics_data *data);
+bool metrics_read(struct metrics_data *data, struct metrics_data *copy);
+
+#endif
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <perf.h>
+
+const char *perf_counter_names[PERF_COUNTERS] = {
+	[PERF_COUNTER_CYCLES] = "cycles",
+	[PERF_COUNTER_INSTRUCTIONS] = "instructions",
+	[PERF_COUNTER_CACHE_MISSES] = "cache misses",
+	[PERF_COUNTER_BRANCH_MISSES] = "branch misses",
+};
+
+static const uint64_t perf_counter_configs[PERF_COUNTERS] = {
+	[PERF_COUNTER_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+	[PERF_COUNTER_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+	[PERF_COUNTER_CACHE_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+	[PERF_COUNTER_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+/* Counters only follow the thread that opened them, so each thread gets its
+ * own group, opened on first use and closed when the thread exits. */
+struct perf_group {
+	int fds[PERF_COUNTERS];
+};
+
+static pthread_key_t perf_key;
+static pthread_once_t perf_once = PTHREAD_ONCE_INIT;
+
+static void perf_group_close(void *data)
+{
+	struct perf_group *group = data;
+	unsigned int i;
+
+	if (!group)
+		return;
+
+	for (i = 0; i < PERF_COUNTERS; i++)
+		if (group->fds[i] >= 0)
+			close(group->fds[i]);
+
+	free(group);
+}
+
+static void perf_key_create(void)
+{
+	pthread_key_create(&perf_key, perf_group_close);
+}
+
+static struct perf_group *perf_group_open(void)
+{
+	struct perf_event_attr attr;
+	struct perf_group *group;
+	unsigned int i;
+	int leader = -1;
+	int fd;
+
+	group = malloc(sizeof(*group));
+	if (!group)
+		return NULL;
+
+	for (i = 0; i < PERF_COUNTERS; i++)
+		group->fds[i] = -1;
+
+	for (i = 0; i < PERF_COUNTERS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = perf_counter_configs[i];
+		attr.read_format = PERF_FORMAT_GROUP;
+		/* User space only, which is all we can tune anyway. */
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+		if (fd < 0)
+			goto error;
+
+		group->fds[i] = fd;
+
+		if (leader < 0)
+			leader = fd;
+	}
+
+	return group;
+
+error:
+	perf_group_close(group);
+
+	return NULL;
+}
+
+/* Check that counters are available, opening them for the calling thread. */
+int perf_enable(void)
+{
+	struct perf_sample sample;
+
+	return perf_read(&sample);
+}
+
+/* Read the running counts of the calling thread, in a single system call. */
+int perf_read(struct perf_sample *sample)
+{
+	struct perf_group *group;
+	uint64_t values[1 + PERF_COUNTERS];
+	ssize_t length;
+	unsigned int i;
+
+	if (!sample)
+		return -EINVAL;
+
+	pthread_once(&perf_once, perf_key_create);
+
+	group = pthread_getspecific(perf_key);
+	if (!group) {
+		group = perf_group_open();
+		if (!group)
+			return -errno;
+
+		pthread_setspecific(perf_key, group);
+	}
+
+	length = read(group->fds[0], values, sizeof(values));
+	if (length != sizeof(values) || values[0] != PERF_COUNTERS)
+		return -EIO;
+
+	for (i = 0; i < PERF_COUNTERS; i++)
+		sample->values[i] = values[1 + i];
+
+	return 0;
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#ifndef _PERF_H_
+#define _PERF_H_
+
+#include <stdint.h>
+
+enum perf_counter {
+	PERF_COUNTER_CYCLES,
+	PERF_COUNTER_INSTRUCTIONS,
+	PERF_COUNTER_CACHE_MISSES,
+	PERF_COUNTER_BRANCH_MISSES,
+	PERF_COUNTERS,
+};
+
+struct perf_sample {
+	uint64_t values[PERF_COUNTERS];
+};
+
+extern const char *perf_counter_names[PERF_COUNTERS];
+
+int perf_enable(void);
+int perf_read(struct perf_sample *sample);
+
+#endif
@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <linux/videodev2.h>
+
+#include <v4l2-encoder.h>
+#include <h264.h>
+#include <ring.h>
+#include <pipeline.h>
+
+static void *pipeline_producer(void *data)
+{
+	struct pipeline *pipeline = data;
+	struct v4l2_encoder *encoder = pipeline->encoder;
+	unsigned int output_index;
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < pipeline->frames; i++) {
+		ring_pop(pipeline->output_free, &output_index);
+
+		/* The submit stage gave up. */
+		if (output_index == RING_END)
+			break;
+
+		ret = v4l2_encoder_draw(encoder,
+					&encoder->output_buffers[output_index]);
+		if (ret) {
+			ring_push(pipeline->output_ready, RING_END);
+			break;
+		}
+
+		ring_push(pipeline->output_ready, output_index);
+	}
+
+	pipeline->producer_ret = ret;
+
+	return NULL;
+}
+
+/* Written slices come back through the ring, but only the submit thread
+ * hands them back to the encoder, which it owns. */
+static int pipeline_capture_return(struct pipeline *pipeline, bool wait)
+{
+	struct v4l2_encoder *encoder = pipeline->encoder;
+	unsigned int capture_index;
+	int ret;
+
+	while (true) {
+		if (wait && !encoder->capture_free_count)
+			ring_pop(pipeline->capture_free, &capture_index);
+		else if (!ring_try_pop(pipeline->capture_free, &capture_index))
+			return 0;
+
+		/* The writer stage gave up. */
+		if (capture_index == RING_END)
+			return -EPIPE;
+
+		ret = v4l2_encoder_capture_return(encoder,
+				&encoder->capture_buffers[capture_index]);
+		if (ret)
+			return ret;
+	}
+}
+
+static void *pipeline_submit(void *data)
+{
+	struct pipeline *pipeline = data;
+	struct v4l2_encoder *encoder = pipeline->encoder;
+	unsigned int depth = encoder->setup.pipeline_depth;
+	unsigned int output_index, capture_index;
+	bool output_ready = false;
+	unsigned int queued = 0;
+	bool wait;
+	int ret = 0;
+
+	while (queued < pipeline->frames || encoder->pending_count) {
+		if (queued < pipeline->frames && encoder->pending_count < depth) {
+			/* Only block on the other stages when the hardware
+			 * has nothing left to work on. */
+			wait = !encoder->pending_count;
+
+			ret = pipeline_capture_return(pipeline, wait);
+			if (ret)
+				goto complete;
+
+			if (encoder->capture_free_count && !output_ready &&
+			    wait) {
+				ring_pop(pipeline->output_ready, &output_index);
+				output_ready = true;
+			} else if (encoder->capture_free_count && !output_ready) {
+				output_ready = ring_try_pop(pipeline->output_ready,
+							    &output_index);
+			}
+
+			if (output_ready && output_index == RING_END) {
+				ret = -EPIPE;
+				goto complete;
+			}
+
+			/* The output ring hands buffers over in order, so
+			 * they always match the encoder queue indexes. */
+			if (output_ready && encoder->capture_free_count) {
+				ret = h264_prepare(encoder);
+				if (ret)
+					goto complete;
+
+				ret = v4l2_encoder_queue(encoder);
+				if (ret)
+					goto complete;
+
+				output_ready = false;
+				queued++;
+				continue;
+			}
+		}
+
+		ret = v4l2_encoder_dequeue(encoder);
+		if (ret)
+			goto complete;
+
+		/* Frames encoded again after an overflow changed buffers. */
+		output_index = encoder->output_buffers_done_index;
+		capture_index = encoder->capture_buffers_done_index;
+
+		ret = v4l2_encoder_feedback(encoder);
+		if (ret)
+			goto complete;
+
+		/* Lent buffers are left alone until the writer is done. */
+		ret = v4l2_encoder_capture_lend(encoder,
+				&encoder->capture_buffers[capture_index]);
+		if (ret)
+			goto complete;
+
+		ring_push(pipeline->capture_done, capture_index);
+		ring_push(pipeline->output_free, output_index);
+	}
+
+complete:
+	if (ret)
+		ring_push(pipeline->output_free, RING_END);
+
+	ring_push(pipeline->capture_done, RING_END);
+
+	pipeline->submit_ret = ret;
+
+	return NULL;
+}
+
+static void *pipeline_writer(void *data)
+{
+	struct pipeline *pipeline = data;
+	struct v4l2_encoder *encoder = pipeline->encoder;
+	unsigned int capture_index;
+	int ret = 0;
+
+	while (true) {
+		ring_pop(pipeline->capture_done, &capture_index);
+		if (capture_index == RING_END)
+			break;
+
+		/* Keep draining so that the submit stage can unwind, buffers
+		 * are still handed back to be returned at the end. */
+		if (!ret) {
+			ret = h264_slice_write(encoder,
+					&encoder->capture_buffers[capture_index]);
+			if (ret)
+				ring_push(pipeline->capture_free, RING_END);
+		}
+
+		ring_push(pipeline->capture_free, capture_index);
+	}
+
+	pipeline->writer_ret = ret;
+
+	return NULL;
+}
+
+int pipeline_run(struct v4l2_encoder *encoder, unsigned int frames)
+{
+	struct pipeline pipeline = { 0 };
+	unsigned int output_count, capture_count;
+	unsigned int capture_index;
+	unsigned int i;
+	int ret;
+
+	if (!encoder || !encoder->started || encoder->pending_count)
+		return -EINVAL;
+
+	/* Capture buffers may be added when slices overflow them. */
+	output_count = encoder->output_buffers_count;
+	capture_count = encoder->buffers_max;
+
+	pipeline.encoder = encoder;
+	pipeline.frames = frames;
+
+	/* Leave room for the end marker next to every buffer. */
+	pipeline.output_ready = ring_create(output_count + 1);
+	pipeline.output_free = ring_create(output_count + 1);
+	pipeline.capture_done = ring_create(capture_count + 1);
+	pipeline.capture_free = ring_create(capture_count + 1);
+
+	if (!pipeline.output_ready || !pipeline.output_free ||
+	    !pipeline.capture_done || !pipeline.capture_free) {
+		ret = -ENOMEM;
+		goto complete;
+	}
+
+	/* Hand buffers over in the order of the encoder free list. */
+	for (i = 0; i < encoder->output_free_count; i++)
+		ring_push(pipeline.output_free, encoder->output_free[i]);
+
+	ret = pthread_create(&pipeline.writer_thread, NULL, pipeline_writer,
+			     &pipeline);
+	if (ret) {
+		ret = -ret;
+		goto complete;
+	}
+
+	ret = pthread_create(&pipeline.submit_thread, NULL, pipeline_submit,
+			     &pipeline);
+	if (ret) {
+		ring_push(pipeline.capture_done, RING_END);
+		pthread_join(pipeline.writer_thread, NULL);
+		ret = -ret;
+		goto complete;
+	}
+
+	ret = pthread_create(&pipeline.producer_thread, NULL,
+			     pipeline_producer, &pipeline);
+	if (ret) {
+		ring_push(pipeline.output_ready, RING_END);
+		pthread_join(pipeline.submit_thread, NULL);
+		pthread_join(pipeline.writer_thread, NULL);
+		ret = -ret;
+		goto complete;
+	}
+
+	pthread_join(pipeline.producer_thread, NULL);
+	pthread_join(pipeline.submit_thread, NULL);
+	pthread_join(pipeline.writer_thread, NULL);
+
+	/* The submit stage gives up with -EPIPE when another one failed. */
+	if (pipeline.producer_ret)
+		ret = pipeline.producer_ret;
+	else if (pipeline.writer_ret)
+		ret = pipeline.writer_ret;
+	else
+		ret = pipeline.submit_ret;
+
+complete:
+	/* Slices written after the submit stage ended are still lent. */
+	while (pipeline.capture_free &&
+	       ring_try_pop(pipeline.capture_free, &capture_index))
+		if (capture_index != RING_END)
+			v4l2_encoder_capture_return(encoder,
+					&encoder->capture_buffers[capture_index]);
+
+	ring_destroy(pipeline.capture_free);
+	ring_destroy(pipeline.capture_done);
+	ring_destroy(pipeline.output_free);
+	ring_destroy(pipeline.output_ready);
+
+	return ret;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <pthread.h>
+
+#include <ring.h>
+
+struct v4l2_encoder;
+
+struct pipeline {
+	struct v4l2_encoder *encoder;
+	unsigned int frames;
+
+	/* Producer to submit and back. */
+	struct ring *output_ready;
+	struct ring *output_free;
+
+	/* Submit to writer and back. */
+	struct ring *capture_done;
+	struct ring *capture_free;
+
+	pthread_t producer_thread;
+	pthread_t submit_thread;
+	pthread_t writer_thread;
+
+	int producer_ret;
+	int submit_ret;
+	int writer_ret;
+};
+
+int pipeline_run(struct v4l2_encoder *encoder, unsigned int frames);
+
+#endif
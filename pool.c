@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <linux/videodev2.h>
+
+#include <v4l2-encoder.h>
+#include <pool.h>
+
+/* Cost of a macroblock in nanoseconds of hardware time, upscaled. */
+static uint64_t pool_device_cost(struct pool *pool, unsigned int index)
+{
+	struct pool_device *device = &pool->devices[index];
+	uint64_t hardware_time = 0;
+	uint64_t macroblocks = 0;
+	unsigned int i;
+
+	if (device->macroblocks)
+		return device->hardware_time * 1024 / device->macroblocks;
+
+	/* Assume unmeasured devices perform like the measured average. */
+	for (i = 0; i < pool->devices_count; i++) {
+		hardware_time += pool->devices[i].hardware_time;
+		macroblocks += pool->devices[i].macroblocks;
+	}
+
+	if (macroblocks)
+		return hardware_time * 1024 / macroblocks;
+
+	return 1024;
+}
+
+struct pool *pool_create(void)
+{
+	struct v4l2_encoder_device *devices = NULL;
+	unsigned int devices_count = 0;
+	struct pool *pool = NULL;
+	unsigned int i;
+	int ret;
+
+	ret = v4l2_encoder_devices_enumerate(&devices, &devices_count);
+	if (ret || !devices_count) {
+		fprintf(stderr, "Failed to find encoder devices\n");
+		goto complete;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		goto complete;
+
+	pool->devices = calloc(devices_count, sizeof(*pool->devices));
+	if (!pool->devices) {
+		free(pool);
+		pool = NULL;
+		goto complete;
+	}
+
+	pool->devices_count = devices_count;
+
+	for (i = 0; i < devices_count; i++)
+		pool->devices[i].device = devices[i];
+
+complete:
+	if (devices)
+		free(devices);
+
+	return pool;
+}
+
+void pool_destroy(struct pool *pool)
+{
+	if (!pool)
+		return;
+
+	if (pool->devices)
+		free(pool->devices);
+
+	free(pool);
+}
+
+static int pool_device_calibrate(struct pool *pool, unsigned int index,
+				 unsigned int width, unsigned int height)
+{
+	struct v4l2_encoder *encoder;
+	uint64_t time;
+	unsigned int i;
+	int ret;
+
+	encoder = calloc(1, sizeof(*encoder));
+	if (!encoder)
+		return -ENOMEM;
+
+	encoder->bitstream_path = "/dev/null";
+
+	ret = v4l2_encoder_open_device(encoder, &pool->devices[index].device);
+	if (ret) {
+		free(encoder);
+		return ret;
+	}
+
+	ret = v4l2_encoder_probe(encoder);
+	if (ret)
+		goto complete;
+
+	ret = v4l2_encoder_setup_defaults(encoder);
+	if (ret)
+		goto complete;
+
+	ret = v4l2_encoder_setup_dimensions(encoder, width, height);
+	if (ret)
+		goto complete;
+
+	ret = v4l2_encoder_setup(encoder);
+	if (ret)
+		goto complete;
+
+	ret = v4l2_encoder_start(encoder);
+	if (ret)
+		goto complete;
+
+	/* One frame at a time, so that only the hardware is timed. */
+	for (i = 0; i < POOL_CALIBRATION_FRAMES; i++) {
+		ret = v4l2_encoder_prepare(encoder);
+		if (ret)
+			break;
+
+		time = v4l2_encoder_time();
+
+		ret = v4l2_encoder_run(encoder);
+		if (ret)
+			break;
+
+		pool_device_measure(pool, index, encoder->setup.width_mbs *
+				    encoder->setup.height_mbs,
+				    v4l2_encoder_time() - time);
+
+		ret = v4l2_encoder_complete(encoder);
+		if (ret)
+			break;
+	}
+
+	v4l2_encoder_stop(encoder);
+
+complete:
+	v4l2_encoder_teardown(encoder);
+	v4l2_encoder_close(encoder);
+	free(encoder);
+
+	return ret;
+}
+
+/* Placement needs a measured cost for each device before streams run. */
+int pool_calibrate(struct pool *pool, unsigned int width, unsigned int height)
+{
+	unsigned int available = 0;
+	unsigned int i;
+	int ret;
+
+	if (!pool || !width || !height)
+		return -EINVAL;
+
+	for (i = 0; i < pool->devices_count; i++) {
+		ret = pool_device_calibrate(pool, i, width, height);
+		if (ret) {
+			fprintf(stderr, "Failed to calibrate encoder device %s\n",
+				pool->devices[i].device.syspath);
+			pool->devices[i].unavailable = true;
+			continue;
+		}
+
+		available++;
+	}
+
+	return available ? 0 : -ENODEV;
+}
+
+int pool_encoder_open(struct pool *pool, struct v4l2_encoder *encoder,
+		      uint64_t load, unsigned int *device_index)
+{
+	uint64_t utilization;
+	uint64_t utilization_min = 0;
+	unsigned int index;
+	unsigned int i;
+	int ret = -ENODEV;
+
+	if (!pool || !encoder || !device_index)
+		return -EINVAL;
+
+	/* Place the stream where the projected hardware time is lowest,
+	 * trying the next best device when it fails to open. */
+	while (true) {
+		index = pool->devices_count;
+
+		for (i = 0; i < pool->devices_count; i++) {
+			if (pool->devices[i].unavailable)
+				continue;
+
+			utilization = (pool->devices[i].load + load) *
+				      pool_device_cost(pool, i);
+
+			if (index == pool->devices_count ||
+			    utilization < utilization_min) {
+				utilization_min = utilization;
+				index = i;
+			}
+		}
+
+		if (index == pool->devices_count)
+			return ret;
+
+		ret = v4l2_encoder_open_device(encoder,
+					       &pool->devices[index].device);
+		if (!ret)
+			break;
+
+		pool->devices[index].unavailable = true;
+	}
+
+	pool->devices[index].streams_count++;
+	pool->devices[index].load += load;
+
+	*device_index = index;
+
+	return 0;
+}
+
+void pool_encoder_release(struct pool *pool, uint64_t load,
+			  unsigned int device_index)
+{
+	if (!pool || device_index >= pool->devices_count)
+		return;
+
+	pool->devices[device_index].streams_count--;
+	pool->devices[device_index].load -= load;
+}
+
+void pool_device_measure(struct pool *pool, unsigned int device_index,
+			 uint64_t macroblocks, uint64_t hardware_time)
+{
+	if (!pool || device_index >= pool->devices_count)
+		return;
+
+	pool->devices[device_index].macroblocks += macroblocks;
+	pool->devices[device_index].hardware_time += hardware_time;
+}
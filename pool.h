@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <v4l2-encoder.h>
+
+#define POOL_CALIBRATION_FRAMES	8
+
+struct pool_device {
+	struct v4l2_encoder_device device;
+	unsigned int streams_count;
+
+	/* Failed to open, streams are placed elsewhere. */
+	bool unavailable;
+
+	/* Macroblocks per second expected from the assigned streams. */
+	uint64_t load;
+
+	/* Measured hardware cost. */
+	uint64_t hardware_time;
+	uint64_t macroblocks;
+};
+
+struct pool {
+	struct pool_device *devices;
+	unsigned int devices_count;
+};
+
+struct pool *pool_create(void);
+void pool_destroy(struct pool *pool);
+int pool_calibrate(struct pool *pool, unsigned int width, unsigned int height);
+int pool_encoder_open(struct pool *pool, struct v4l2_encoder *encoder,
+		      uint64_t load, unsigned int *device_index);
+void pool_encoder_release(struct pool *pool, uint64_t load,
+			  unsigned int device_index);
+void pool_device_measure(struct pool *pool, unsigned int device_index,
+			 uint64_t macroblocks, uint64_t hardware_time);
+
+#endif
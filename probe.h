@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#ifndef _PROBE_H_
+#define _PROBE_H_
+
+/* USDT probes for bpftrace and perf, built in whenever sys/sdt.h is around
+ * unless PROBE_DISABLE is defined. Each costs a nop when not traced. */
+#if !defined(PROBE_DISABLE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE_ENABLED
+#endif
+#endif
+
+#ifdef PROBE_ENABLED
+#define PROBE2(name, a, b) \
+	DTRACE_PROBE2(v4l2_encoder, name, a, b)
+#define PROBE3(name, a, b, c) \
+	DTRACE_PROBE3(v4l2_encoder, name, a, b, c)
+#define PROBE4(name, a, b, c, d) \
+	DTRACE_PROBE4(v4l2_encoder, name, a, b, c, d)
+#else
+#define PROBE2(name, a, b) \
+	do { (void)(a); (void)(b); } while (0)
+#define PROBE3(name, a, b, c) \
+	do { (void)(a); (void)(b); (void)(c); } while (0)
+#define PROBE4(name, a, b, c, d) \
+	do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+#endif
+
+#endif
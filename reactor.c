@@ -0,0 +1,528 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <linux/videodev2.h>
+
+#include <v4l2-encoder.h>
+#include <reactor.h>
+#include <ring.h>
+
+#define REACTOR_EVENTS_COUNT	64
+#define REACTOR_TIMEOUT_NS	300000000ULL
+
+/* Virtual time is scaled so that weights keep some precision. */
+#define REACTOR_WEIGHT_SCALE	1024
+
+static void reactor_stream_finish(struct reactor *reactor,
+				  struct reactor_stream *stream, int ret)
+{
+	if (stream->finished)
+		return;
+
+	v4l2_encoder_poll_detach(stream->encoder);
+
+	/* Requests left behind by a failed stream no longer count. */
+	reactor->devices[stream->device].pending_count -=
+		stream->encoder->pending_count;
+	reactor->pending_count -= stream->encoder->pending_count;
+
+	stream->ret = ret;
+	stream->finished = true;
+
+	reactor->streams_active--;
+}
+
+static uint64_t reactor_stream_release_time(struct reactor_stream *stream,
+					    unsigned int index)
+{
+	return stream->start_time + index * stream->period;
+}
+
+static bool reactor_stream_urgent(struct reactor_stream *stream,
+				  uint64_t time)
+{
+	uint64_t deadline;
+
+	if (!stream->deadline)
+		return false;
+
+	deadline = reactor_stream_release_time(stream, stream->frames_submitted) +
+		   stream->deadline;
+
+	/* Leave room for a couple of frames worth of hardware time. */
+	return deadline <= time + 2 * stream->hardware_time_average;
+}
+
+static struct reactor_stream *reactor_schedule_pick(struct reactor *reactor,
+						    uint64_t time,
+						    uint64_t *release_time)
+{
+	struct reactor_stream *stream;
+	struct reactor_stream *pick = NULL;
+	bool pick_urgent = false;
+	uint64_t release;
+	bool urgent;
+
+	*release_time = 0;
+
+	for (stream = reactor->streams; stream; stream = stream->next) {
+		struct reactor_device *device = &reactor->devices[stream->device];
+
+		if (stream->finished || stream->ended || stream->preparing)
+			continue;
+
+		/* Frames being prepared are bound for the device too. */
+		if (reactor->depth && device->pending_count +
+		    device->preparing_count >= reactor->depth)
+			continue;
+
+		if (!v4l2_encoder_output_buffer_available(stream->encoder))
+			continue;
+
+		release = reactor_stream_release_time(stream,
+						      stream->frames_submitted);
+		if (release > time) {
+			if (!*release_time || release < *release_time)
+				*release_time = release;
+
+			continue;
+		}
+
+		urgent = reactor_stream_urgent(stream, time);
+
+		/* Streams at risk of missing their deadline go first, in
+		 * deadline order. Others share the hardware time according
+		 * to their weight. */
+		if (!pick || (urgent && !pick_urgent))
+			goto pick;
+		else if (!urgent && pick_urgent)
+			continue;
+		else if (urgent && stream->deadline + release <
+			 pick->deadline +
+			 reactor_stream_release_time(pick, pick->frames_submitted))
+			goto pick;
+		else if (!urgent && stream->virtual_time < pick->virtual_time)
+			goto pick;
+
+		continue;
+
+pick:
+		pick = stream;
+		pick_urgent = urgent;
+	}
+
+	return pick;
+}
+
+static struct reactor_stream *reactor_stream_get(struct reactor *reactor,
+					       unsigned int index)
+{
+	struct reactor_stream *stream;
+
+	for (stream = reactor->streams; stream; stream = stream->next)
+		if (stream->index == index)
+			return stream;
+
+	return NULL;
+}
+
+/* Streams are only added before running, so the list is stable here. */
+static void *reactor_prepare(void *data)
+{
+	struct reactor *reactor = data;
+	struct reactor_stream *stream;
+	uint64_t value = 1;
+	unsigned int index;
+
+	while (true) {
+		ring_pop(reactor->prepare_ring, &index);
+		if (index == RING_END)
+			break;
+
+		stream = reactor_stream_get(reactor, index);
+		stream->prepare_ret = stream->prepare(stream,
+						      stream->prepare_buffer);
+
+		ring_push(reactor->prepared_ring, index);
+		write(reactor->prepared_fd, &value, sizeof(value));
+	}
+
+	return NULL;
+}
+
+static void reactor_schedule(struct reactor *reactor, uint64_t *release_time)
+{
+	struct reactor_stream *stream;
+	uint64_t time;
+
+	*release_time = 0;
+
+	while (true) {
+		time = v4l2_encoder_time();
+
+		stream = reactor_schedule_pick(reactor, time, release_time);
+		if (!stream)
+			break;
+
+		/* Only the picked stream grows its capture pool. */
+		stream->prepare_buffer =
+			v4l2_encoder_output_buffer_next(stream->encoder);
+		if (!stream->prepare_buffer) {
+			reactor_stream_finish(reactor, stream, -EBUSY);
+			continue;
+		}
+
+		stream->preparing = true;
+		reactor->devices[stream->device].preparing_count++;
+
+		ring_push(reactor->prepare_ring, stream->index);
+	}
+}
+
+/* Prepared frames are submitted from the reactor thread. */
+static void reactor_prepared(struct reactor *reactor)
+{
+	struct v4l2_encoder_frame frame = { 0 };
+	struct reactor_stream *stream;
+	unsigned int index;
+	uint64_t value;
+	int ret;
+
+	read(reactor->prepared_fd, &value, sizeof(value));
+
+	while (ring_try_pop(reactor->prepared_ring, &index)) {
+		stream = reactor_stream_get(reactor, index);
+
+		stream->preparing = false;
+		reactor->devices[stream->device].preparing_count--;
+
+		if (stream->finished)
+			continue;
+
+		ret = stream->prepare_ret;
+		if (ret > 0) {
+			stream->ended = true;
+
+			if (!stream->encoder->pending_count)
+				reactor_stream_finish(reactor, stream, 0);
+
+			continue;
+		}
+
+		frame.output_buffer = stream->prepare_buffer;
+
+		if (!ret)
+			ret = v4l2_encoder_submit(stream->encoder, &frame);
+
+		if (ret) {
+			reactor_stream_finish(reactor, stream, ret);
+			continue;
+		}
+
+		stream->frames_submitted++;
+		reactor->devices[stream->device].pending_count++;
+		reactor->pending_count++;
+	}
+}
+
+static int reactor_stream_process(struct reactor *reactor,
+				  struct reactor_stream *stream)
+{
+	struct v4l2_encoder *encoder = stream->encoder;
+	struct reactor_device *device = &reactor->devices[stream->device];
+	struct v4l2_encoder_frame frame = { 0 };
+	uint64_t hardware_time;
+	uint64_t deadline;
+	uint64_t start;
+	uint64_t time;
+	int ret;
+
+	while (!(ret = v4l2_encoder_reap(encoder, &frame))) {
+		time = v4l2_encoder_time();
+
+		/* The device runs one job at a time, which starts when it
+		 * is queued or when the previous one completes. Completions
+		 * of other streams may be processed out of order. */
+		start = frame.queue_time > device->complete_time ?
+			frame.queue_time : device->complete_time;
+		hardware_time = frame.complete_time > start ?
+				frame.complete_time - start : 0;
+
+		if (frame.complete_time > device->complete_time)
+			device->complete_time = frame.complete_time;
+
+		device->pending_count--;
+		device->hardware_time += hardware_time;
+		device->macroblocks += encoder->setup.width_mbs *
+				       encoder->setup.height_mbs;
+
+		reactor->progress_time = time;
+		reactor->pending_count--;
+
+		stream->hardware_time += hardware_time;
+		stream->hardware_time_average =
+			(7 * stream->hardware_time_average + hardware_time) / 8;
+		stream->virtual_time += hardware_time * REACTOR_WEIGHT_SCALE /
+					stream->weight;
+
+		if (stream->deadline) {
+			deadline = reactor_stream_release_time(stream,
+							       stream->frames_completed) +
+				   stream->deadline;
+			if (frame.complete_time > deadline)
+				stream->deadline_misses++;
+		}
+
+		stream->frames_completed++;
+
+		ret = stream->complete(stream, &frame);
+		if (ret)
+			return ret;
+	}
+
+	if (ret != -EAGAIN)
+		return ret;
+
+	return 0;
+}
+
+struct reactor *reactor_create(void)
+{
+	struct epoll_event event = { 0 };
+	struct reactor *reactor;
+	int ret;
+
+	reactor = calloc(1, sizeof(*reactor));
+	if (!reactor)
+		return NULL;
+
+	reactor->prepared_fd = -1;
+
+	reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (reactor->epoll_fd < 0)
+		goto error;
+
+	reactor->prepared_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (reactor->prepared_fd < 0)
+		goto error;
+
+	/* Told apart from stream events by their data. */
+	event.events = EPOLLIN;
+	event.data.ptr = reactor;
+
+	ret = epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->prepared_fd,
+			&event);
+	if (ret)
+		goto error;
+
+	return reactor;
+
+error:
+	if (reactor->prepared_fd >= 0)
+		close(reactor->prepared_fd);
+
+	if (reactor->epoll_fd >= 0)
+		close(reactor->epoll_fd);
+
+	free(reactor);
+
+	return NULL;
+}
+
+void reactor_destroy(struct reactor *reactor)
+{
+	struct reactor_stream *stream;
+
+	if (!reactor)
+		return;
+
+	for (stream = reactor->streams; stream; stream = stream->next)
+		if (!stream->finished)
+			v4l2_encoder_poll_detach(stream->encoder);
+
+	close(reactor->prepared_fd);
+	close(reactor->epoll_fd);
+	free(reactor);
+}
+
+int reactor_setup_depth(struct reactor *reactor, unsigned int depth)
+{
+	if (!reactor)
+		return -EINVAL;
+
+	reactor->depth = depth;
+
+	return 0;
+}
+
+int reactor_stream_add(struct reactor *reactor, struct reactor_stream *stream)
+{
+	struct reactor_stream *entry;
+	int ret;
+
+	if (!reactor || !stream || !stream->encoder || !stream->prepare ||
+	    !stream->complete || stream->device >= REACTOR_DEVICES_MAX)
+		return -EINVAL;
+
+	ret = v4l2_encoder_poll_attach(stream->encoder, reactor->epoll_fd,
+				       stream);
+	if (ret)
+		return ret;
+
+	if (!stream->weight)
+		stream->weight = 1;
+
+	stream->start_time = v4l2_encoder_time();
+	stream->virtual_time = 0;
+	stream->frames_submitted = 0;
+
+	stream->index = reactor->streams_count++;
+	stream->prepare_buffer = NULL;
+	stream->preparing = false;
+
+	/* Don't let late streams catch up at the expense of others. */
+	for (entry = reactor->streams; entry; entry = entry->next)
+		if (!entry->finished && entry->virtual_time > stream->virtual_time)
+			stream->virtual_time = entry->virtual_time;
+
+	stream->hardware_time = 0;
+	stream->hardware_time_average = 0;
+	stream->frames_completed = 0;
+	stream->deadline_misses = 0;
+
+	stream->ended = false;
+	stream->finished = false;
+	stream->ret = 0;
+
+	stream->next = reactor->streams;
+	reactor->streams = stream;
+	reactor->streams_active++;
+
+	return 0;
+}
+
+int reactor_run(struct reactor *reactor)
+{
+	struct epoll_event events[REACTOR_EVENTS_COUNT];
+	struct reactor_stream *stream;
+	uint64_t release_time;
+	uint64_t timeout;
+	uint64_t time;
+	unsigned int i;
+	int count;
+	int ret;
+
+	if (!reactor)
+		return -EINVAL;
+
+	/* Each stream has at most one frame being prepared. */
+	reactor->prepare_ring = ring_create(reactor->streams_count + 1);
+	reactor->prepared_ring = ring_create(reactor->streams_count + 1);
+	if (!reactor->prepare_ring || !reactor->prepared_ring) {
+		ret = -ENOMEM;
+		goto error_ring;
+	}
+
+	ret = pthread_create(&reactor->prepare_thread, NULL, reactor_prepare,
+			     reactor);
+	if (ret) {
+		ret = -ret;
+		goto error_ring;
+	}
+
+	reactor->progress_time = v4l2_encoder_time();
+
+	while (reactor->streams_active) {
+		reactor_schedule(reactor, &release_time);
+		if (!reactor->streams_active)
+			break;
+
+		time = v4l2_encoder_time();
+		timeout = REACTOR_TIMEOUT_NS;
+
+		/* Wake up in time for the next paced frame. */
+		if (release_time && release_time > time &&
+		    release_time - time < timeout)
+			timeout = release_time - time;
+		else if (release_time && release_time <= time)
+			timeout = 0;
+
+		count = epoll_wait(reactor->epoll_fd, events,
+				   REACTOR_EVENTS_COUNT,
+				   (timeout + 999999) / 1000000);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+
+			ret = -errno;
+			goto complete;
+		}
+
+		time = v4l2_encoder_time();
+
+		/* Completions are timestamped before any other work. */
+		for (i = 0; i < count; i++) {
+			stream = events[i].data.ptr;
+
+			if (events[i].data.ptr != reactor && !stream->finished)
+				v4l2_encoder_poll_event(stream->encoder, time);
+		}
+
+		if (!count && reactor->pending_count &&
+		    time - reactor->progress_time >= REACTOR_TIMEOUT_NS) {
+			fprintf(stderr, "Timed out waiting for encoders\n");
+			ret = -ETIMEDOUT;
+			goto complete;
+		}
+
+		for (i = 0; i < count; i++) {
+			if (events[i].data.ptr == reactor) {
+				reactor_prepared(reactor);
+				continue;
+			}
+
+			stream = events[i].data.ptr;
+
+			/* Request and video fds may both fire for a stream. */
+			if (stream->finished)
+				continue;
+
+			ret = reactor_stream_process(reactor, stream);
+			if (ret || (stream->ended &&
+				    !stream->encoder->pending_count))
+				reactor_stream_finish(reactor, stream, ret);
+		}
+	}
+
+	ret = 0;
+
+	for (stream = reactor->streams; stream; stream = stream->next) {
+		if (stream->ret) {
+			ret = stream->ret;
+			break;
+		}
+	}
+
+complete:
+	ring_push(reactor->prepare_ring, RING_END);
+	pthread_join(reactor->prepare_thread, NULL);
+
+error_ring:
+	ring_destroy(reactor->prepared_ring);
+	ring_destroy(reactor->prepare_ring);
+	reactor->prepared_ring = NULL;
+	reactor->prepare_ring = NULL;
+
+	return ret;
+}
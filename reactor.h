@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+struct ring;
+struct v4l2_encoder;
+struct v4l2_encoder_buffer;
+struct v4l2_encoder_frame;
+
+struct reactor_stream {
+	struct v4l2_encoder *encoder;
+
+	/* Fill the output buffer, return a positive value at end of stream.
+	 * Called from the prepare thread, one frame at a time. */
+	int (*prepare)(struct reactor_stream *stream,
+		       struct v4l2_encoder_buffer *output_buffer);
+	/* Consume the encoded frame before the next reap. */
+	int (*complete)(struct reactor_stream *stream,
+			struct v4l2_encoder_frame *frame);
+	void *data;
+
+	/* Scheduling */
+	unsigned int device;
+	unsigned int weight;
+	uint64_t period;
+	uint64_t deadline;
+
+	uint64_t start_time;
+	uint64_t virtual_time;
+	unsigned int frames_submitted;
+
+	/* Frame handed to the prepare thread. */
+	unsigned int index;
+	struct v4l2_encoder_buffer *prepare_buffer;
+	int prepare_ret;
+	bool preparing;
+
+	/* Statistics */
+	uint64_t hardware_time;
+	uint64_t hardware_time_average;
+	unsigned int frames_completed;
+	unsigned int deadline_misses;
+
+	bool ended;
+	bool finished;
+	int ret;
+
+	struct reactor_stream *next;
+};
+
+#define REACTOR_DEVICES_MAX	16
+
+struct reactor_device {
+	unsigned int pending_count;
+	unsigned int preparing_count;
+	uint64_t complete_time;
+
+	/* Statistics */
+	uint64_t hardware_time;
+	uint64_t macroblocks;
+};
+
+struct reactor {
+	int epoll_fd;
+
+	struct reactor_stream *streams;
+	unsigned int streams_count;
+	unsigned int streams_active;
+
+	/* Frames are filled on a separate thread, so that completions are
+	 * seen as soon as they happen. Its event fd is polled along. */
+	pthread_t prepare_thread;
+	struct ring *prepare_ring;
+	struct ring *prepared_ring;
+	int prepared_fd;
+
+	/* Requests allowed in flight on each device, 0 for no limit. */
+	unsigned int depth;
+	struct reactor_device devices[REACTOR_DEVICES_MAX];
+	unsigned int pending_count;
+	uint64_t progress_time;
+};
+
+struct reactor *reactor_create(void);
+void reactor_destroy(struct reactor *reactor);
+int reactor_setup_depth(struct reactor *reactor, unsigned int depth);
+int reactor_stream_add(struct reactor *reactor, struct reactor_stream *stream);
+int reactor_run(struct reactor *reactor);
+
+#endif
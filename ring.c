@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <ring.h>
+
+static void ring_wait(atomic_uint *word, unsigned int value)
+{
+	syscall(SYS_futex, (unsigned int *)word, FUTEX_WAIT_PRIVATE, value,
+		NULL, NULL, 0);
+}
+
+static void ring_wake(struct ring *ring, atomic_uint *word)
+{
+	/* Only pay for the syscall when the other side is sleeping. */
+	if (!atomic_load(&ring->waiters))
+		return;
+
+	syscall(SYS_futex, (unsigned int *)word, FUTEX_WAKE_PRIVATE, 1,
+		NULL, NULL, 0);
+}
+
+struct ring *ring_create(unsigned int size)
+{
+	struct ring *ring = NULL;
+	unsigned int size_pow2 = 1;
+
+	if (!size)
+		return NULL;
+
+	/* Power of two sizes turn the modulo into a mask. */
+	while (size_pow2 < size)
+		size_pow2 <<= 1;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		goto error;
+
+	ring->entries = calloc(size_pow2, sizeof(*ring->entries));
+	if (!ring->entries)
+		goto error;
+
+	ring->size = size_pow2;
+
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->waiters, 0);
+
+	return ring;
+
+error:
+	if (ring)
+		free(ring);
+
+	return NULL;
+}
+
+void ring_destroy(struct ring *ring)
+{
+	if (!ring)
+		return;
+
+	if (ring->entries)
+		free(ring->entries);
+
+	free(ring);
+}
+
+bool ring_try_push(struct ring *ring, unsigned int value)
+{
+	unsigned int head, tail;
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (tail - head >= ring->size)
+		return false;
+
+	ring->entries[tail & (ring->size - 1)] = value;
+
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_seq_cst);
+	ring_wake(ring, &ring->tail);
+
+	return true;
+}
+
+void ring_push(struct ring *ring, unsigned int value)
+{
+	unsigned int head;
+
+	while (!ring_try_push(ring, value)) {
+		head = atomic_load(&ring->head);
+
+		atomic_fetch_add(&ring->waiters, 1);
+
+		/* Sleep until the consumer frees an entry. */
+		if (atomic_load(&ring->tail) - head >= ring->size)
+			ring_wait(&ring->head, head);
+
+		atomic_fetch_sub(&ring->waiters, 1);
+	}
+}
+
+bool ring_try_pop(struct ring *ring, unsigned int *value)
+{
+	unsigned int head, tail;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (head == tail)
+		return false;
+
+	*value = ring->entries[head & (ring->size - 1)];
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_seq_cst);
+	ring_wake(ring, &ring->head);
+
+	return true;
+}
+
+void ring_pop(struct ring *ring, unsigned int *value)
+{
+	unsigned int tail;
+
+	while (!ring_try_pop(ring, value)) {
+		tail = atomic_load(&ring->tail);
+
+		atomic_fetch_add(&ring->waiters, 1);
+
+		/* Sleep until the producer adds an entry. */
+		if (tail == atomic_load(&ring->head))
+			ring_wait(&ring->tail, tail);
+
+		atomic_fetch_sub(&ring->waiters, 1);
+	}
+}
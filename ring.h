@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/* Bounded single-producer single-consumer ring of indexes. */
+struct ring {
+	unsigned int *entries;
+	unsigned int size;
+
+	atomic_uint head;
+	atomic_uint tail;
+	atomic_uint waiters;
+};
+
+#define RING_END	(~0U)
+
+struct ring *ring_create(unsigned int size);
+void ring_destroy(struct ring *ring);
+bool ring_try_push(struct ring *ring, unsigned int value);
+void ring_push(struct ring *ring, unsigned int value);
+bool ring_try_pop(struct ring *ring, unsigned int *value);
+void ring_pop(struct ring *ring, unsigned int *value);
+
+#endif
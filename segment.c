@@ -0,0 +1,277 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include <linux/videodev2.h>
+
+#include <v4l2-encoder.h>
+#include <segment.h>
+
+static int segment_encode(struct segment_context *context,
+			  unsigned int index, int fd)
+{
+	struct segment_run *run = context->run;
+	struct v4l2_encoder *encoder = context->encoder;
+	unsigned int depth = encoder->setup.pipeline_depth;
+	unsigned int frame = index * run->segment_frames;
+	unsigned int frames;
+	unsigned int i;
+	int bitstream_fd;
+	int ret;
+
+	frames = run->frames - frame;
+	if (frames > run->segment_frames)
+		frames = run->segment_frames;
+
+	ret = v4l2_encoder_seek(encoder, frame);
+	if (ret)
+		return ret;
+
+	/* Slices go to the segment, parameter sets were written once. */
+	bitstream_fd = encoder->bitstream_fd;
+	encoder->bitstream_fd = fd;
+
+	for (i = 0; i < frames; i++) {
+		ret = v4l2_encoder_prepare(encoder);
+		if (ret)
+			goto complete;
+
+		ret = v4l2_encoder_queue(encoder);
+		if (ret)
+			goto complete;
+
+		if (encoder->pending_count < depth)
+			continue;
+
+		ret = v4l2_encoder_dequeue(encoder);
+		if (ret)
+			goto complete;
+
+		ret = v4l2_encoder_complete(encoder);
+		if (ret)
+			goto complete;
+	}
+
+	/* The next segment restarts with an IDR, drain this one first. */
+	while (encoder->pending_count) {
+		ret = v4l2_encoder_dequeue(encoder);
+		if (ret)
+			goto complete;
+
+		ret = v4l2_encoder_complete(encoder);
+		if (ret)
+			goto complete;
+	}
+
+	ret = 0;
+
+complete:
+	encoder->bitstream_fd = bitstream_fd;
+
+	return ret;
+}
+
+static void *segment_thread(void *data)
+{
+	struct segment_context *context = data;
+	struct segment_run *run = context->run;
+	unsigned int index;
+	int ret = 0;
+	int fd;
+
+	while (true) {
+		pthread_mutex_lock(&run->lock);
+
+		/* Bound the memory held by segments waiting to be written. */
+		while (!run->abort && run->encode_index < run->segments_count &&
+		       run->encode_index >= run->write_index +
+					    2 * run->contexts_count)
+			pthread_cond_wait(&run->cond, &run->lock);
+
+		if (run->abort || run->encode_index >= run->segments_count) {
+			pthread_mutex_unlock(&run->lock);
+			break;
+		}
+
+		index = run->encode_index++;
+
+		pthread_mutex_unlock(&run->lock);
+
+		fd = memfd_create("segment", MFD_CLOEXEC);
+		if (fd < 0) {
+			fprintf(stderr, "Failed to create segment memory\n");
+			ret = -errno;
+			break;
+		}
+
+		ret = segment_encode(context, index, fd);
+		if (ret) {
+			fprintf(stderr, "Failed to encode segment %u\n", index);
+			close(fd);
+			break;
+		}
+
+		pthread_mutex_lock(&run->lock);
+		run->segments[index].fd = fd;
+		run->segments[index].done = true;
+		pthread_cond_broadcast(&run->cond);
+		pthread_mutex_unlock(&run->lock);
+	}
+
+	if (ret) {
+		pthread_mutex_lock(&run->lock);
+		run->abort = true;
+		pthread_cond_broadcast(&run->cond);
+		pthread_mutex_unlock(&run->lock);
+	}
+
+	context->ret = ret;
+
+	return NULL;
+}
+
+static int segment_write(struct segment *segment, int bitstream_fd)
+{
+	struct stat stat;
+	off_t offset = 0;
+	ssize_t count;
+	int ret;
+
+	ret = fstat(segment->fd, &stat);
+	if (ret)
+		return -errno;
+
+	while (offset < stat.st_size) {
+		count = sendfile(bitstream_fd, segment->fd, &offset,
+				 stat.st_size - offset);
+		if (count <= 0) {
+			fprintf(stderr, "Failed to write segment\n");
+			return count ? -errno : -EIO;
+		}
+	}
+
+	return 0;
+}
+
+int segment_run(struct v4l2_encoder **encoders, unsigned int contexts_count,
+		unsigned int frames, int bitstream_fd)
+{
+	struct segment_run run = { 0 };
+	struct segment *segment;
+	unsigned int started = 0;
+	unsigned int i;
+	int ret = 0;
+
+	if (!encoders || !contexts_count || bitstream_fd < 0)
+		return -EINVAL;
+
+	/* Every segment is a closed GOP starting with an IDR. */
+	run.segment_frames = encoders[0]->setup.gop_size;
+	run.frames = frames;
+	run.segments_count = (frames + run.segment_frames - 1) /
+			     run.segment_frames;
+	run.contexts_count = contexts_count;
+
+	for (i = 1; i < contexts_count; i++) {
+		if (encoders[i]->setup.gop_size != run.segment_frames)
+			return -EINVAL;
+	}
+
+	run.segments = calloc(run.segments_count, sizeof(*run.segments));
+	run.contexts = calloc(contexts_count, sizeof(*run.contexts));
+	if (!run.segments || !run.contexts) {
+		ret = -ENOMEM;
+		goto complete;
+	}
+
+	for (i = 0; i < run.segments_count; i++)
+		run.segments[i].fd = -1;
+
+	pthread_mutex_init(&run.lock, NULL);
+	pthread_cond_init(&run.cond, NULL);
+
+	for (i = 0; i < contexts_count; i++) {
+		struct segment_context *context = &run.contexts[i];
+
+		context->run = &run;
+		context->encoder = encoders[i];
+
+		ret = pthread_create(&context->thread, NULL, segment_thread,
+				     context);
+		if (ret) {
+			ret = -ret;
+			break;
+		}
+
+		started++;
+	}
+
+	/* Stitch the segments back in order as they become available. */
+	while (!ret && run.write_index < run.segments_count) {
+		segment = &run.segments[run.write_index];
+
+		pthread_mutex_lock(&run.lock);
+
+		while (!run.abort && !segment->done)
+			pthread_cond_wait(&run.cond, &run.lock);
+
+		pthread_mutex_unlock(&run.lock);
+
+		if (!segment->done) {
+			ret = -EIO;
+			break;
+		}
+
+		ret = segment_write(segment, bitstream_fd);
+
+		close(segment->fd);
+		segment->fd = -1;
+
+		pthread_mutex_lock(&run.lock);
+		run.write_index++;
+		pthread_cond_broadcast(&run.cond);
+		pthread_mutex_unlock(&run.lock);
+	}
+
+	if (ret) {
+		pthread_mutex_lock(&run.lock);
+		run.abort = true;
+		pthread_cond_broadcast(&run.cond);
+		pthread_mutex_unlock(&run.lock);
+	}
+
+	for (i = 0; i < started; i++) {
+		pthread_join(run.contexts[i].thread, NULL);
+
+		if (!ret)
+			ret = run.contexts[i].ret;
+	}
+
+	for (i = 0; i < run.segments_count; i++)
+		if (run.segments[i].fd >= 0)
+			close(run.segments[i].fd);
+
+	pthread_cond_destroy(&run.cond);
+	pthread_mutex_destroy(&run.lock);
+
+complete:
+	if (run.contexts)
+		free(run.contexts);
+
+	if (run.segments)
+		free(run.segments);
+
+	return ret;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#ifndef _SEGMENT_H_
+#define _SEGMENT_H_
+
+#include <stdbool.h>
+#include <pthread.h>
+
+struct v4l2_encoder;
+
+struct segment {
+	/* In-memory bitstream, -1 until encoded. */
+	int fd;
+	bool done;
+};
+
+struct segment_context {
+	struct segment_run *run;
+	struct v4l2_encoder *encoder;
+	pthread_t thread;
+	int ret;
+};
+
+struct segment_run {
+	struct segment_context *contexts;
+	unsigned int contexts_count;
+
+	struct segment *segments;
+	unsigned int segments_count;
+	unsigned int segment_frames;
+	unsigned int frames;
+
+	/* Next segment to encode and next one to write out. */
+	unsigned int encode_index;
+	unsigned int write_index;
+	bool abort;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+int segment_run(struct v4l2_encoder **encoders, unsigned int contexts_count,
+		unsigned int frames, int bitstream_fd);
+
+#endif
@@ -0,0 +1,492 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <linux/videodev2.h>
+#include <linux/media.h>
+
+#include <v4l2.h>
+#include <session.h>
+
+struct session {
+	bool replay;
+	uint64_t start_time;
+	pthread_mutex_t lock;
+
+	/* Record */
+	FILE *file;
+	void *payload;
+	unsigned int payload_size;
+	unsigned int payload_length;
+
+	/* Replay, with the whole trace in memory. */
+	uint8_t *data;
+	size_t size;
+	size_t controls_offset;
+	size_t buffers_offset;
+	size_t bitstreams_offset;
+	unsigned int frames;
+};
+
+/* Opened before any device and closed after all of them. */
+static struct session *session;
+
+static uint64_t session_time(void)
+{
+	struct timespec timespec;
+
+	clock_gettime(CLOCK_MONOTONIC, &timespec);
+
+	return timespec.tv_sec * 1000000000ULL + timespec.tv_nsec;
+}
+
+static struct session *session_create(bool replay)
+{
+	struct session *session;
+
+	session = calloc(1, sizeof(*session));
+	if (!session)
+		return NULL;
+
+	session->replay = replay;
+	session->start_time = session_time();
+	pthread_mutex_init(&session->lock, NULL);
+
+	return session;
+}
+
+static void session_destroy(struct session *session)
+{
+	pthread_mutex_destroy(&session->lock);
+
+	if (session->file)
+		fclose(session->file);
+
+	free(session->payload);
+	free(session->data);
+	free(session);
+}
+
+int session_record_open(const char *path)
+{
+	struct session_header header = {
+		.magic = SESSION_MAGIC,
+		.version = SESSION_VERSION,
+	};
+
+	if (!path)
+		return -EINVAL;
+
+	if (session)
+		return -EBUSY;
+
+	session = session_create(false);
+	if (!session)
+		return -ENOMEM;
+
+	session->file = fopen(path, "w");
+	if (!session->file)
+		goto error;
+
+	if (fwrite(&header, sizeof(header), 1, session->file) != 1)
+		goto error;
+
+	return 0;
+
+error:
+	session_destroy(session);
+	session = NULL;
+
+	return -EIO;
+}
+
+int session_replay_open(const char *path)
+{
+	struct session_header *header;
+	FILE *file;
+	long size;
+
+	if (!path)
+		return -EINVAL;
+
+	if (session)
+		return -EBUSY;
+
+	session = session_create(true);
+	if (!session)
+		return -ENOMEM;
+
+	file = fopen(path, "r");
+	if (!file)
+		goto error;
+
+	if (fseek(file, 0, SEEK_END) || (size = ftell(file)) < 0 ||
+	    fseek(file, 0, SEEK_SET))
+		goto error_file;
+
+	if ((size_t)size < sizeof(*header))
+		goto error_file;
+
+	session->data = malloc(size);
+	if (!session->data)
+		goto error_file;
+
+	if (fread(session->data, size, 1, file) != 1)
+		goto error_file;
+
+	fclose(file);
+
+	header = (struct session_header *)session->data;
+	if (header->magic != SESSION_MAGIC ||
+	    header->version != SESSION_VERSION)
+		goto error;
+
+	session->size = size;
+	session->controls_offset = sizeof(*header);
+	session->buffers_offset = sizeof(*header);
+	session->bitstreams_offset = sizeof(*header);
+
+	return 0;
+
+error_file:
+	fclose(file);
+
+error:
+	session_destroy(session);
+	session = NULL;
+
+	return -EIO;
+}
+
+void session_close(void)
+{
+	if (!session)
+		return;
+
+	if (session->replay)
+		printf("Replayed %u recorded frames\n", session->frames);
+
+	session_destroy(session);
+	session = NULL;
+}
+
+bool session_active(void)
+{
+	return session;
+}
+
+static int session_payload_append(struct session *session, const void *data,
+				  unsigned int size)
+{
+	unsigned int length;
+	void *payload;
+
+	if (session->payload_size + size > session->payload_length) {
+		length = session->payload_length ? session->payload_length : 4096;
+
+		while (session->payload_size + size > length)
+			length *= 2;
+
+		payload = realloc(session->payload, length);
+		if (!payload)
+			return -ENOMEM;
+
+		session->payload = payload;
+		session->payload_length = length;
+	}
+
+	memcpy(session->payload + session->payload_size, data, size);
+	session->payload_size += size;
+
+	return 0;
+}
+
+static void session_payload_controls(struct session *session,
+				     struct v4l2_ext_controls *ext_controls)
+{
+	struct v4l2_ext_control *control;
+	uint32_t entry[2];
+	unsigned int i;
+
+	for (i = 0; ext_controls->controls && i < ext_controls->count; i++) {
+		control = &ext_controls->controls[i];
+
+		entry[0] = control->id;
+		entry[1] = control->size;
+		session_payload_append(session, entry, sizeof(entry));
+
+		/* Simple controls keep their value in place. */
+		if (control->size)
+			session_payload_append(session, control->ptr,
+					       control->size);
+		else
+			session_payload_append(session, &control->value64,
+					       sizeof(control->value64));
+	}
+}
+
+static void session_payload_planes(struct session *session,
+				   struct v4l2_buffer *buffer)
+{
+	if (!v4l2_type_mplane_check(buffer->type) || !buffer->m.planes ||
+	    buffer->length > VIDEO_MAX_PLANES)
+		return;
+
+	session_payload_append(session, buffer->m.planes,
+			       buffer->length * sizeof(*buffer->m.planes));
+}
+
+static void session_write(struct session *session, uint32_t type,
+			  unsigned long request, int result, uint64_t start)
+{
+	struct session_record record = { 0 };
+	uint64_t time;
+
+	time = session_time();
+
+	record.type = type;
+	record.request = request;
+	record.result = result;
+	record.size = session->payload_size;
+	record.time = start - session->start_time;
+	record.duration = time - start;
+
+	fwrite(&record, sizeof(record), 1, session->file);
+	fwrite(session->payload, session->payload_size, 1, session->file);
+
+	session->payload_size = 0;
+}
+
+static void session_record_ioctl(struct session *session,
+				 unsigned long request, void *data, int result,
+				 uint64_t start)
+{
+	if (data && _IOC_DIR(request) != _IOC_NONE)
+		session_payload_append(session, data, _IOC_SIZE(request));
+
+	switch (request) {
+	case VIDIOC_S_EXT_CTRLS:
+	case VIDIOC_G_EXT_CTRLS:
+	case VIDIOC_TRY_EXT_CTRLS:
+		session_payload_controls(session, data);
+		break;
+	case VIDIOC_QBUF:
+	case VIDIOC_DQBUF:
+	case VIDIOC_QUERYBUF:
+		session_payload_planes(session, data);
+		break;
+	}
+
+	session_write(session, SESSION_RECORD_IOCTL, request, result, start);
+}
+
+/* Find the next successful record of the type and ioctl from the offset,
+ * which is moved past it. */
+static struct session_record *session_replay_next(struct session *session,
+						  size_t *offset,
+						  uint32_t type,
+						  unsigned long request)
+{
+	struct session_record *record;
+
+	while (*offset + sizeof(*record) <= session->size) {
+		record = (struct session_record *)(session->data + *offset);
+
+		if (*offset + sizeof(*record) + record->size > session->size)
+			break;
+
+		*offset += sizeof(*record) + record->size;
+
+		if (record->type == type && record->result >= 0 &&
+		    record->request == (uint32_t)request)
+			return record;
+	}
+
+	fprintf(stderr, "Failed to find more recorded frames\n");
+
+	return NULL;
+}
+
+static int session_replay_controls(struct session *session,
+				   struct v4l2_ext_controls *ext_controls)
+{
+	struct v4l2_ext_controls *recorded;
+	struct v4l2_ext_control *control;
+	struct session_record *record;
+	uint8_t *payload, *end;
+	uint32_t *entry;
+	unsigned int size;
+	unsigned int i, j;
+
+	do {
+		record = session_replay_next(session,
+					     &session->controls_offset,
+					     SESSION_RECORD_IOCTL,
+					     VIDIOC_G_EXT_CTRLS);
+		if (!record)
+			return -ENODATA;
+
+		if (record->size < sizeof(*recorded))
+			return -EIO;
+
+		recorded = (struct v4l2_ext_controls *)(record + 1);
+	} while (recorded->which != ext_controls->which);
+	payload = (uint8_t *)(recorded + 1);
+	end = (uint8_t *)(record + 1) + record->size;
+
+	for (i = 0; i < recorded->count; i++) {
+		if (payload + 2 * sizeof(*entry) > end)
+			return -EIO;
+
+		entry = (uint32_t *)payload;
+		payload += 2 * sizeof(*entry);
+		size = entry[1] ? entry[1] : sizeof(control->value64);
+
+		if (payload + size > end)
+			return -EIO;
+
+		for (j = 0; j < ext_controls->count; j++) {
+			control = &ext_controls->controls[j];
+
+			if (control->id != entry[0] || control->size != entry[1])
+				continue;
+
+			if (control->size)
+				memcpy(control->ptr, payload, size);
+			else
+				memcpy(&control->value64, payload, size);
+		}
+
+		payload += size;
+	}
+
+	return 0;
+}
+
+/* Only the encoded size and error state come from the trace, the buffer
+ * itself belongs to the stand-in device. */
+static int session_replay_buffer(struct session *session,
+				 struct v4l2_buffer *buffer)
+{
+	struct v4l2_buffer *recorded;
+	struct v4l2_plane *planes;
+	struct session_record *record;
+	unsigned int i;
+
+	if (buffer->type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+		return 0;
+
+	do {
+		record = session_replay_next(session, &session->buffers_offset,
+					     SESSION_RECORD_IOCTL, VIDIOC_DQBUF);
+		if (!record)
+			return -ENODATA;
+
+		if (record->size < sizeof(*recorded))
+			return -EIO;
+
+		recorded = (struct v4l2_buffer *)(record + 1);
+	} while (recorded->type != buffer->type);
+	planes = (struct v4l2_plane *)(recorded + 1);
+
+	if (record->size < sizeof(*recorded) +
+			   recorded->length * sizeof(*planes))
+		return -EIO;
+
+	buffer->flags &= ~V4L2_BUF_FLAG_ERROR;
+	buffer->flags |= recorded->flags & V4L2_BUF_FLAG_ERROR;
+
+	for (i = 0; i < buffer->length && i < recorded->length; i++)
+		buffer->m.planes[i].bytesused = planes[i].bytesused;
+
+	session->frames++;
+
+	return 0;
+}
+
+/* Called with the result of each ioctl, either 0 or above or a negative
+ * error code, returning the one to hand back to the caller. */
+int session_ioctl(unsigned long request, void *data, int result,
+		  uint64_t start)
+{
+	int ret = result;
+
+	if (!session)
+		return result;
+
+	pthread_mutex_lock(&session->lock);
+
+	if (!session->replay) {
+		session_record_ioctl(session, request, data, result, start);
+		goto complete;
+	}
+
+	if (result < 0)
+		goto complete;
+
+	if (request == VIDIOC_G_EXT_CTRLS)
+		ret = session_replay_controls(session, data);
+	else if (request == VIDIOC_DQBUF)
+		ret = session_replay_buffer(session, data);
+
+	if (!ret)
+		ret = result;
+
+complete:
+	pthread_mutex_unlock(&session->lock);
+
+	return ret;
+}
+
+void session_poll(int result, uint64_t start)
+{
+	if (!session || session->replay)
+		return;
+
+	pthread_mutex_lock(&session->lock);
+	session_write(session, SESSION_RECORD_POLL, V4L2_IOCTL_REQUEST_POLL,
+		      result, start);
+	pthread_mutex_unlock(&session->lock);
+}
+
+/* Record the encoded slice, or fill the buffer with the recorded one. */
+int session_bitstream(void *data, unsigned int size, unsigned int length)
+{
+	struct session_record *record;
+	int ret = 0;
+
+	if (!session || !data)
+		return 0;
+
+	pthread_mutex_lock(&session->lock);
+
+	if (!session->replay) {
+		session_payload_append(session, data, size);
+		session_write(session, SESSION_RECORD_BITSTREAM, 0, size,
+			      session_time());
+		goto complete;
+	}
+
+	record = session_replay_next(session, &session->bitstreams_offset,
+				     SESSION_RECORD_BITSTREAM, 0);
+	if (!record) {
+		ret = -ENODATA;
+		goto complete;
+	}
+
+	memcpy(data, record + 1, record->size < length ? record->size : length);
+
+complete:
+	pthread_mutex_unlock(&session->lock);
+
+	return ret;
+}
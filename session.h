@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SESSION_MAGIC	0x53324c56
+#define SESSION_VERSION	1
+
+enum session_record_type {
+	SESSION_RECORD_IOCTL,
+	SESSION_RECORD_POLL,
+	SESSION_RECORD_BITSTREAM,
+};
+
+struct session_header {
+	uint32_t magic;
+	uint32_t version;
+};
+
+/* Followed by size bytes: the ioctl argument, then its control payloads or
+ * planes, or the bitstream itself. */
+struct session_record {
+	uint32_t type;
+	uint32_t request;
+	int32_t result;
+	uint32_t size;
+	/* Nanoseconds since the session was opened. */
+	uint64_t time;
+	uint64_t duration;
+};
+
+int session_record_open(const char *path);
+int session_replay_open(const char *path);
+void session_close(void);
+bool session_active(void);
+int session_ioctl(unsigned long request, void *data, int result,
+		  uint64_t start);
+void session_poll(int result, uint64_t start);
+int session_bitstream(void *data, unsigned int size, unsigned int length);
+
+#endif
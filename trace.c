@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <linux/videodev2.h>
+
+#include <ring.h>
+#include <trace.h>
+
+static void trace_record_write(FILE *file, struct trace_record *record)
+{
+	unsigned int i;
+
+	fprintf(file, "{\"frame\":%llu,\"type\":\"%c\",\"idr_pic_id\":%u,"
+		"\"frame_num\":%u,\"qp\":%u,\"bits_target\":%u,"
+		"\"bits_left\":%u,\"bits_used\":%u,\"rlc_count\":%u,"
+		"\"qp_average\":%u,\"cp_distance_mbs\":%u,\"cp_target\":[",
+		(unsigned long long)record->frame,
+		record->slice_type == V4L2_H264_SLICE_TYPE_I ? 'I' : 'P',
+		record->idr_pic_id, record->frame_num, record->qp,
+		record->bits_target, record->bits_left, record->bits_used,
+		record->rlc_count, record->qp_average,
+		record->cp_distance_mbs);
+
+	for (i = 0; i < TRACE_CHECKPOINTS; i++)
+		fprintf(file, "%s%u", i ? "," : "", record->cp_target[i]);
+
+	fprintf(file, "],\"hardware_us\":%.1f,\"total_us\":%.1f}\n",
+		record->hardware_time / 1000.0, record->total_time / 1000.0);
+}
+
+static void *trace_writer(void *data)
+{
+	struct trace *trace = data;
+	unsigned int index;
+
+	while (1) {
+		ring_pop(trace->ready, &index);
+		if (index == RING_END)
+			break;
+
+		trace_record_write(trace->file, &trace->records[index]);
+
+		ring_push(trace->free, index);
+	}
+
+	return NULL;
+}
+
+struct trace *trace_create(const char *path)
+{
+	struct trace *trace;
+	unsigned int i;
+
+	trace = calloc(1, sizeof(*trace));
+	if (!trace)
+		return NULL;
+
+	trace->file = fopen(path, "w");
+	if (!trace->file)
+		goto error;
+
+	/* One more entry in the ready ring for the end marker. */
+	trace->free = ring_create(TRACE_RECORDS);
+	trace->ready = ring_create(TRACE_RECORDS + 1);
+	if (!trace->free || !trace->ready)
+		goto error;
+
+	for (i = 0; i < TRACE_RECORDS; i++)
+		ring_push(trace->free, i);
+
+	atomic_init(&trace->dropped, 0);
+
+	if (pthread_create(&trace->thread, NULL, trace_writer, trace))
+		goto error;
+
+	return trace;
+
+error:
+	if (trace->file)
+		fclose(trace->file);
+
+	ring_destroy(trace->free);
+	ring_destroy(trace->ready);
+	free(trace);
+
+	return NULL;
+}
+
+void trace_destroy(struct trace *trace)
+{
+	unsigned int dropped;
+
+	if (!trace)
+		return;
+
+	ring_push(trace->ready, RING_END);
+	pthread_join(trace->thread, NULL);
+
+	dropped = atomic_load(&trace->dropped);
+	if (dropped)
+		fprintf(stderr, "Dropped %u trace records\n", dropped);
+
+	fclose(trace->file);
+
+	ring_destroy(trace->free);
+	ring_destroy(trace->ready);
+	free(trace);
+}
+
+/* Never blocks the encoder, NULL is returned when all records are busy. */
+struct trace_record *trace_record_get(struct trace *trace)
+{
+	unsigned int index;
+
+	if (!ring_try_pop(trace->free, &index)) {
+		atomic_fetch_add(&trace->dropped, 1);
+		return NULL;
+	}
+
+	return &trace->records[index];
+}
+
+void trace_record_commit(struct trace *trace, struct trace_record *record)
+{
+	ring_push(trace->ready, record - trace->records);
+}
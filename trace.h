@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <ring.h>
+
+#define TRACE_RECORDS		256
+#define TRACE_CHECKPOINTS	10
+
+struct trace_record {
+	uint64_t frame;
+	unsigned int slice_type;
+	unsigned int idr_pic_id;
+	unsigned int frame_num;
+
+	/* Rate control, as the frame was queued. */
+	unsigned int qp;
+	unsigned int bits_target;
+	unsigned int bits_left;
+	unsigned int cp_distance_mbs;
+	unsigned int cp_target[TRACE_CHECKPOINTS];
+
+	/* Feedback */
+	unsigned int bits_used;
+	unsigned int rlc_count;
+	unsigned int qp_average;
+
+	/* Nanoseconds from queueing to completion and to feedback. */
+	uint64_t hardware_time;
+	uint64_t total_time;
+};
+
+/* Records are filled by a single producer and written out as JSON lines by
+ * a background thread, dropped when that thread falls behind. */
+struct trace {
+	FILE *file;
+
+	struct trace_record records[TRACE_RECORDS];
+	struct ring *free;
+	struct ring *ready;
+
+	pthread_t thread;
+	atomic_uint dropped;
+};
+
+struct trace *trace_create(const char *path);
+void trace_destroy(struct trace *trace);
+struct trace_record *trace_record_get(struct trace *trace);
+void trace_record_commit(struct trace *trace, struct trace_record *record);
+
+#endif
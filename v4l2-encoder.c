@@ -8,10 +8,14 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <libudev.h>
 
 #include <linux/videodev2.h>
@@ -25,201 +29,1694 @@
 #include <bitstream.h>
 #include <unit.h>
 #include <csc.h>
+#include <loopback.h>
+#include <session.h>
+#include <probe.h>
 
 #define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
 
+#define V4L2_ENCODER_OVERFLOW_QP_DELTA	6
+
+#define V4L2_ENCODER_PROBE_MAGIC	0x50653476
+#define V4L2_ENCODER_PROBE_ENTRIES	16
+
+/* Devices are identified by their node, which is created anew along with
+ * the device. */
+struct v4l2_encoder_probe_entry {
+	uint32_t magic;
+
+	dev_t rdev;
+	ino_t ino;
+	struct timespec ctime;
+
+	char driver[32];
+	char card[32];
+
+	unsigned int capabilities;
+	unsigned int output_type;
+	unsigned int output_capabilities;
+	unsigned int capture_type;
+	unsigned int capture_capabilities;
+};
+
+uint64_t v4l2_encoder_time(void)
+{
+	struct timespec timespec;
+
+	clock_gettime(CLOCK_MONOTONIC, &timespec);
+
+	return timespec.tv_sec * 1000000000ULL + timespec.tv_nsec;
+}
+
+static const char *v4l2_encoder_stage_names[] = {
+	[V4L2_ENCODER_STAGE_DRAW] = "draw",
+	[V4L2_ENCODER_STAGE_CSC] = "csc",
+	[V4L2_ENCODER_STAGE_QBUF] = "qbuf",
+	[V4L2_ENCODER_STAGE_CONTROLS] = "controls",
+	[V4L2_ENCODER_STAGE_REQUEST_QUEUE] = "request queue",
+	[V4L2_ENCODER_STAGE_HARDWARE] = "hardware",
+	[V4L2_ENCODER_STAGE_DQBUF] = "dqbuf",
+	[V4L2_ENCODER_STAGE_WRITE] = "write",
+	[V4L2_ENCODER_STAGE_TOTAL] = "total",
+};
+
+/* Timestamps are only taken with stats enabled, zero otherwise. */
+static uint64_t v4l2_encoder_stats_time(struct v4l2_encoder *encoder)
+{
+	if (!encoder->stats)
+		return 0;
+
+	return v4l2_encoder_time();
+}
+
+/* Record the time spent since start and return the current time, to start
+ * the next stage from. */
+static uint64_t v4l2_encoder_stats_record(struct v4l2_encoder *encoder,
+					  unsigned int stage, uint64_t start)
+{
+	uint64_t time;
+
+	if (!encoder->stats)
+		return 0;
+
+	time = v4l2_encoder_time();
+	histogram_record(&encoder->stats->stages[stage], time - start);
+
+	return time;
+}
+
+/* Counters are only read with perf enabled, a zero sample marks a failed
+ * read. */
+static void v4l2_encoder_perf_start(struct v4l2_encoder *encoder,
+				    struct perf_sample *sample)
+{
+	if (!encoder->stats || !encoder->stats->perf)
+		return;
+
+	if (perf_read(sample))
+		memset(sample, 0, sizeof(*sample));
+}
+
+/* Record the counts since the sample and update it for the next stage. */
+static void v4l2_encoder_perf_record(struct v4l2_encoder *encoder,
+				     unsigned int stage,
+				     struct perf_sample *sample)
+{
+	struct perf_sample current;
+	unsigned int i;
+
+	if (!encoder->stats || !encoder->stats->perf)
+		return;
+
+	if (perf_read(&current)) {
+		memset(sample, 0, sizeof(*sample));
+		return;
+	}
+
+	if (sample->values[PERF_COUNTER_CYCLES])
+		for (i = 0; i < PERF_COUNTERS; i++)
+			histogram_record(&encoder->stats->counters[stage][i],
+					 current.values[i] - sample->values[i]);
+
+	*sample = current;
+}
+
+int v4l2_encoder_stats_enable(struct v4l2_encoder *encoder)
+{
+	if (!encoder)
+		return -EINVAL;
+
+	if (encoder->stats)
+		return 0;
+
+	encoder->stats = calloc(1, sizeof(*encoder->stats));
+	if (!encoder->stats)
+		return -ENOMEM;
+
+	encoder->stats->start_time = v4l2_encoder_time();
+
+	return 0;
+}
+
+/* Requires stats, counters are opened for the calling thread to check that
+ * they are available and lazily for the others. */
+int v4l2_encoder_perf_enable(struct v4l2_encoder *encoder)
+{
+	int ret;
+
+	if (!encoder || !encoder->stats)
+		return -EINVAL;
+
+	ret = perf_enable();
+	if (ret)
+		return ret;
+
+	encoder->stats->perf = true;
+
+	return 0;
+}
+
+static void v4l2_encoder_perf_dump(struct v4l2_encoder *encoder, FILE *file)
+{
+	struct histogram *counters;
+	uint64_t cycles, instructions;
+	unsigned int i;
+
+	fprintf(file, "%-14s %12s %12s %6s %12s %12s %12s\n", "stage",
+		"cycles", "p99 cycles", "ipc", "instructions", "cache misses",
+		"branch misses");
+
+	for (i = 0; i < V4L2_ENCODER_STAGES; i++) {
+		counters = encoder->stats->counters[i];
+
+		if (!histogram_count(&counters[PERF_COUNTER_CYCLES]))
+			continue;
+
+		cycles = histogram_mean(&counters[PERF_COUNTER_CYCLES]);
+		instructions =
+			histogram_mean(&counters[PERF_COUNTER_INSTRUCTIONS]);
+
+		fprintf(file, "%-14s %12llu %12llu %6.2f %12llu %12llu %12llu\n",
+			v4l2_encoder_stage_names[i], (unsigned long long)cycles,
+			(unsigned long long)
+			histogram_percentile(&counters[PERF_COUNTER_CYCLES], 99),
+			cycles ? (double)instructions / cycles : 0.0,
+			(unsigned long long)instructions,
+			(unsigned long long)
+			histogram_mean(&counters[PERF_COUNTER_CACHE_MISSES]),
+			(unsigned long long)
+			histogram_mean(&counters[PERF_COUNTER_BRANCH_MISSES]));
+	}
+}
+
+/* Safe to call from another thread while encoding. */
+void v4l2_encoder_stats_dump(struct v4l2_encoder *encoder, FILE *file)
+{
+	struct v4l2_encoder_stats *stats;
+	struct histogram *histogram;
+	uint64_t busy_time;
+	uint64_t time;
+	unsigned int i;
+
+	if (!encoder || !encoder->stats)
+		return;
+
+	stats = encoder->stats;
+
+	fprintf(file, "%-14s %8s %10s %10s %10s %10s %10s\n", "stage", "count",
+		"mean us", "p50 us", "p99 us", "p999 us", "max us");
+
+	for (i = 0; i < V4L2_ENCODER_STAGES; i++) {
+		histogram = &stats->stages[i];
+
+		if (!histogram_count(histogram))
+			continue;
+
+		fprintf(file,
+			"%-14s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+			v4l2_encoder_stage_names[i],
+			(unsigned long long)histogram_count(histogram),
+			histogram_mean(histogram) / 1000.0,
+			histogram_percentile(histogram, 50) / 1000.0,
+			histogram_percentile(histogram, 99) / 1000.0,
+			histogram_percentile(histogram, 99.9) / 1000.0,
+			histogram_max(histogram) / 1000.0);
+	}
+
+	time = v4l2_encoder_time();
+	busy_time = atomic_load(&stats->busy_time);
+
+	fprintf(file, "hardware busy %.3f s, idle %.3f s\n",
+		busy_time / 1000000000.0,
+		(time - stats->start_time - busy_time) / 1000000000.0);
+
+	if (stats->perf)
+		v4l2_encoder_perf_dump(encoder, file);
+}
+
+int v4l2_encoder_trace_open(struct v4l2_encoder *encoder, const char *path)
+{
+	if (!encoder || !path)
+		return -EINVAL;
+
+	if (encoder->trace)
+		return -EBUSY;
+
+	encoder->trace = trace_create(path);
+	if (!encoder->trace)
+		return -ENOMEM;
+
+	return 0;
+}
+
+int v4l2_encoder_metrics_open(struct v4l2_encoder *encoder, unsigned int index)
+{
+	if (!encoder)
+		return -EINVAL;
+
+	if (encoder->metrics)
+		return -EBUSY;
+
+	encoder->metrics = metrics_create(index);
+	if (!encoder->metrics)
+		return -ENOMEM;
+
+	encoder->metrics->data->start_time = v4l2_encoder_time();
+
+	return 0;
+}
+
+/* Called once per frame after rate control feedback, from the thread that
+ * completes frames, which is the only writer. */
+static void v4l2_encoder_metrics_update(struct v4l2_encoder *encoder,
+					struct v4l2_encoder_buffer *output_buffer,
+					struct v4l2_encoder_buffer *capture_buffer)
+{
+	struct v4l2_ctrl_h264_encode_feedback *encode_feedback =
+		&encoder->h264_dst_controls.encode_feedback;
+	struct metrics_data *data = encoder->metrics->data;
+	unsigned int macroblocks;
+	uint64_t latency;
+	uint64_t time;
+
+	time = v4l2_encoder_time();
+	macroblocks = encoder->setup.width_mbs * encoder->setup.height_mbs;
+	latency = time - (output_buffer->start_time ?
+			  output_buffer->start_time :
+			  output_buffer->queue_time);
+
+	metrics_write_begin(encoder->metrics);
+
+	data->width = encoder->setup.width;
+	data->height = encoder->setup.height;
+	data->fps_num = encoder->setup.fps_num;
+	data->fps_den = encoder->setup.fps_den;
+	data->bitrate = encoder->setup.bitrate;
+
+	data->update_time = time;
+	data->frames++;
+	data->bytes += capture_buffer->buffer.m.planes[0].bytesused;
+
+	data->qp = encoder->rc.qp;
+	data->qp_average = encode_feedback->qp_sum / macroblocks;
+	data->bits_target = output_buffer->bits_target;
+	data->bits_left = encoder->rc.bits_left;
+
+	data->latency[metrics_latency_bucket(latency)]++;
+
+	metrics_write_end(encoder->metrics);
+}
+
+static void v4l2_encoder_trace_record(struct v4l2_encoder *encoder,
+				      struct v4l2_encoder_buffer *output_buffer,
+				      struct v4l2_encoder_buffer *capture_buffer)
+{
+	struct v4l2_ctrl_h264_encode_feedback *encode_feedback =
+		&encoder->h264_dst_controls.encode_feedback;
+	struct trace_record *record;
+	unsigned int macroblocks;
+	uint64_t time;
+	unsigned int i;
+
+	time = v4l2_encoder_time();
+	macroblocks = encoder->setup.width_mbs * encoder->setup.height_mbs;
+
+	record = trace_record_get(encoder->trace);
+	if (!record)
+		goto complete;
+
+	record->frame = encoder->trace_frame;
+	record->slice_type = output_buffer->encode_params.slice_type;
+	record->idr_pic_id = output_buffer->encode_params.idr_pic_id;
+	record->frame_num = output_buffer->encode_params.frame_num;
+
+	record->qp = output_buffer->encode_rc.qp;
+	record->bits_target = output_buffer->bits_target;
+	record->bits_left = output_buffer->bits_left;
+	record->cp_distance_mbs = output_buffer->encode_rc.cp_distance_mbs;
+
+	for (i = 0; i < TRACE_CHECKPOINTS; i++)
+		record->cp_target[i] = output_buffer->encode_rc.cp_target[i];
+
+	record->bits_used = capture_buffer->buffer.m.planes[0].bytesused * 8;
+	record->rlc_count = encode_feedback->rlc_count;
+	record->qp_average = encode_feedback->qp_sum / macroblocks;
+
+	record->hardware_time = output_buffer->complete_time -
+				output_buffer->queue_time;
+	record->total_time = time - (output_buffer->start_time ?
+				     output_buffer->start_time :
+				     output_buffer->queue_time);
+
+	trace_record_commit(encoder->trace, record);
+
+complete:
+	encoder->trace_frame++;
+}
+
+/* Free buffers are kept in the order they were released, next one first. */
+static void v4l2_encoder_free_push(unsigned int *free, unsigned int *count,
+				   unsigned int index)
+{
+	free[*count] = index;
+	(*count)++;
+}
+
+/* Buffers put back at the front are the next ones to be queued. */
+static void v4l2_encoder_free_unshift(unsigned int *free, unsigned int *count,
+				      unsigned int index)
+{
+	memmove(&free[1], &free[0], *count * sizeof(*free));
+	free[0] = index;
+	(*count)++;
+}
+
+static int v4l2_encoder_free_take(unsigned int *free, unsigned int *count,
+				  unsigned int index)
+{
+	unsigned int i;
+
+	for (i = 0; i < *count; i++)
+		if (free[i] == index)
+			break;
+
+	if (i == *count)
+		return -EBUSY;
+
+	memmove(&free[i], &free[i + 1], (*count - i - 1) * sizeof(*free));
+	(*count)--;
+
+	return 0;
+}
+
+static void v4l2_encoder_free_update(struct v4l2_encoder *encoder)
+{
+	if (encoder->output_free_count)
+		encoder->output_buffers_index = encoder->output_free[0];
+
+	if (encoder->capture_free_count)
+		encoder->capture_buffers_index = encoder->capture_free[0];
+}
+
+static void v4l2_encoder_pending_push(struct v4l2_encoder *encoder,
+				      unsigned int output_index,
+				      unsigned int capture_index)
+{
+	unsigned int position;
+
+	position = (encoder->pending_index + encoder->pending_count) %
+		   encoder->buffers_max;
+
+	encoder->output_pending[position] = output_index;
+	encoder->capture_pending[position] = capture_index;
+
+	if (!encoder->pending_count) {
+		encoder->output_buffers_done_index = output_index;
+		encoder->capture_buffers_done_index = capture_index;
+	}
+
+	encoder->pending_count++;
+}
+
+static void v4l2_encoder_pending_pop(struct v4l2_encoder *encoder)
+{
+	unsigned int position = encoder->pending_index;
+
+	v4l2_encoder_free_push(encoder->output_free,
+			       &encoder->output_free_count,
+			       encoder->output_pending[position]);
+	if (!encoder->capture_buffers[encoder->capture_pending[position]].retired)
+		v4l2_encoder_free_push(encoder->capture_free,
+				       &encoder->capture_free_count,
+				       encoder->capture_pending[position]);
+	v4l2_encoder_free_update(encoder);
+
+	encoder->pending_index++;
+	encoder->pending_index %= encoder->buffers_max;
+
+	encoder->pending_count--;
+
+	/* Without anything pending, the next queued buffers come first. */
+	if (encoder->pending_count) {
+		position = encoder->pending_index;
+
+		encoder->output_buffers_done_index =
+			encoder->output_pending[position];
+		encoder->capture_buffers_done_index =
+			encoder->capture_pending[position];
+	} else {
+		encoder->output_buffers_done_index =
+			encoder->output_buffers_index;
+		encoder->capture_buffers_done_index =
+			encoder->capture_buffers_index;
+	}
+}
+
+int v4l2_encoder_feedback(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_buffer *output_buffer;
+	struct v4l2_encoder_buffer *capture_buffer;
+	int ret;
+
+	if (!encoder || !encoder->pending_count)
+		return -EINVAL;
+
+	ret = h264_complete(encoder);
+	if (ret)
+		return ret;
+
+	output_buffer = &encoder->output_buffers[encoder->output_buffers_done_index];
+	capture_buffer = &encoder->capture_buffers[encoder->capture_buffers_done_index];
+
+	if (encoder->trace)
+		v4l2_encoder_trace_record(encoder, output_buffer,
+					  capture_buffer);
+
+	if (encoder->metrics)
+		v4l2_encoder_metrics_update(encoder, output_buffer,
+					    capture_buffer);
+
+	if (output_buffer->start_time) {
+		v4l2_encoder_stats_record(encoder, V4L2_ENCODER_STAGE_TOTAL,
+					  output_buffer->start_time);
+		output_buffer->start_time = 0;
+
+		if (encoder->stats)
+			atomic_fetch_add(&encoder->stats->bytes,
+					 capture_buffer->buffer.m.planes[0].bytesused);
+	}
+
+	v4l2_encoder_pending_pop(encoder);
+
+	return 0;
+}
+
 int v4l2_encoder_complete(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_buffer *capture_buffer;
+	struct perf_sample sample;
+	unsigned int capture_index;
+	uint64_t time;
+	int ret;
+
+	if (!encoder || !encoder->pending_count)
+		return -EINVAL;
+
+	capture_index = encoder->capture_buffers_done_index;
+	capture_buffer = &encoder->capture_buffers[capture_index];
+
+	time = v4l2_encoder_stats_time(encoder);
+	v4l2_encoder_perf_start(encoder, &sample);
+
+	ret = h264_slice_write(encoder, capture_buffer);
+	if (ret)
+		return ret;
+
+	v4l2_encoder_stats_record(encoder, V4L2_ENCODER_STAGE_WRITE, time);
+	v4l2_encoder_perf_record(encoder, V4L2_ENCODER_STAGE_WRITE, &sample);
+
+	return v4l2_encoder_feedback(encoder);
+}
+
+int v4l2_encoder_draw_planes(struct v4l2_encoder *encoder, void **planes)
+{
+	struct perf_sample sample;
+	unsigned int width, height;
+	uint64_t time;
+	int fd;
+	int ret;
+
+	if (!encoder || !planes)
+		return -EINVAL;
+
+	width = encoder->setup.width;
+	height = encoder->setup.height;
+
+	time = v4l2_encoder_stats_time(encoder);
+	v4l2_encoder_perf_start(encoder, &sample);
+
+#define MANDELBROT
+
+#ifdef MANDELBROT
+	draw_mandelbrot_zoom(&encoder->draw_mandelbrot);
+	draw_mandelbrot(&encoder->draw_mandelbrot, encoder->draw_buffer);
+#endif
+#ifdef GRADIENT
+	draw_gradient(encoder->draw_buffer);
+#endif
+#ifdef RECTANGLE
+	draw_background(encoder->draw_buffer, 0xff00ffff);
+	draw_rectangle(encoder->draw_buffer, encoder->x, height / 3, width / 3,
+		       height / 3, 0x00ff0000);
+
+	if (!encoder->direction) {
+		if (encoder->x >= 20) {
+			encoder->x -= 20;
+		} else {
+			encoder->x = 0;
+			encoder->direction = 1;
+		}
+	} else {
+		if (encoder->x < (2 * width / 3 - 20)) {
+			encoder->x += 20;
+		} else {
+			encoder->x = 2 * width / 3;
+			encoder->direction = 0;
+		}
+	}
+#endif
+#ifdef PATTERN
+	if (!encoder->pattern_drawn) {
+		draw_png(encoder->draw_buffer, "test-pattern.png");
+		encoder->pattern_drawn = true;
+	}
+#endif
+
+	time = v4l2_encoder_stats_record(encoder, V4L2_ENCODER_STAGE_DRAW, time);
+	v4l2_encoder_perf_record(encoder, V4L2_ENCODER_STAGE_DRAW, &sample);
+
+	if (encoder->setup.format == V4L2_PIX_FMT_YUV420M)
+		ret = rgb2yuv420(encoder->draw_buffer, planes[0], planes[1],
+				 planes[2]);
+	else
+		ret = rgb2nv12(encoder->draw_buffer, planes[0], planes[1]);
+	if (ret)
+		return ret;
+
+	v4l2_encoder_stats_record(encoder, V4L2_ENCODER_STAGE_CSC, time);
+	v4l2_encoder_perf_record(encoder, V4L2_ENCODER_STAGE_CSC, &sample);
+
+#ifdef OUTPUT_DUMP
+	fd = open("output.yuv",  O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("output open error!\n");
+		return -1;
+	}
+
+	write(fd, planes[0], width * height);
+	write(fd, planes[1], width * height / 4);
+	write(fd, planes[2], width * height / 4);
+
+	close(fd);
+#endif
+
+	return 0;
+}
+
+int v4l2_encoder_draw(struct v4l2_encoder *encoder,
+		      struct v4l2_encoder_buffer *output_buffer)
+{
+	if (!encoder || !output_buffer)
+		return -EINVAL;
+
+	/* Imported buffers are filled by their producer. */
+	if (!output_buffer->mmap_data[0])
+		return -EINVAL;
+
+	if (encoder->stats || encoder->trace || encoder->metrics)
+		output_buffer->start_time = v4l2_encoder_time();
+
+	return v4l2_encoder_draw_planes(encoder, output_buffer->mmap_data);
+}
+
+static void v4l2_encoder_poll_add(struct v4l2_encoder *encoder, int fd,
+				  unsigned int events)
+{
+	struct epoll_event event = { 0 };
+
+	if (encoder->poll_fd < 0)
+		return;
+
+	event.events = events;
+	event.data.ptr = encoder->poll_data;
+
+	epoll_ctl(encoder->poll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static void v4l2_encoder_poll_remove(struct v4l2_encoder *encoder, int fd)
+{
+	if (encoder->poll_fd < 0)
+		return;
+
+	epoll_ctl(encoder->poll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/* Capture buffers all lent to consumers grow the pool when possible. */
+static int v4l2_encoder_capture_next(struct v4l2_encoder *encoder)
+{
+	int ret;
+
+	if (!encoder->capture_free_count) {
+		ret = v4l2_encoder_buffers_grow(encoder, encoder->capture_type,
+						1);
+		if (ret)
+			return -EBUSY;
+	}
+
+	return encoder->capture_buffers_index;
+}
+
+/* Queueing only fails with -EBUSY on these, checked before the H.264 state
+ * advances so that the same frame can be tried again. */
+static int v4l2_encoder_queue_check(struct v4l2_encoder *encoder)
+{
+	int ret;
+
+	if (encoder->pending_count >= encoder->setup.pipeline_depth ||
+	    !encoder->output_free_count)
+		return -EBUSY;
+
+	ret = v4l2_encoder_capture_next(encoder);
+	if (ret < 0)
+		return ret;
+
+	return 0;
+}
+
+int v4l2_encoder_prepare(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_buffer *output_buffer;
+	unsigned int output_index;
+	int ret;
+
+	if (!encoder)
+		return -EINVAL;
+
+	/* The next buffer must not be held by a pending request. */
+	ret = v4l2_encoder_queue_check(encoder);
+	if (ret)
+		return ret;
+
+	output_index = encoder->output_buffers_index;
+	output_buffer = &encoder->output_buffers[output_index];
+
+	PROBE2(prepare_start, encoder->gop_index, output_index);
+
+	ret = h264_prepare(encoder);
+	if (ret)
+		return ret;
+
+	ret = v4l2_encoder_draw(encoder, output_buffer);
+	if (ret)
+		return ret;
+
+	PROBE3(prepare_end, encoder->h264_src_controls.encode_params.frame_num,
+	       output_index, encoder->h264_src_controls.encode_rc.qp);
+
+	return 0;
+}
+
+static bool v4l2_encoder_capture_pending_check(struct v4l2_encoder *encoder,
+					       unsigned int index)
+{
+	unsigned int position;
+	unsigned int i;
+
+	for (i = 0; i < encoder->pending_count; i++) {
+		position = (encoder->pending_index + i) % encoder->buffers_max;
+
+		if (encoder->capture_pending[position] == index)
+			return true;
+	}
+
+	return false;
+}
+
+/* Capture buffers left queued by failed requests can only be taken back
+ * by stopping the queue, once no pending request holds a capture buffer. */
+static int v4l2_encoder_capture_reclaim(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_buffer *buffer;
+	bool stranded = false;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < encoder->capture_buffers_count; i++) {
+		buffer = &encoder->capture_buffers[i];
+
+		if (buffer->queued &&
+		    !v4l2_encoder_capture_pending_check(encoder, i))
+			stranded = true;
+	}
+
+	if (!stranded)
+		return 0;
+
+	ret = v4l2_stream_off(encoder->video_fd, encoder->capture_type);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < encoder->capture_buffers_count; i++)
+		encoder->capture_buffers[i].queued = false;
+
+	return v4l2_stream_on(encoder->video_fd, encoder->capture_type);
+}
+
+/* Queue a frame with the current source controls, which are kept along.
+ * On failure, the buffers go back to the front of the free lists and a
+ * capture buffer already handed to the driver is used for the next frame. */
+static int v4l2_encoder_queue_buffers(struct v4l2_encoder *encoder,
+				      unsigned int output_index,
+				      unsigned int capture_index)
+{
+	struct v4l2_encoder_buffer *output_buffer;
+	struct v4l2_encoder_buffer *capture_buffer;
+	bool output_taken, capture_taken;
+	uint64_t time;
+	int ret;
+
+	output_buffer = &encoder->output_buffers[output_index];
+	capture_buffer = &encoder->capture_buffers[capture_index];
+
+	time = v4l2_encoder_stats_time(encoder);
+
+	v4l2_buffer_request_attach(&output_buffer->buffer,
+				   output_buffer->request_fd);
+
+	ret = v4l2_buffer_queue(encoder->video_fd, &output_buffer->buffer);
+
+	v4l2_buffer_request_detach(&output_buffer->buffer);
+
+	if (ret)
+		return ret;
+
+	output_buffer->queued = true;
+	output_taken = !v4l2_encoder_free_take(encoder->output_free,
+					       &encoder->output_free_count,
+					       output_index);
+
+	if (!capture_buffer->queued) {
+		ret = v4l2_buffer_queue(encoder->video_fd,
+					&capture_buffer->buffer);
+		if (ret)
+			goto error_output;
+	}
+
+	capture_buffer->queued = true;
+	capture_buffer->frame_num =
+		encoder->h264_src_controls.encode_params.frame_num;
+	capture_taken = !v4l2_encoder_free_take(encoder->capture_free,
+						&encoder->capture_free_count,
+						capture_index);
+	v4l2_encoder_free_update(encoder);
+
+	time = v4l2_encoder_stats_record(encoder, V4L2_ENCODER_STAGE_QBUF, time);
+
+	v4l2_ext_controls_request_attach(&encoder->h264_src_controls.ext_controls,
+					 output_buffer->request_fd);
+
+	ret = v4l2_ext_controls_set(encoder->video_fd,
+				    &encoder->h264_src_controls.ext_controls);
+
+	v4l2_ext_controls_request_detach(&encoder->h264_src_controls.ext_controls);
+
+	if (ret)
+		goto error_capture;
+
+	time = v4l2_encoder_stats_record(encoder, V4L2_ENCODER_STAGE_CONTROLS,
+					 time);
+
+	ret = media_request_queue(output_buffer->request_fd);
+	if (ret)
+		goto error_capture;
+
+	v4l2_encoder_stats_record(encoder, V4L2_ENCODER_STAGE_REQUEST_QUEUE,
+				  time);
+
+	PROBE4(request_queue, encoder->h264_src_controls.encode_params.frame_num,
+	       output_index, capture_index,
+	       encoder->h264_src_controls.encode_rc.qp);
+
+	output_buffer->request_queued = true;
+	output_buffer->complete_time = 0;
+	output_buffer->encode_params = encoder->h264_src_controls.encode_params;
+	output_buffer->encode_rc = encoder->h264_src_controls.encode_rc;
+
+	/* Idle request and video fds report errors when polled, so they are
+	 * only watched while something is pending. */
+	v4l2_encoder_poll_add(encoder, output_buffer->request_fd,
+			      EPOLLPRI | EPOLLIN);
+
+	return 0;
+
+error_capture:
+	/* The capture buffer stays with the driver, which hands it to the
+	 * next request, so it goes first. */
+	if (capture_taken)
+		v4l2_encoder_free_unshift(encoder->capture_free,
+					  &encoder->capture_free_count,
+					  capture_index);
+
+error_output:
+	/* An unqueued request gives its output buffer back. */
+	media_request_reinit(output_buffer->request_fd);
+
+	output_buffer->queued = false;
+
+	if (output_taken)
+		v4l2_encoder_free_unshift(encoder->output_free,
+					  &encoder->output_free_count,
+					  output_index);
+
+	v4l2_encoder_free_update(encoder);
+
+	if (!encoder->pending_count)
+		v4l2_encoder_capture_reclaim(encoder);
+
+	return ret;
+}
+
+int v4l2_encoder_queue(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_buffer *output_buffer;
+	unsigned int output_index;
+	unsigned int capture_index;
+	int ret;
+
+	if (!encoder)
+		return -EINVAL;
+
+	if (encoder->pending_count >= encoder->setup.pipeline_depth ||
+	    !encoder->output_free_count)
+		return -EBUSY;
+
+	ret = v4l2_encoder_capture_next(encoder);
+	if (ret < 0)
+		return ret;
+
+	capture_index = ret;
+
+	output_index = encoder->output_buffers_index;
+	output_buffer = &encoder->output_buffers[output_index];
+
+	ret = v4l2_encoder_queue_buffers(encoder, output_index, capture_index);
+	if (ret)
+		return ret;
+
+	output_buffer->slice_type =
+		encoder->h264_src_controls.encode_params.slice_type;
+	output_buffer->frame_num =
+		encoder->h264_src_controls.encode_params.frame_num;
+	output_buffer->queue_time = v4l2_encoder_time();
+	output_buffer->bits_target = encoder->rc.bits_target;
+	output_buffer->bits_left = encoder->rc.bits_left;
+
+	/* Frames drawn elsewhere start when they are handed over. */
+	if ((encoder->stats || encoder->trace || encoder->metrics) &&
+	    !output_buffer->start_time)
+		output_buffer->start_time = output_buffer->queue_time;
+
+	if (!encoder->pending_count)
+		v4l2_encoder_poll_add(encoder, encoder->video_fd, EPOLLIN);
+
+	/* The reference buffer is always the previous frame, which is known
+	 * as soon as it is queued, without waiting for it to complete. */
+	v4l2_buffer_timestamp_get(&output_buffer->buffer,
+				  &encoder->reference_timestamp);
+
+	v4l2_encoder_pending_push(encoder, output_index, capture_index);
+
+	return 0;
+}
+
+static int v4l2_encoder_dequeue_wait(struct v4l2_encoder *encoder,
+				     struct v4l2_encoder_buffer *buffer)
+{
+	struct pollfd pollfd = { 0 };
+	unsigned int index = buffer->buffer.index;
+	int ret;
+
+	pollfd.fd = encoder->video_fd;
+	pollfd.events = POLLIN;
+
+	while ((ret = v4l2_buffer_dequeue(encoder->video_fd,
+					  &buffer->buffer)) == -EAGAIN) {
+		ret = poll(&pollfd, 1, 300);
+		if (ret < 0)
+			return -errno;
+		else if (ret == 0)
+			return -ETIMEDOUT;
+	}
+
+	if (ret)
+		return ret;
+
+	if (buffer->buffer.index != index) {
+		fprintf(stderr, "Dequeued buffers out of order\n");
+		return -EIO;
+	}
+
+	buffer->queued = false;
+
+	return 0;
+}
+
+/* Devices that report when a request completed are trusted over the time
+ * its completion was seen at. */
+static void v4l2_encoder_complete_stamp(struct v4l2_encoder_buffer *output_buffer,
+					uint64_t time)
+{
+	if (output_buffer->complete_time)
+		return;
+
+	output_buffer->complete_time =
+		media_request_complete_time(output_buffer->request_fd);
+	if (!output_buffer->complete_time)
+		output_buffer->complete_time = time;
+}
+
+/* The hardware runs one request at a time, which starts when it is queued
+ * or when the previous one completes. */
+static void v4l2_encoder_hardware_record(struct v4l2_encoder *encoder,
+					 struct v4l2_encoder_buffer *output_buffer)
+{
+	uint64_t start = output_buffer->queue_time;
+	uint64_t time;
+
+	if (encoder->complete_time > start)
+		start = encoder->complete_time;
+
+	encoder->complete_time = output_buffer->complete_time;
+
+	if (!encoder->stats || output_buffer->complete_time < start)
+		return;
+
+	time = output_buffer->complete_time - start;
+
+	histogram_record(&encoder->stats->stages[V4L2_ENCODER_STAGE_HARDWARE],
+			 time);
+	atomic_fetch_add(&encoder->stats->busy_time, time);
+}
+
+/*
+ * Requests queued after an overflowing frame use its reconstruction as
+ * reference, so they are all encoded again in order once they complete:
+ * the overflowing frame with larger capture buffers and a higher QP.
+ */
+static int v4l2_encoder_overflow(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_h264_src_controls *h264_src_controls =
+		&encoder->h264_src_controls;
+	struct v4l2_ctrl_h264_encode_params encode_params;
+	struct v4l2_ctrl_h264_encode_rc encode_rc;
+	struct v4l2_encoder_buffer *output_buffer;
+	struct v4l2_encoder_buffer *capture_buffer;
+	struct timeval timeout;
+	unsigned int output_index, capture_index;
+	unsigned int position;
+	unsigned int size, size_max;
+	unsigned int qp, qp_max;
+	bool resized = false;
+	unsigned int i;
+	int ret;
+
+	output_buffer = &encoder->output_buffers[encoder->output_buffers_done_index];
+	qp = output_buffer->encode_rc.qp;
+	qp_max = encoder->setup.qp_max;
+
+	for (i = 1; i < encoder->pending_count; i++) {
+		position = (encoder->pending_index + i) % encoder->buffers_max;
+		output_buffer =
+			&encoder->output_buffers[encoder->output_pending[position]];
+		capture_buffer =
+			&encoder->capture_buffers[encoder->capture_pending[position]];
+
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 300000;
+
+		ret = media_request_poll(output_buffer->request_fd, &timeout);
+		if (ret < 0)
+			return ret;
+		else if (ret == 0)
+			return -ETIMEDOUT;
+
+		/* Discarded frames still kept the hardware busy. */
+		v4l2_encoder_complete_stamp(output_buffer, v4l2_encoder_time());
+		v4l2_encoder_hardware_record(encoder, output_buffer);
+
+		v4l2_encoder_poll_remove(encoder, output_buffer->request_fd);
+
+		output_buffer->request_queued = false;
+
+		ret = v4l2_encoder_dequeue_wait(encoder, output_buffer);
+		if (ret)
+			return ret;
+
+		ret = v4l2_encoder_dequeue_wait(encoder, capture_buffer);
+		if (ret)
+			return ret;
+
+		ret = media_request_reinit(output_buffer->request_fd);
+		if (ret)
+			return ret;
+	}
+
+	ret = v4l2_encoder_capture_reclaim(encoder);
+	if (ret)
+		return ret;
+
+	size = encoder->capture_format.fmt.pix_mp.plane_fmt[0].sizeimage;
+	size_max = h264_capture_size_max(encoder);
+
+	if (size < size_max) {
+		size = size * 2 < size_max ? size * 2 : size_max;
+
+		ret = v4l2_encoder_capture_resize(encoder, size);
+		if (ret)
+			fprintf(stderr, "Failed to resize capture buffers\n");
+		else
+			resized = true;
+	}
+
+	if (!resized && qp >= qp_max) {
+		fprintf(stderr, "Failed to fit slice in capture buffer\n");
+		return -ENOSPC;
+	}
+
+	encode_params = h264_src_controls->encode_params;
+	encode_rc = h264_src_controls->encode_rc;
+
+	for (i = 0; i < encoder->pending_count; i++) {
+		position = (encoder->pending_index + i) % encoder->buffers_max;
+		output_index = encoder->output_pending[position];
+		capture_index = encoder->capture_pending[position];
+		output_buffer = &encoder->output_buffers[output_index];
+
+		if (encoder->capture_buffers[capture_index].retired) {
+			ret = v4l2_encoder_capture_next(encoder);
+			if (ret < 0)
+				goto complete;
+
+			encoder->capture_pending[position] = ret;
+			v4l2_encoder_capture_release(encoder, capture_index);
+			capture_index = ret;
+		}
+
+		h264_src_controls->encode_params = output_buffer->encode_params;
+		h264_src_controls->encode_rc = output_buffer->encode_rc;
+
+		if (!i) {
+			qp += V4L2_ENCODER_OVERFLOW_QP_DELTA;
+			h264_src_controls->encode_rc.qp = qp < qp_max ? qp : qp_max;
+		}
+
+		ret = v4l2_encoder_queue_buffers(encoder, output_index,
+						 capture_index);
+		if (ret)
+			goto error;
+	}
+
+	encoder->capture_buffers_done_index =
+		encoder->capture_pending[encoder->pending_index];
+
+	ret = 0;
+	goto complete;
+
+error:
+	/* Frames that could not be queued again are dropped, keeping their
+	 * buffers first in line. */
+	while (encoder->pending_count > i) {
+		position = (encoder->pending_index + encoder->pending_count - 1) %
+			   encoder->buffers_max;
+		output_index = encoder->output_pending[position];
+		capture_index = encoder->capture_pending[position];
+
+		v4l2_encoder_free_take(encoder->output_free,
+				       &encoder->output_free_count,
+				       output_index);
+		v4l2_encoder_free_unshift(encoder->output_free,
+					  &encoder->output_free_count,
+					  output_index);
+
+		if (encoder->capture_buffers[capture_index].retired) {
+			v4l2_encoder_capture_release(encoder, capture_index);
+		} else {
+			v4l2_encoder_free_take(encoder->capture_free,
+					       &encoder->capture_free_count,
+					       capture_index);
+			v4l2_encoder_free_unshift(encoder->capture_free,
+						  &encoder->capture_free_count,
+						  capture_index);
+		}
+
+		encoder->pending_count--;
+	}
+
+	v4l2_encoder_free_update(encoder);
+
+	if (encoder->pending_count) {
+		encoder->capture_buffers_done_index =
+			encoder->capture_pending[encoder->pending_index];
+	} else {
+		encoder->output_buffers_done_index =
+			encoder->output_buffers_index;
+		encoder->capture_buffers_done_index =
+			encoder->capture_buffers_index;
+
+		v4l2_encoder_poll_remove(encoder, encoder->video_fd);
+		v4l2_encoder_capture_reclaim(encoder);
+	}
+
+complete:
+	h264_src_controls->encode_params = encode_params;
+	h264_src_controls->encode_rc = encode_rc;
+
+	return ret;
+}
+
+static int v4l2_encoder_dequeue_try(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_buffer *output_buffer;
+	unsigned int output_index;
+	struct v4l2_encoder_buffer *capture_buffer;
+	unsigned int capture_index;
+	struct timeval timeout = { 0, 0 };
+	uint64_t time;
+	int ret;
+
+	/* Requests complete in order, so always check the oldest one. */
+	output_index = encoder->output_buffers_done_index;
+	output_buffer = &encoder->output_buffers[output_index];
+
+	capture_index = encoder->capture_buffers_done_index;
+	capture_buffer = &encoder->capture_buffers[capture_index];
+
+	if (output_buffer->request_queued) {
+		ret = media_request_poll(output_buffer->request_fd, &timeout);
+		if (ret < 0)
+			return ret;
+		else if (ret == 0)
+			return -EAGAIN;
+
+		/* Without a poll event, completion is only seen now. */
+		v4l2_encoder_complete_stamp(output_buffer, v4l2_encoder_time());
+		v4l2_encoder_hardware_record(encoder, output_buffer);
+
+		PROBE3(request_complete, output_buffer->encode_params.frame_num,
+		       output_index, capture_index);
+
+		v4l2_ext_controls_request_attach(&encoder->h264_dst_controls.ext_controls,
+						 output_buffer->request_fd);
+
+		ret = v4l2_ext_controls_get(encoder->video_fd,
+					    &encoder->h264_dst_controls.ext_controls);
+		if (ret)
+			return ret;
+
+		v4l2_ext_controls_request_detach(&encoder->h264_dst_controls.ext_controls);
+
+		v4l2_encoder_poll_remove(encoder, output_buffer->request_fd);
+
+		output_buffer->request_queued = false;
+	}
+
+	time = v4l2_encoder_stats_time(encoder);
+
+	/* Buffers may be marked done slightly after their request. */
+	if (output_buffer->queued) {
+		ret = v4l2_buffer_dequeue(encoder->video_fd,
+					  &output_buffer->buffer);
+		if (ret)
+			return ret;
+
+		output_buffer->queued = false;
+	}
+
+	if (capture_buffer->queued) {
+		ret = v4l2_buffer_dequeue(encoder->video_fd,
+					  &capture_buffer->buffer);
+		if (ret)
+			return ret;
+
+		capture_buffer->queued = false;
+
+		ret = session_bitstream(capture_buffer->mmap_data[0],
+					capture_buffer->buffer.m.planes[0].bytesused,
+					capture_buffer->buffer.m.planes[0].length);
+		if (ret)
+			return ret;
+
+		PROBE3(buffer_dequeue, capture_buffer->frame_num,
+		       capture_index,
+		       capture_buffer->buffer.m.planes[0].bytesused);
+	}
+
+	v4l2_encoder_stats_record(encoder, V4L2_ENCODER_STAGE_DQBUF, time);
+
+	if (output_buffer->buffer.index != output_index ||
+	    capture_buffer->buffer.index != capture_index) {
+		fprintf(stderr, "Dequeued buffers out of order\n");
+		return -EIO;
+	}
+
+	ret = media_request_reinit(output_buffer->request_fd);
+	if (ret)
+		return ret;
+
+	if (v4l2_buffer_error_check(&capture_buffer->buffer)) {
+		ret = v4l2_encoder_overflow(encoder);
+		if (ret)
+			return ret;
+
+		return -EAGAIN;
+	}
+
+	if (encoder->pending_count == 1)
+		v4l2_encoder_poll_remove(encoder, encoder->video_fd);
+
+	return 0;
+}
+
+int v4l2_encoder_dequeue(struct v4l2_encoder *encoder)
 {
 	struct v4l2_encoder_buffer *output_buffer;
 	unsigned int output_index;
+	struct timeval timeout;
 	int ret;
 
-	if (!encoder)
+	if (!encoder || !encoder->pending_count)
 		return -EINVAL;
 
-	output_index = encoder->output_buffers_index;
+	output_index = encoder->output_buffers_done_index;
 	output_buffer = &encoder->output_buffers[output_index];
 
-	ret = h264_complete(encoder);
+	/* Frames encoded again after an overflow are waited for too. */
+	do {
+		if (output_buffer->request_queued) {
+			timeout.tv_sec = 0;
+			timeout.tv_usec = 300000;
+
+			ret = media_request_poll(output_buffer->request_fd,
+						 &timeout);
+			if (ret < 0)
+				return ret;
+			else if (ret == 0)
+				return -ETIMEDOUT;
+
+			v4l2_encoder_poll_event(encoder, v4l2_encoder_time());
+		}
+
+		ret = v4l2_encoder_dequeue_try(encoder);
+		if (ret && ret != -EAGAIN)
+			return ret;
+	} while (ret == -EAGAIN);
+
+	return 0;
+}
+
+int v4l2_encoder_run(struct v4l2_encoder *encoder)
+{
+	int ret;
+
+	if (!encoder)
+		return -EINVAL;
+
+	ret = v4l2_encoder_queue(encoder);
 	if (ret)
 		return ret;
 
-	/* The reference buffer is always the previous frame. */
-	v4l2_buffer_timestamp_get(&output_buffer->buffer,
-				  &encoder->reference_timestamp);
+	return v4l2_encoder_dequeue(encoder);
+}
 
-	encoder->output_buffers_index++;
-	encoder->output_buffers_index %= encoder->output_buffers_count;
+/* Whether a frame can be submitted, without growing the capture pool. */
+bool v4l2_encoder_output_buffer_available(struct v4l2_encoder *encoder)
+{
+	if (!encoder || !encoder->started)
+		return false;
 
-	encoder->capture_buffers_index++;
-	encoder->capture_buffers_index %= encoder->capture_buffers_count;
+	if (encoder->pending_count >= encoder->setup.pipeline_depth ||
+	    !encoder->output_free_count)
+		return false;
 
-	return 0;
+	return encoder->capture_free_count ||
+	       encoder->capture_buffers_count < encoder->buffers_max;
 }
 
-int v4l2_encoder_prepare(struct v4l2_encoder *encoder)
+struct v4l2_encoder_buffer *v4l2_encoder_output_buffer_next(struct v4l2_encoder *encoder)
 {
-	struct v4l2_encoder_buffer *output_buffer;
 	unsigned int output_index;
-	unsigned int width, height;
-	int fd;
-	int ret;
 
-	if (!encoder)
-		return -EINVAL;
+	if (!encoder || !encoder->started)
+		return NULL;
 
-	width = encoder->setup.width;
-	height = encoder->setup.height;
+	if (encoder->pending_count >= encoder->setup.pipeline_depth ||
+	    !encoder->output_free_count)
+		return NULL;
+
+	if (v4l2_encoder_capture_next(encoder) < 0)
+		return NULL;
 
 	output_index = encoder->output_buffers_index;
-	output_buffer = &encoder->output_buffers[output_index];
 
-	ret = h264_prepare(encoder);
-	if (ret)
-		return ret;
+	return &encoder->output_buffers[output_index];
+}
 
-#define MANDELBROT
+struct v4l2_encoder_buffer *v4l2_encoder_output_import(struct v4l2_encoder *encoder,
+						       const int *fds,
+						       unsigned int fds_count)
+{
+	struct v4l2_encoder_buffer *buffer;
+	struct v4l2_encoder_buffer *match = NULL;
+	struct v4l2_encoder_buffer *oldest = NULL;
+	struct stat stat;
+	dev_t devs[4];
+	ino_t ids[4];
+	unsigned int i, j;
+
+	if (!encoder || !fds || !encoder->started ||
+	    encoder->output_memory != V4L2_MEMORY_DMABUF)
+		return NULL;
+
+	if (encoder->pending_count >= encoder->setup.pipeline_depth ||
+	    !encoder->output_free_count)
+		return NULL;
+
+	if (v4l2_encoder_capture_next(encoder) < 0)
+		return NULL;
+
+	if (fds_count != encoder->output_buffers[0].planes_count ||
+	    fds_count > ARRAY_SIZE(ids))
+		return NULL;
+
+	for (i = 0; i < fds_count; i++) {
+		if (fstat(fds[i], &stat))
+			return NULL;
+
+		devs[i] = stat.st_dev;
+		ids[i] = stat.st_ino;
+	}
 
-#ifdef MANDELBROT
-	draw_mandelbrot_zoom(&encoder->draw_mandelbrot);
-	draw_mandelbrot(&encoder->draw_mandelbrot, encoder->draw_buffer);
-#endif
-#ifdef GRADIENT
-	draw_gradient(encoder->draw_buffer);
-#endif
-#ifdef RECTANGLE
-	draw_background(encoder->draw_buffer, 0xff00ffff);
-	draw_rectangle(encoder->draw_buffer, encoder->x, height / 3, width / 3,
-		       height / 3, 0x00ff0000);
+	/* Drivers keep a dmabuf mapped for as long as it is queued to the
+	 * same slot, so look for the slot that last held it. */
+	for (i = 0; i < encoder->output_free_count; i++) {
+		buffer = &encoder->output_buffers[encoder->output_free[i]];
 
-	if (!encoder->direction) {
-		if (encoder->x >= 20) {
-			encoder->x -= 20;
-		} else {
-			encoder->x = 0;
-			encoder->direction = 1;
-		}
-	} else {
-		if (encoder->x < (2 * width / 3 - 20)) {
-			encoder->x += 20;
-		} else {
-			encoder->x = 2 * width / 3;
-			encoder->direction = 0;
+		for (j = 0; j < fds_count; j++)
+			if (buffer->dmabuf_devs[j] != devs[j] ||
+			    buffer->dmabuf_ids[j] != ids[j])
+				break;
+
+		if (j == fds_count) {
+			match = buffer;
+			break;
 		}
+
+		if (!oldest || buffer->dmabuf_time < oldest->dmabuf_time)
+			oldest = buffer;
 	}
-#endif
-#ifdef PATTERN
-	if (!encoder->pattern_drawn) {
-		draw_png(encoder->draw_buffer, "test-pattern.png");
-		encoder->pattern_drawn = true;
-	}
-#endif
 
-	if (encoder->setup.format == V4L2_PIX_FMT_YUV420M)
-		ret = rgb2yuv420(encoder->draw_buffer,
-				 output_buffer->mmap_data[0],
-				 output_buffer->mmap_data[1],
-				 output_buffer->mmap_data[2]);
-	else
-		ret = rgb2nv12(encoder->draw_buffer,
-			       output_buffer->mmap_data[0],
-			       output_buffer->mmap_data[1]);
+	buffer = match ? match : oldest;
+	if (!buffer)
+		return NULL;
 
-#ifdef OUTPUT_DUMP
-	fd = open("output.yuv",  O_WRONLY | O_CREAT | O_TRUNC, 0644);
-	if (fd < 0) {
-		printf("output open error!\n");
-		return -1;
+	for (i = 0; i < fds_count; i++) {
+		buffer->planes[i].m.fd = fds[i];
+		buffer->dmabuf_devs[i] = devs[i];
+		buffer->dmabuf_ids[i] = ids[i];
 	}
 
-	write(fd, output_buffer->mmap_data[0], width * height);
-	write(fd, output_buffer->mmap_data[1], width * height / 4);
-	write(fd, output_buffer->mmap_data[2], width * height / 4);
+	buffer->dmabuf_time = ++encoder->dmabuf_sequence;
 
-	close(fd);
-#endif
+	/* Move the slot to the front of the free list to queue it next. */
+	i = buffer - encoder->output_buffers;
 
-	return 0;
+	v4l2_encoder_free_take(encoder->output_free,
+			       &encoder->output_free_count, i);
+	v4l2_encoder_free_unshift(encoder->output_free,
+				  &encoder->output_free_count, i);
+
+	v4l2_encoder_free_update(encoder);
+
+	return buffer;
 }
 
-int v4l2_encoder_run(struct v4l2_encoder *encoder)
+/* Without USERPTR support, user planes are copied to the driver buffers. */
+static int v4l2_encoder_output_user(struct v4l2_encoder *encoder,
+				    struct v4l2_encoder_buffer *buffer,
+				    void **planes)
 {
-	struct v4l2_encoder_buffer *output_buffer;
-	unsigned int output_index;
-	struct v4l2_encoder_buffer *capture_buffer;
-	unsigned int capture_index;
-	struct timeval timeout = { 0, 300000 };
+	unsigned int length;
+	unsigned int i;
 	int ret;
 
-	if (!encoder)
-		return -EINVAL;
+	for (i = 0; i < buffer->planes_count; i++) {
+		if (!planes[i])
+			return -EINVAL;
 
-	output_index = encoder->output_buffers_index;
-	output_buffer = &encoder->output_buffers[output_index];
+		ret = v4l2_buffer_plane_length(&buffer->buffer, i, &length);
+		if (ret)
+			return ret;
 
-	v4l2_buffer_request_attach(&output_buffer->buffer,
-				   output_buffer->request_fd);
+		if (encoder->output_memory == V4L2_MEMORY_USERPTR)
+			buffer->planes[i].m.userptr = (unsigned long)planes[i];
+		else if (encoder->output_memory == V4L2_MEMORY_MMAP)
+			memcpy(buffer->mmap_data[i], planes[i], length);
+		else
+			return -EINVAL;
+	}
 
-	ret = v4l2_buffer_queue(encoder->video_fd, &output_buffer->buffer);
-	if (ret)
-		return ret;
+	return 0;
+}
 
-	v4l2_buffer_request_detach(&output_buffer->buffer);
+int v4l2_encoder_submit(struct v4l2_encoder *encoder,
+			struct v4l2_encoder_frame *frame)
+{
+	int ret;
 
-	capture_index = encoder->capture_buffers_index;
-	capture_buffer = &encoder->capture_buffers[capture_index];
+	if (!encoder || !frame || !encoder->started)
+		return -EINVAL;
 
-	ret = v4l2_buffer_queue(encoder->video_fd, &capture_buffer->buffer);
+	ret = v4l2_encoder_queue_check(encoder);
 	if (ret)
 		return ret;
 
-	v4l2_ext_controls_request_attach(&encoder->h264_src_controls.ext_controls,
-					 output_buffer->request_fd);
+	/* Output buffers are used in turn. */
+	if (frame->output_buffer !=
+	    &encoder->output_buffers[encoder->output_buffers_index])
+		return -EINVAL;
 
-	ret = v4l2_ext_controls_set(encoder->video_fd,
-				    &encoder->h264_src_controls.ext_controls);
+	if (frame->planes[0]) {
+		ret = v4l2_encoder_output_user(encoder, frame->output_buffer,
+					       frame->planes);
+		if (ret)
+			return ret;
+	}
+
+	PROBE2(prepare_start, encoder->gop_index, encoder->output_buffers_index);
+
+	ret = h264_prepare(encoder);
 	if (ret)
 		return ret;
 
-	v4l2_ext_controls_request_detach(&encoder->h264_src_controls.ext_controls);
+	PROBE3(prepare_end, encoder->h264_src_controls.encode_params.frame_num,
+	       encoder->output_buffers_index,
+	       encoder->h264_src_controls.encode_rc.qp);
 
-	ret = media_request_queue(output_buffer->request_fd);
+	return v4l2_encoder_queue(encoder);
+}
+
+int v4l2_encoder_reap(struct v4l2_encoder *encoder,
+		      struct v4l2_encoder_frame *frame)
+{
+	struct v4l2_encoder_buffer *output_buffer;
+	struct v4l2_encoder_buffer *capture_buffer;
+	int ret;
+
+	if (!encoder || !frame)
+		return -EINVAL;
+
+	if (!encoder->pending_count)
+		return -EAGAIN;
+
+	output_buffer = &encoder->output_buffers[encoder->output_buffers_done_index];
+	capture_buffer = &encoder->capture_buffers[encoder->capture_buffers_done_index];
+
+	ret = v4l2_encoder_dequeue_try(encoder);
 	if (ret)
 		return ret;
 
-	ret = media_request_poll(output_buffer->request_fd, &timeout);
-	if (ret <= 0)
+	ret = v4l2_encoder_feedback(encoder);
+	if (ret)
 		return ret;
 
-	v4l2_ext_controls_request_attach(&encoder->h264_dst_controls.ext_controls,
-					 output_buffer->request_fd);
+	frame->output_buffer = output_buffer;
+	frame->capture_buffer = capture_buffer;
+	frame->data = capture_buffer->mmap_data[0];
+	frame->size = capture_buffer->buffer.m.planes[0].bytesused;
+	frame->fd = capture_buffer->export_fd;
+	frame->slice_type = output_buffer->slice_type;
+	frame->frame_num = output_buffer->frame_num;
+	frame->queue_time = output_buffer->queue_time;
+	frame->complete_time = output_buffer->complete_time;
 
-	ret = v4l2_ext_controls_get(encoder->video_fd,
-				    &encoder->h264_dst_controls.ext_controls);
-	if (ret)
-		return ret;
+	v4l2_buffer_timestamp_get(&capture_buffer->buffer, &frame->timestamp);
 
-	v4l2_ext_controls_request_detach(&encoder->h264_dst_controls.ext_controls);
+	return 0;
+}
 
-	do {
-		ret = v4l2_buffer_dequeue(encoder->video_fd, &output_buffer->buffer);
-		if (ret && ret != -EAGAIN)
-			return ret;
-	} while (ret == -EAGAIN);
+int v4l2_encoder_capture_lend(struct v4l2_encoder *encoder,
+			      struct v4l2_encoder_buffer *capture_buffer)
+{
+	unsigned int capture_index;
+	int ret;
 
-	do {
-		ret = v4l2_buffer_dequeue(encoder->video_fd, &capture_buffer->buffer);
-		if (ret && ret != -EAGAIN)
+	if (!encoder || !capture_buffer || capture_buffer->lent)
+		return -EINVAL;
+
+	capture_index = capture_buffer - encoder->capture_buffers;
+
+	/* Queued, lent and retired buffers are not on the free list. */
+	if (!capture_buffer->retired) {
+		ret = v4l2_encoder_free_take(encoder->capture_free,
+					     &encoder->capture_free_count,
+					     capture_index);
+		if (ret)
 			return ret;
-	} while (ret == -EAGAIN);
 
-	ret = media_request_reinit(output_buffer->request_fd);
-	if (ret)
-		return ret;
+		v4l2_encoder_free_update(encoder);
+	}
+
+	capture_buffer->lent = true;
+
+	return 0;
+}
+
+int v4l2_encoder_capture_return(struct v4l2_encoder *encoder,
+				struct v4l2_encoder_buffer *capture_buffer)
+{
+	if (!encoder || !capture_buffer || !capture_buffer->lent)
+		return -EINVAL;
+
+	capture_buffer->lent = false;
+
+	if (capture_buffer->retired)
+		return v4l2_encoder_capture_release(encoder,
+				capture_buffer - encoder->capture_buffers);
+
+	v4l2_encoder_free_push(encoder->capture_free,
+			       &encoder->capture_free_count,
+			       capture_buffer - encoder->capture_buffers);
+	v4l2_encoder_free_update(encoder);
+
+	return 0;
+}
+
+static void v4l2_encoder_poll_register(struct v4l2_encoder *encoder,
+				       bool registered)
+{
+	unsigned int i;
+
+	/* Catch up with requests queued before the fd was attached. */
+	for (i = 0; i < encoder->output_buffers_count; i++) {
+		struct v4l2_encoder_buffer *buffer = &encoder->output_buffers[i];
+
+		if (!buffer->request_queued)
+			continue;
+
+		if (registered)
+			v4l2_encoder_poll_add(encoder, buffer->request_fd,
+					      EPOLLPRI);
+		else
+			v4l2_encoder_poll_remove(encoder, buffer->request_fd);
+	}
+
+	if (!encoder->pending_count)
+		return;
+
+	if (registered)
+		v4l2_encoder_poll_add(encoder, encoder->video_fd, EPOLLIN);
+	else
+		v4l2_encoder_poll_remove(encoder, encoder->video_fd);
+}
+
+int v4l2_encoder_poll_fd(struct v4l2_encoder *encoder)
+{
+	if (!encoder)
+		return -EINVAL;
+
+	if (encoder->poll_fd >= 0)
+		return encoder->poll_fd;
+
+	encoder->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (encoder->poll_fd < 0)
+		return -errno;
+
+	encoder->poll_data = encoder;
+	encoder->poll_shared = false;
+
+	v4l2_encoder_poll_register(encoder, true);
+
+	return encoder->poll_fd;
+}
+
+int v4l2_encoder_poll_attach(struct v4l2_encoder *encoder, int poll_fd,
+			     void *data)
+{
+	if (!encoder || poll_fd < 0)
+		return -EINVAL;
+
+	v4l2_encoder_poll_detach(encoder);
+
+	/* Events carry the provided data to identify the encoder. */
+	encoder->poll_fd = poll_fd;
+	encoder->poll_data = data;
+	encoder->poll_shared = true;
+
+	v4l2_encoder_poll_register(encoder, true);
 
 	return 0;
 }
 
+void v4l2_encoder_poll_detach(struct v4l2_encoder *encoder)
+{
+	if (!encoder || encoder->poll_fd < 0)
+		return;
+
+	v4l2_encoder_poll_register(encoder, false);
+
+	if (!encoder->poll_shared)
+		close(encoder->poll_fd);
+
+	encoder->poll_fd = -1;
+	encoder->poll_data = NULL;
+	encoder->poll_shared = false;
+}
+
+/* Called as soon as polling returns, before any other work, to timestamp
+ * the requests that completed with the time they were seen at. */
+void v4l2_encoder_poll_event(struct v4l2_encoder *encoder, uint64_t time)
+{
+	struct v4l2_encoder_buffer *output_buffer;
+	struct pollfd pollfd = { 0 };
+	unsigned int position;
+	unsigned int i;
+
+	if (!encoder)
+		return;
+
+	/* Requests complete in order. */
+	for (i = 0; i < encoder->pending_count; i++) {
+		position = (encoder->pending_index + i) % encoder->buffers_max;
+		output_buffer =
+			&encoder->output_buffers[encoder->output_pending[position]];
+
+		if (!output_buffer->request_queued ||
+		    output_buffer->complete_time)
+			continue;
+
+		/* Polled directly, to keep this out of the ioctl statistics
+		 * and session records. */
+		pollfd.fd = output_buffer->request_fd;
+		pollfd.events = POLLPRI | POLLIN;
+
+		if (poll(&pollfd, 1, 0) <= 0 ||
+		    !(pollfd.revents & (POLLPRI | POLLIN)))
+			break;
+
+		v4l2_encoder_complete_stamp(output_buffer, time);
+	}
+}
+
 int v4l2_encoder_start(struct v4l2_encoder *encoder)
 {
 	int ret;
@@ -242,6 +1739,7 @@ int v4l2_encoder_start(struct v4l2_encoder *encoder)
 
 int v4l2_encoder_stop(struct v4l2_encoder *encoder)
 {
+	unsigned int i;
 	int ret;
 
 	if (!encoder || !encoder->started)
@@ -255,6 +1753,33 @@ int v4l2_encoder_stop(struct v4l2_encoder *encoder)
 	if (ret)
 		return ret;
 
+	/* Pending requests are cancelled when streaming stops. */
+	while (encoder->pending_count) {
+		unsigned int output_index = encoder->output_buffers_done_index;
+		unsigned int capture_index = encoder->capture_buffers_done_index;
+		struct v4l2_encoder_buffer *output_buffer =
+			&encoder->output_buffers[output_index];
+
+		if (output_buffer->request_queued)
+			v4l2_encoder_poll_remove(encoder,
+						 output_buffer->request_fd);
+
+		media_request_reinit(output_buffer->request_fd);
+
+		output_buffer->request_queued = false;
+		output_buffer->queued = false;
+		encoder->capture_buffers[capture_index].queued = false;
+
+		if (encoder->pending_count == 1)
+			v4l2_encoder_poll_remove(encoder, encoder->video_fd);
+
+		v4l2_encoder_pending_pop(encoder);
+	}
+
+	/* Including those left queued by failed requests. */
+	for (i = 0; i < encoder->capture_buffers_count; i++)
+		encoder->capture_buffers[i].queued = false;
+
 	encoder->started = false;
 
 	return 0;
@@ -267,12 +1792,42 @@ int v4l2_encoder_intra_request(struct v4l2_encoder *encoder)
 	if (!encoder || !encoder->started)
 		return -EINVAL;
 
-	encoder->gop_index = 0;
+	encoder->gop_index = 0;
+
+	ret = h264_rate_control_intra_request(encoder);
+	if (ret)
+		return ret;
+
+	return 0;
+}
+
+int v4l2_encoder_seek(struct v4l2_encoder *encoder, unsigned int frame)
+{
+	struct v4l2_ctrl_h264_encode_params *encode_params =
+		&encoder->h264_src_controls.encode_params;
+	int ret;
+
+	if (!encoder || !encoder->started)
+		return -EINVAL;
+
+	/* The next frame must not reference a frame still in flight. */
+	if (encoder->pending_count)
+		return -EBUSY;
+
+	if (frame % encoder->setup.gop_size)
+		return -EINVAL;
 
-	ret = h264_rate_control_intra_request(encoder);
+	ret = v4l2_encoder_intra_request(encoder);
 	if (ret)
 		return ret;
 
+	/* Number the IDR as a sequential encode would have. */
+	encode_params->idr_pic_id = frame / encoder->setup.gop_size;
+
+#ifdef MANDELBROT
+	draw_mandelbrot_seek(&encoder->draw_mandelbrot, frame);
+#endif
+
 	return 0;
 }
 
@@ -280,6 +1835,7 @@ int v4l2_encoder_buffer_setup(struct v4l2_encoder_buffer *buffer,
 			     unsigned int type, unsigned int index)
 {
 	struct v4l2_encoder *encoder;
+	unsigned int memory;
 	int ret;
 
 	if (!buffer || !buffer->encoder)
@@ -287,7 +1843,15 @@ int v4l2_encoder_buffer_setup(struct v4l2_encoder_buffer *buffer,
 
 	encoder = buffer->encoder;
 
-	v4l2_buffer_setup_base(&buffer->buffer, type, encoder->memory, index,
+	buffer->request_fd = -1;
+	buffer->export_fd = -1;
+
+	if (type == encoder->output_type)
+		memory = encoder->output_memory;
+	else
+		memory = encoder->capture_memory;
+
+	v4l2_buffer_setup_base(&buffer->buffer, type, memory, index,
 			       buffer->planes, buffer->planes_count);
 
 	ret = v4l2_buffer_query(encoder->video_fd, &buffer->buffer);
@@ -296,9 +1860,14 @@ int v4l2_encoder_buffer_setup(struct v4l2_encoder_buffer *buffer,
 		goto complete;
 	}
 
-	if(encoder->memory == V4L2_MEMORY_MMAP) {
+	if (memory == V4L2_MEMORY_MMAP) {
+		int flags = MAP_SHARED;
 		unsigned int i;
 
+		/* Fault the mappings in now rather than on the first frames. */
+		if (encoder->setup.memory_lock)
+			flags |= MAP_POPULATE;
+
 		for (i = 0; i < buffer->planes_count; i++) {
 			unsigned int offset;
 			unsigned int length;
@@ -314,12 +1883,20 @@ int v4l2_encoder_buffer_setup(struct v4l2_encoder_buffer *buffer,
 				goto complete;
 
 			buffer->mmap_data[i] =
-				mmap(NULL, length, PROT_READ | PROT_WRITE,
-				     MAP_SHARED, encoder->video_fd, offset);
+				loopback_mmap(NULL, length,
+					      PROT_READ | PROT_WRITE, flags,
+					      encoder->video_fd, offset);
 			if (buffer->mmap_data[i] == MAP_FAILED) {
 				ret = -errno;
 				goto complete;
 			}
+
+			if (encoder->setup.memory_lock &&
+			    mlock(buffer->mmap_data[i], length)) {
+				ret = -errno;
+				fprintf(stderr, "Failed to lock buffer memory\n");
+				goto complete;
+			}
 		}
 	}
 
@@ -331,8 +1908,15 @@ int v4l2_encoder_buffer_setup(struct v4l2_encoder_buffer *buffer,
 		}
 
 		v4l2_buffer_timestamp_set(&buffer->buffer, index * 1000);
-	} else {
-		buffer->request_fd = -1;
+	} else if (encoder->setup.capture_export) {
+		/* The slice is a single plane. */
+		buffer->export_fd = v4l2_buffer_export(encoder->video_fd, type,
+						       index, 0, O_CLOEXEC);
+		if (buffer->export_fd < 0) {
+			ret = buffer->export_fd;
+			fprintf(stderr, "Failed to export capture buffer\n");
+			goto complete;
+		}
 	}
 
 	ret = 0;
@@ -341,35 +1925,342 @@ complete:
 	return ret;
 }
 
-int v4l2_encoder_buffer_teardown(struct v4l2_encoder_buffer *buffer)
+static void v4l2_encoder_buffer_unmap(struct v4l2_encoder_buffer *buffer)
 {
-	struct v4l2_encoder *encoder;
+	unsigned int i;
+
+	if (buffer->buffer.memory != V4L2_MEMORY_MMAP)
+		return;
 
+	for (i = 0; i < buffer->planes_count; i++) {
+		unsigned int length;
+
+		if (!buffer->mmap_data[i] || buffer->mmap_data[i] == MAP_FAILED)
+			continue;
+
+		v4l2_buffer_plane_length(&buffer->buffer, i, &length);
+		munmap(buffer->mmap_data[i], length);
+
+		buffer->mmap_data[i] = NULL;
+	}
+}
+
+int v4l2_encoder_buffer_teardown(struct v4l2_encoder_buffer *buffer)
+{
 	if (!buffer || !buffer->encoder)
 		return -EINVAL;
 
-	encoder = buffer->encoder;
+	v4l2_encoder_buffer_unmap(buffer);
 
-	if(encoder->memory == V4L2_MEMORY_MMAP) {
-		unsigned int i;
+	if (buffer->request_fd >= 0)
+		media_request_free(buffer->request_fd);
 
-		for (i = 0; i < buffer->planes_count; i++) {
-			unsigned int length;
+	if (buffer->export_fd >= 0)
+		close(buffer->export_fd);
+
+	memset(buffer, 0, sizeof(*buffer));
+	buffer->request_fd = -1;
+	buffer->export_fd = -1;
+
+	return 0;
+}
+
+static int v4l2_encoder_buffers_setup(struct v4l2_encoder *encoder,
+				      unsigned int type, unsigned int index,
+				      unsigned int count)
+{
+	struct v4l2_encoder_buffer *buffers;
+	unsigned int *buffers_count;
+	unsigned int *free;
+	unsigned int *free_count;
+	unsigned int planes_count;
+	unsigned int i;
+	int ret;
+
+	if (type == encoder->output_type) {
+		buffers = encoder->output_buffers;
+		buffers_count = &encoder->output_buffers_count;
+		free = encoder->output_free;
+		free_count = &encoder->output_free_count;
+		planes_count = encoder->output_format.fmt.pix_mp.num_planes;
+	} else {
+		buffers = encoder->capture_buffers;
+		buffers_count = &encoder->capture_buffers_count;
+		free = encoder->capture_free;
+		free_count = &encoder->capture_free_count;
+		planes_count = encoder->capture_format.fmt.pix_mp.num_planes;
+	}
+
+	if (index + count > encoder->buffers_max)
+		return -EINVAL;
+
+	for (i = index; i < index + count; i++) {
+		buffers[i].encoder = encoder;
+		buffers[i].planes_count = planes_count;
+
+		ret = v4l2_encoder_buffer_setup(&buffers[i], type, i);
+		if (ret)
+			return ret;
+
+		/* Slots of removed buffers may be filled again. */
+		if (*buffers_count < i + 1)
+			*buffers_count = i + 1;
+
+		v4l2_encoder_free_push(free, free_count, i);
+	}
+
+	v4l2_encoder_free_update(encoder);
+
+	return 0;
+}
 
-			if (!buffer->mmap_data[i] ||
-			    buffer->mmap_data[i] == MAP_FAILED)
-					continue;
+static void v4l2_encoder_buffers_teardown(struct v4l2_encoder *encoder)
+{
+	unsigned int i;
+
+	if (encoder->output_buffers) {
+		for (i = 0; i < encoder->buffers_max; i++)
+			v4l2_encoder_buffer_teardown(&encoder->output_buffers[i]);
+
+		v4l2_buffers_destroy(encoder->video_fd, encoder->output_type,
+				     encoder->output_memory);
+	}
+
+	if (encoder->capture_buffers) {
+		for (i = 0; i < encoder->buffers_max; i++)
+			v4l2_encoder_buffer_teardown(&encoder->capture_buffers[i]);
+
+		v4l2_buffers_destroy(encoder->video_fd, encoder->capture_type,
+				     encoder->capture_memory);
+	}
+
+	free(encoder->output_buffers);
+	free(encoder->capture_buffers);
+	free(encoder->output_free);
+	free(encoder->capture_free);
+	free(encoder->output_pending);
+	free(encoder->capture_pending);
+
+	encoder->output_buffers = NULL;
+	encoder->capture_buffers = NULL;
+	encoder->output_free = NULL;
+	encoder->capture_free = NULL;
+	encoder->output_pending = NULL;
+	encoder->capture_pending = NULL;
+
+	encoder->output_buffers_count = 0;
+	encoder->output_free_count = 0;
+	encoder->capture_buffers_count = 0;
+	encoder->capture_free_count = 0;
+}
+
+static bool v4l2_encoder_capture_reusable(struct v4l2_encoder_buffer *buffer,
+					   unsigned int size)
+{
+	return buffer->encoder && buffer->released &&
+	       buffer->planes[0].length >= size;
+}
+
+static int v4l2_encoder_capture_reinstate(struct v4l2_encoder *encoder,
+					  unsigned int index)
+{
+	struct v4l2_encoder_buffer *buffer = &encoder->capture_buffers[index];
+	int ret;
+
+	buffer->retired = false;
+	buffer->released = false;
+
+	ret = v4l2_encoder_buffer_setup(buffer, encoder->capture_type, index);
+	if (ret)
+		return ret;
+
+	v4l2_encoder_free_push(encoder->capture_free,
+			       &encoder->capture_free_count, index);
+
+	return 0;
+}
+
+int v4l2_encoder_capture_resize(struct v4l2_encoder *encoder,
+				unsigned int size)
+{
+	struct v4l2_plane_pix_format *plane_format;
+	struct v4l2_encoder_buffer *buffer;
+	unsigned int buffers_count;
+	unsigned int active_count = 0;
+	unsigned int reused_count = 0;
+	unsigned int size_old;
+	unsigned int i;
+	int ret;
+
+	if (!encoder || !encoder->up || !size)
+		return -EINVAL;
+
+	if (!v4l2_type_mplane_check(encoder->capture_type))
+		return -EINVAL;
+
+	plane_format = &encoder->capture_format.fmt.pix_mp.plane_fmt[0];
+	size_old = plane_format->sizeimage;
+	buffers_count = encoder->capture_buffers_count;
+
+	for (i = 0; i < buffers_count; i++) {
+		buffer = &encoder->capture_buffers[i];
+
+		if (buffer->encoder && !buffer->retired)
+			active_count++;
+	}
+
+	/* Released buffers that are large enough come back first. */
+	for (i = 0; i < buffers_count && reused_count < active_count; i++)
+		if (v4l2_encoder_capture_reusable(&encoder->capture_buffers[i],
+						  size))
+			reused_count++;
+
+	plane_format->sizeimage = size;
 
-			v4l2_buffer_plane_length(&buffer->buffer, i, &length);
-			munmap(buffer->mmap_data[i], length);
+	if (active_count > reused_count) {
+		ret = v4l2_encoder_buffers_grow(encoder, encoder->capture_type,
+						active_count - reused_count);
+		if (ret) {
+			plane_format->sizeimage = size_old;
+			return ret;
 		}
 	}
 
-	if (buffer->request_fd >= 0)
-		close(buffer->request_fd);
+	/* Buffers held by requests or consumers retire once released. */
+	for (i = 0; i < buffers_count; i++) {
+		buffer = &encoder->capture_buffers[i];
 
-	memset(buffer, 0, sizeof(*buffer));
-	buffer->request_fd = -1;
+		if (!buffer->encoder || buffer->retired)
+			continue;
+
+		buffer->retired = true;
+		v4l2_encoder_free_take(encoder->capture_free,
+				       &encoder->capture_free_count, i);
+	}
+
+	for (i = 0; i < buffers_count && reused_count; i++) {
+		if (!v4l2_encoder_capture_reusable(&encoder->capture_buffers[i],
+						   size))
+			continue;
+
+		ret = v4l2_encoder_capture_reinstate(encoder, i);
+		if (ret)
+			return ret;
+
+		reused_count--;
+	}
+
+	/* Pending ones are released as they get replaced. */
+	for (i = 0; i < buffers_count; i++)
+		if (!v4l2_encoder_capture_pending_check(encoder, i))
+			v4l2_encoder_capture_release(encoder, i);
+
+	v4l2_encoder_free_update(encoder);
+
+	return 0;
+}
+
+/* Retired buffers are unmapped once neither queued nor lent. They are then
+ * removed when the driver supports it, or their slot is kept to be reused
+ * by a later resize. */
+int v4l2_encoder_capture_release(struct v4l2_encoder *encoder,
+				 unsigned int index)
+{
+	struct v4l2_encoder_buffer *buffer;
+	bool check;
+	int ret;
+
+	if (!encoder || index >= encoder->capture_buffers_count)
+		return -EINVAL;
+
+	buffer = &encoder->capture_buffers[index];
+
+	if (!buffer->encoder || !buffer->retired || buffer->released ||
+	    buffer->queued || buffer->lent)
+		return 0;
+
+	v4l2_encoder_buffer_unmap(buffer);
+
+	if (buffer->export_fd >= 0) {
+		close(buffer->export_fd);
+		buffer->export_fd = -1;
+	}
+
+	buffer->released = true;
+
+	check = v4l2_capabilities_check(encoder->capture_capabilities,
+					V4L2_BUF_CAP_SUPPORTS_REMOVE_BUFS);
+	if (!check)
+		return 0;
+
+	ret = v4l2_buffers_remove(encoder->video_fd, encoder->capture_type,
+				  index, 1);
+	if (ret)
+		return 0;
+
+	v4l2_encoder_buffer_teardown(buffer);
+
+	while (encoder->capture_buffers_count &&
+	       !encoder->capture_buffers[encoder->capture_buffers_count - 1].encoder)
+		encoder->capture_buffers_count--;
+
+	return 0;
+}
+
+int v4l2_encoder_buffers_grow(struct v4l2_encoder *encoder, unsigned int type,
+			      unsigned int count)
+{
+	struct v4l2_encoder_buffer *buffers;
+	struct v4l2_format *format;
+	unsigned int buffers_count;
+	unsigned int used_count = 0;
+	unsigned int memory;
+	unsigned int index;
+	unsigned int i;
+	int ret;
+
+	if (!encoder || !encoder->up || !count)
+		return -EINVAL;
+
+	if (type == encoder->output_type) {
+		buffers = encoder->output_buffers;
+		format = &encoder->output_format;
+		buffers_count = encoder->output_buffers_count;
+		memory = encoder->output_memory;
+	} else if (type == encoder->capture_type) {
+		buffers = encoder->capture_buffers;
+		format = &encoder->capture_format;
+		buffers_count = encoder->capture_buffers_count;
+		memory = encoder->capture_memory;
+	} else {
+		return -EINVAL;
+	}
+
+	/* Removed buffers leave slots that the driver fills again. */
+	for (i = 0; i < buffers_count; i++)
+		if (buffers[i].encoder)
+			used_count++;
+
+	if (used_count + count > encoder->buffers_max)
+		return -ENOSPC;
+
+	ret = v4l2_buffers_create(encoder->video_fd, type, memory, format,
+				  &count, &index);
+	if (ret)
+		return ret;
+
+	if (!count || index + count > encoder->buffers_max)
+		return -ENOSPC;
+
+	for (i = index; i < index + count && i < buffers_count; i++)
+		if (buffers[i].encoder)
+			return -ENOSPC;
+
+	ret = v4l2_encoder_buffers_setup(encoder, type, index, count);
+	if (ret) {
+		fprintf(stderr, "Failed to setup grown buffers\n");
+		return ret;
+	}
 
 	return 0;
 }
@@ -455,77 +2346,190 @@ int v4l2_encoder_setup_defaults(struct v4l2_encoder *encoder)
 	if (ret)
 		return ret;
 
-	ret = v4l2_encoder_setup_fps(encoder, 25);
-	if (ret)
-		return ret;
+	ret = v4l2_encoder_setup_fps(encoder, 25);
+	if (ret)
+		return ret;
+
+	ret = v4l2_encoder_setup_bitrate(encoder, 500000);
+	if (ret)
+		return ret;
+
+	encoder->setup.gop_size = 10;
+
+	encoder->setup.qp_intra_delta = 2;
+	encoder->setup.qp_min = 11;
+	encoder->setup.qp_max = 51;
+
+	encoder->setup.pipeline_depth = 1;
+	encoder->setup.output_buffers_count = 3;
+	encoder->setup.capture_buffers_count = 3;
+	encoder->setup.buffers_max = VIDEO_MAX_FRAME;
+	encoder->setup.output_memory = V4L2_MEMORY_MMAP;
+	encoder->setup.capture_export = false;
+
+	return 0;
+}
+
+int v4l2_encoder_setup_dimensions(struct v4l2_encoder *encoder,
+				  unsigned int width, unsigned int height)
+{
+	if (!encoder || !width || !height)
+		return -EINVAL;
+
+	if (encoder->up)
+		return -EBUSY;
+
+	encoder->setup.width = width;
+	encoder->setup.width_mbs = (width + 15) / 16;
+
+	encoder->setup.height = height;
+	encoder->setup.height_mbs = (height + 15) / 16;
+
+	return 0;
+}
+
+int v4l2_encoder_setup_format(struct v4l2_encoder *encoder, uint32_t format)
+{
+	if (!encoder)
+		return -EINVAL;
+
+	if (encoder->up)
+		return -EBUSY;
+
+	encoder->setup.format = format;
+
+	return 0;
+}
+
+int v4l2_encoder_setup_fps(struct v4l2_encoder *encoder, float fps)
+{
+	if (!encoder || !fps)
+		return -EINVAL;
+
+	encoder->setup.fps_den = 1000;
+	encoder->setup.fps_num = fps * encoder->setup.fps_den;
+
+	if (encoder->up)
+		h264_rate_control_update(encoder);
+
+	return 0;
+}
+
+int v4l2_encoder_setup_bitrate(struct v4l2_encoder *encoder, uint64_t bitrate)
+{
+	if (!encoder || !bitrate)
+		return -EINVAL;
+
+	encoder->setup.bitrate = bitrate;
+
+	if (encoder->up)
+		h264_rate_control_update(encoder);
+
+	return 0;
+}
+
+int v4l2_encoder_setup_gop_size(struct v4l2_encoder *encoder,
+				unsigned int gop_size)
+{
+	if (!encoder || !gop_size)
+		return -EINVAL;
+
+	encoder->setup.gop_size = gop_size;
+
+	if (encoder->up)
+		h264_rate_control_update(encoder);
+
+	return 0;
+}
+
+int v4l2_encoder_setup_qp(struct v4l2_encoder *encoder, unsigned int qp_min,
+			  unsigned int qp_max)
+{
+	if (!encoder || qp_min > qp_max || qp_max > 51)
+		return -EINVAL;
+
+	encoder->setup.qp_min = qp_min;
+	encoder->setup.qp_max = qp_max;
+
+	if (encoder->up)
+		h264_rate_control_update(encoder);
+
+	return 0;
+}
 
-	ret = v4l2_encoder_setup_bitrate(encoder, 500000);
-	if (ret)
-		return ret;
+int v4l2_encoder_setup_pipeline(struct v4l2_encoder *encoder,
+				unsigned int depth)
+{
+	if (!encoder || !depth)
+		return -EINVAL;
 
-	encoder->setup.gop_size = 10;
+	if (encoder->up)
+		return -EBUSY;
 
-	encoder->setup.qp_intra_delta = 2;
-	encoder->setup.qp_min = 11;
-	encoder->setup.qp_max = 51;
+	encoder->setup.pipeline_depth = depth;
 
 	return 0;
 }
 
-int v4l2_encoder_setup_dimensions(struct v4l2_encoder *encoder,
-				  unsigned int width, unsigned int height)
+int v4l2_encoder_setup_buffers(struct v4l2_encoder *encoder,
+			       unsigned int output_count,
+			       unsigned int capture_count, unsigned int max)
 {
-	if (!encoder || !width || !height)
+	if (!encoder || !output_count || !capture_count ||
+	    output_count > max || capture_count > max)
 		return -EINVAL;
 
 	if (encoder->up)
 		return -EBUSY;
 
-	encoder->setup.width = width;
-	encoder->setup.width_mbs = (width + 15) / 16;
-
-	encoder->setup.height = height;
-	encoder->setup.height_mbs = (height + 15) / 16;
+	encoder->setup.output_buffers_count = output_count;
+	encoder->setup.capture_buffers_count = capture_count;
+	encoder->setup.buffers_max = max;
 
 	return 0;
 }
 
-int v4l2_encoder_setup_format(struct v4l2_encoder *encoder, uint32_t format)
+int v4l2_encoder_setup_output_memory(struct v4l2_encoder *encoder,
+				     unsigned int memory)
 {
 	if (!encoder)
 		return -EINVAL;
 
+	if (memory != V4L2_MEMORY_MMAP && memory != V4L2_MEMORY_DMABUF &&
+	    memory != V4L2_MEMORY_USERPTR)
+		return -EINVAL;
+
 	if (encoder->up)
 		return -EBUSY;
 
-	encoder->setup.format = format;
+	encoder->setup.output_memory = memory;
 
 	return 0;
 }
 
-int v4l2_encoder_setup_fps(struct v4l2_encoder *encoder, float fps)
+int v4l2_encoder_setup_capture_export(struct v4l2_encoder *encoder,
+				      bool export)
 {
-	if (!encoder || !fps)
+	if (!encoder)
 		return -EINVAL;
 
-	encoder->setup.fps_den = 1000;
-	encoder->setup.fps_num = fps * encoder->setup.fps_den;
-
 	if (encoder->up)
-		h264_rate_control_setup(encoder);
+		return -EBUSY;
+
+	encoder->setup.capture_export = export;
 
 	return 0;
 }
 
-int v4l2_encoder_setup_bitrate(struct v4l2_encoder *encoder, uint64_t bitrate)
+int v4l2_encoder_setup_memory_lock(struct v4l2_encoder *encoder, bool lock)
 {
-	if (!encoder || !bitrate)
+	if (!encoder)
 		return -EINVAL;
 
-	encoder->setup.bitrate = bitrate;
-
 	if (encoder->up)
-		h264_rate_control_setup(encoder);
+		return -EBUSY;
+
+	encoder->setup.memory_lock = lock;
 
 	return 0;
 }
@@ -536,13 +2540,34 @@ int v4l2_encoder_setup(struct v4l2_encoder *encoder)
 	unsigned int buffers_count;
 	unsigned int capture_size;
 	uint32_t format;
-	unsigned int i;
 	int ret;
 
 	if (!encoder || encoder->up)
 		return -EINVAL;
 
-	capture_size = 512 * 1024;
+	/* Each pending request holds its own output and capture buffers. */
+	if (encoder->setup.pipeline_depth > encoder->setup.buffers_max ||
+	    encoder->setup.output_buffers_count > encoder->setup.buffers_max ||
+	    encoder->setup.capture_buffers_count > encoder->setup.buffers_max)
+		return -EINVAL;
+
+	if (encoder->setup.output_memory == V4L2_MEMORY_DMABUF &&
+	    !v4l2_capabilities_check(encoder->output_capabilities,
+				     V4L2_BUF_CAP_SUPPORTS_DMABUF)) {
+		fprintf(stderr, "Missing output DMABUF support\n");
+		return -EINVAL;
+	}
+
+	encoder->output_memory = encoder->setup.output_memory;
+
+	if (encoder->output_memory == V4L2_MEMORY_USERPTR &&
+	    !v4l2_capabilities_check(encoder->output_capabilities,
+				     V4L2_BUF_CAP_SUPPORTS_USERPTR)) {
+		fprintf(stderr, "Missing output USERPTR support, copying to MMAP buffers\n");
+		encoder->output_memory = V4L2_MEMORY_MMAP;
+	}
+
+	capture_size = h264_capture_size(encoder);
 	width = encoder->setup.width;
 	height = encoder->setup.height;
 	format = encoder->setup.format;
@@ -587,59 +2612,90 @@ int v4l2_encoder_setup(struct v4l2_encoder *encoder)
 		goto complete;
 	}
 
+	/* Buffers */
+
+	encoder->buffers_max = encoder->setup.buffers_max;
+
+	encoder->output_buffers = calloc(encoder->buffers_max,
+					 sizeof(*encoder->output_buffers));
+	encoder->capture_buffers = calloc(encoder->buffers_max,
+					  sizeof(*encoder->capture_buffers));
+	encoder->output_free = calloc(encoder->buffers_max,
+				      sizeof(*encoder->output_free));
+	encoder->capture_free = calloc(encoder->buffers_max,
+				       sizeof(*encoder->capture_free));
+	encoder->output_pending = calloc(encoder->buffers_max,
+					 sizeof(*encoder->output_pending));
+	encoder->capture_pending = calloc(encoder->buffers_max,
+					  sizeof(*encoder->capture_pending));
+	if (!encoder->output_buffers || !encoder->capture_buffers ||
+	    !encoder->output_free || !encoder->capture_free ||
+	    !encoder->output_pending || !encoder->capture_pending) {
+		ret = -ENOMEM;
+		goto error;
+	}
+
+	encoder->output_buffers_count = 0;
+	encoder->output_free_count = 0;
+	encoder->capture_buffers_count = 0;
+	encoder->capture_free_count = 0;
+
 	/* Capture buffers */
 
-	buffers_count = ARRAY_SIZE(encoder->capture_buffers);
+	buffers_count = encoder->setup.capture_buffers_count;
+	if (buffers_count < encoder->setup.pipeline_depth)
+		buffers_count = encoder->setup.pipeline_depth;
 
 	ret = v4l2_buffers_request(encoder->video_fd, encoder->capture_type,
-				   encoder->memory, buffers_count);
+				   encoder->capture_memory, buffers_count);
 	if (ret) {
 		fprintf(stderr, "Failed to allocate capture buffers\n");
 		goto error;
 	}
 
-	for (i = 0; i < buffers_count; i++) {
-		struct v4l2_encoder_buffer *buffer = &encoder->capture_buffers[i];
-
-		buffer->encoder = encoder;
-		buffer->planes_count =
-			encoder->capture_format.fmt.pix_mp.num_planes;
-
-		ret = v4l2_encoder_buffer_setup(buffer, encoder->capture_type, i);
-		if (ret) {
-			fprintf(stderr, "Failed to setup capture buffer\n");
-			goto error;
-		}
+	ret = v4l2_encoder_buffers_setup(encoder, encoder->capture_type, 0,
+					 buffers_count);
+	if (ret) {
+		fprintf(stderr, "Failed to setup capture buffers\n");
+		goto error;
 	}
 
-	encoder->capture_buffers_count = buffers_count;
+	encoder->capture_buffers_done_index = encoder->capture_buffers_index;
 
 	/* Output buffers */
 
-	buffers_count = ARRAY_SIZE(encoder->output_buffers);
+	buffers_count = encoder->setup.output_buffers_count;
+	if (buffers_count < encoder->setup.pipeline_depth)
+		buffers_count = encoder->setup.pipeline_depth;
 
 	ret = v4l2_buffers_request(encoder->video_fd, encoder->output_type,
-				   encoder->memory, buffers_count);
+				   encoder->output_memory, buffers_count);
+	if (ret && encoder->output_memory == V4L2_MEMORY_USERPTR) {
+		fprintf(stderr, "Rejected output USERPTR buffers, copying to MMAP buffers\n");
+		encoder->output_memory = V4L2_MEMORY_MMAP;
+
+		ret = v4l2_buffers_request(encoder->video_fd,
+					   encoder->output_type,
+					   encoder->output_memory,
+					   buffers_count);
+	}
+
 	if (ret) {
 		fprintf(stderr, "Failed to allocate output buffers\n");
-		goto complete;
+		goto error;
 	}
 
-	for (i = 0; i < buffers_count; i++) {
-		struct v4l2_encoder_buffer *buffer = &encoder->output_buffers[i];
-
-		buffer->encoder = encoder;
-		buffer->planes_count =
-			encoder->output_format.fmt.pix_mp.num_planes;
-
-		ret = v4l2_encoder_buffer_setup(buffer, encoder->output_type, i);
-		if (ret) {
-			fprintf(stderr, "Failed to setup output buffer\n");
-			goto error;
-		}
+	ret = v4l2_encoder_buffers_setup(encoder, encoder->output_type, 0,
+					 buffers_count);
+	if (ret) {
+		fprintf(stderr, "Failed to setup output buffers\n");
+		goto error;
 	}
 
-	encoder->output_buffers_count = buffers_count;
+	encoder->output_buffers_done_index = encoder->output_buffers_index;
+
+	encoder->pending_index = 0;
+	encoder->pending_count = 0;
 
 	/* Source controls */
 
@@ -665,73 +2721,461 @@ int v4l2_encoder_setup(struct v4l2_encoder *encoder)
 		goto error;
 	}
 
-	/* Draw buffer */
+	/* Draw buffer */
+
+	encoder->draw_buffer = draw_buffer_create(width, height,
+						  encoder->setup.memory_lock);
+	if (!encoder->draw_buffer) {
+		fprintf(stderr, "Failed to create draw buffer\n");
+		goto error;
+	}
+
+	/* Mandelbrot */
+
+	draw_mandelbrot_init(&encoder->draw_mandelbrot);
+
+	encoder->up = true;
+
+	ret = 0;
+	goto complete;
+
+error:
+	v4l2_encoder_buffers_teardown(encoder);
+
+complete:
+	return ret;
+}
+
+int v4l2_encoder_teardown(struct v4l2_encoder *encoder)
+{
+	if (!encoder || !encoder->up)
+		return -EINVAL;
+
+	v4l2_encoder_buffers_teardown(encoder);
+
+	h264_teardown(encoder);
+
+	encoder->up = false;
+
+	return 0;
+}
+
+/* Changing the format requires releasing the buffers of the queue. */
+static int v4l2_encoder_output_reconfigure(struct v4l2_encoder *encoder,
+					   struct v4l2_format *format)
+{
+	unsigned int buffers_count = encoder->output_buffers_count;
+	unsigned int i;
+	int ret;
+
+	if (encoder->started) {
+		ret = v4l2_stream_off(encoder->video_fd, encoder->output_type);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < buffers_count; i++)
+		v4l2_encoder_buffer_teardown(&encoder->output_buffers[i]);
+
+	encoder->output_buffers_count = 0;
+	encoder->output_free_count = 0;
+
+	ret = v4l2_buffers_destroy(encoder->video_fd, encoder->output_type,
+				   encoder->output_memory);
+	if (ret)
+		return ret;
+
+	ret = v4l2_format_set(encoder->video_fd, format);
+	if (ret) {
+		fprintf(stderr, "Failed to set output format\n");
+		return ret;
+	}
+
+	encoder->output_format = *format;
+
+	ret = v4l2_buffers_request(encoder->video_fd, encoder->output_type,
+				   encoder->output_memory, buffers_count);
+	if (ret) {
+		fprintf(stderr, "Failed to allocate output buffers\n");
+		return ret;
+	}
+
+	ret = v4l2_encoder_buffers_setup(encoder, encoder->output_type, 0,
+					 buffers_count);
+	if (ret) {
+		fprintf(stderr, "Failed to setup output buffers\n");
+		return ret;
+	}
+
+	encoder->output_buffers_done_index = encoder->output_buffers_index;
+
+	if (encoder->started) {
+		ret = v4l2_stream_on(encoder->video_fd, encoder->output_type);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* The coded format only changes without buffers, so they are all allocated
+ * again, at least as large as before. */
+static int v4l2_encoder_capture_reconfigure(struct v4l2_encoder *encoder,
+					    struct v4l2_format *format)
+{
+	unsigned int buffers_count = 0;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < encoder->capture_buffers_count; i++) {
+		struct v4l2_encoder_buffer *buffer = &encoder->capture_buffers[i];
+
+		if (buffer->lent)
+			return -EBUSY;
+
+		if (buffer->encoder && !buffer->retired)
+			buffers_count++;
+	}
+
+	if (encoder->started) {
+		ret = v4l2_stream_off(encoder->video_fd, encoder->capture_type);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < encoder->capture_buffers_count; i++)
+		v4l2_encoder_buffer_teardown(&encoder->capture_buffers[i]);
+
+	encoder->capture_buffers_count = 0;
+	encoder->capture_free_count = 0;
+
+	ret = v4l2_buffers_destroy(encoder->video_fd, encoder->capture_type,
+				   encoder->capture_memory);
+	if (ret)
+		return ret;
+
+	ret = v4l2_format_set(encoder->video_fd, format);
+	if (ret) {
+		fprintf(stderr, "Failed to set capture format\n");
+		return ret;
+	}
+
+	encoder->capture_format = *format;
+
+	ret = v4l2_buffers_request(encoder->video_fd, encoder->capture_type,
+				   encoder->capture_memory, buffers_count);
+	if (ret) {
+		fprintf(stderr, "Failed to allocate capture buffers\n");
+		return ret;
+	}
+
+	ret = v4l2_encoder_buffers_setup(encoder, encoder->capture_type, 0,
+					 buffers_count);
+	if (ret) {
+		fprintf(stderr, "Failed to setup capture buffers\n");
+		return ret;
+	}
+
+	encoder->capture_buffers_done_index = encoder->capture_buffers_index;
+
+	if (encoder->started) {
+		ret = v4l2_stream_on(encoder->video_fd, encoder->capture_type);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int v4l2_encoder_reconfigure(struct v4l2_encoder *encoder, unsigned int width,
+			     unsigned int height, uint32_t format, float fps)
+{
+	struct v4l2_encoder_setup *setup;
+	struct v4l2_encoder_setup setup_old;
+	struct v4l2_format output_format;
+	struct v4l2_format output_format_old;
+	struct v4l2_format capture_format;
+	struct v4l2_format capture_format_old;
+	struct draw_buffer *draw_buffer = NULL;
+	struct v4l2_plane_pix_format *plane_format;
+	unsigned int capture_size;
+	bool capture_reconfigured = false;
+	int ret;
+
+	if (!encoder || !encoder->up || !width || !height || !fps)
+		return -EINVAL;
+
+	/* Frames in flight were set up for the previous configuration. */
+	if (encoder->pending_count)
+		return -EBUSY;
+
+	ret = v4l2_encoder_capture_reclaim(encoder);
+	if (ret)
+		return ret;
+
+	setup = &encoder->setup;
+	setup_old = *setup;
+	output_format_old = encoder->output_format;
+	capture_format_old = encoder->capture_format;
+
+	setup->width = width;
+	setup->width_mbs = (width + 15) / 16;
+	setup->height = height;
+	setup->height_mbs = (height + 15) / 16;
+	setup->format = format;
+	setup->fps_den = 1000;
+	setup->fps_num = fps * setup->fps_den;
+
+	/* Output */
+
+	if (width != setup_old.width || height != setup_old.height ||
+	    format != setup_old.format) {
+		v4l2_format_setup_pixel(&output_format, encoder->output_type,
+					width, height, format);
+
+		ret = v4l2_format_try(encoder->video_fd, &output_format);
+		if (ret) {
+			fprintf(stderr, "Failed to try output format\n");
+			goto error;
+		}
+
+		draw_buffer = draw_buffer_create(width, height,
+						 setup->memory_lock);
+		if (!draw_buffer) {
+			fprintf(stderr, "Failed to create draw buffer\n");
+			ret = -ENOMEM;
+			goto error;
+		}
+
+		ret = v4l2_encoder_output_reconfigure(encoder, &output_format);
+		if (ret)
+			goto error_output;
+	}
+
+	/* Capture, with buffers that are large enough kept when the coded
+	 * size does not change. */
+
+	capture_size = h264_capture_size(encoder);
+
+	if (v4l2_type_mplane_check(encoder->capture_type)) {
+		plane_format = &encoder->capture_format.fmt.pix_mp.plane_fmt[0];
+
+		if (width != setup_old.width || height != setup_old.height) {
+			v4l2_format_setup_pixel(&capture_format,
+						encoder->capture_type, width,
+						height,
+						V4L2_PIX_FMT_H264_SLICE);
+			capture_format.fmt.pix_mp.plane_fmt[0].sizeimage =
+				capture_size > plane_format->sizeimage ?
+				capture_size : plane_format->sizeimage;
+
+			ret = v4l2_format_try(encoder->video_fd,
+					      &capture_format);
+			if (ret) {
+				fprintf(stderr, "Failed to try capture format\n");
+				goto error_output;
+			}
+
+			capture_reconfigured = true;
+
+			ret = v4l2_encoder_capture_reconfigure(encoder,
+							       &capture_format);
+			if (ret) {
+				fprintf(stderr, "Failed to reconfigure capture buffers\n");
+				goto error_capture;
+			}
+		} else if (capture_size > plane_format->sizeimage) {
+			ret = v4l2_encoder_capture_resize(encoder,
+							  capture_size);
+			if (ret) {
+				fprintf(stderr, "Failed to resize capture buffers\n");
+				goto error_output;
+			}
+		}
+	}
+
+	/* H.264 */
+
+	ret = h264_reconfigure(encoder);
+	if (ret)
+		goto error_h264;
+
+	if (draw_buffer) {
+		draw_buffer_destroy(encoder->draw_buffer);
+		encoder->draw_buffer = draw_buffer;
+	}
+
+	return 0;
+
+error_h264:
+	/* Parameter sets follow the previous dimensions again. */
+	*setup = setup_old;
+	h264_reconfigure(encoder);
+
+error_capture:
+	if (capture_reconfigured &&
+	    v4l2_encoder_capture_reconfigure(encoder, &capture_format_old))
+		fprintf(stderr, "Failed to restore capture format\n");
+
+error_output:
+	/* Output buffers were already set up again for the new format. */
+	if (draw_buffer) {
+		*setup = setup_old;
+
+		if (v4l2_encoder_output_reconfigure(encoder,
+						    &output_format_old))
+			fprintf(stderr, "Failed to restore output format\n");
+
+		draw_buffer_destroy(draw_buffer);
+	}
+
+error:
+	*setup = setup_old;
+
+	return ret;
+}
+
+static int v4l2_encoder_probe_identity(struct v4l2_encoder *encoder,
+				       struct v4l2_encoder_probe_entry *entry)
+{
+	struct stat stat;
+
+	if (fstat(encoder->video_fd, &stat))
+		return -errno;
+
+	memset(entry, 0, sizeof(*entry));
+	entry->magic = V4L2_ENCODER_PROBE_MAGIC;
+	entry->rdev = stat.st_rdev;
+	entry->ino = stat.st_ino;
+	entry->ctime = stat.st_ctim;
+
+	return 0;
+}
+
+static bool v4l2_encoder_probe_match(struct v4l2_encoder_probe_entry *entry,
+				     struct v4l2_encoder_probe_entry *identity)
+{
+	return entry->magic == identity->magic &&
+	       entry->rdev == identity->rdev && entry->ino == identity->ino &&
+	       entry->ctime.tv_sec == identity->ctime.tv_sec &&
+	       entry->ctime.tv_nsec == identity->ctime.tv_nsec;
+}
 
-	encoder->draw_buffer = draw_buffer_create(width, height);
-	if (!encoder->draw_buffer) {
-		fprintf(stderr, "Failed to create draw buffer\n");
-		goto error;
-	}
+static int v4l2_encoder_probe_cache_load(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_probe_entry entries[V4L2_ENCODER_PROBE_ENTRIES];
+	struct v4l2_encoder_probe_entry identity;
+	struct v4l2_encoder_probe_entry *entry;
+	unsigned int count;
+	ssize_t length;
+	unsigned int i;
+	int fd;
+	int ret;
 
-	/* Mandelbrot */
+	if (!encoder->probe_cache_path)
+		return -ENOENT;
 
-	draw_mandelbrot_init(&encoder->draw_mandelbrot);
+	ret = v4l2_encoder_probe_identity(encoder, &identity);
+	if (ret)
+		return ret;
 
-	encoder->up = true;
+	fd = open(encoder->probe_cache_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
 
-	ret = 0;
-	goto complete;
+	length = read(fd, entries, sizeof(entries));
+	close(fd);
 
-error:
-	buffers_count = ARRAY_SIZE(encoder->output_buffers);
+	if (length < 0)
+		return -errno;
 
-	for (i = 0; i < buffers_count; i++)
-		v4l2_encoder_buffer_teardown(&encoder->output_buffers[i]);
+	count = length / sizeof(*entries);
 
-	v4l2_buffers_destroy(encoder->video_fd, encoder->output_type,
-			     encoder->memory);
+	for (i = 0; i < count; i++) {
+		entry = &entries[i];
 
-	buffers_count = ARRAY_SIZE(encoder->capture_buffers);
+		if (!v4l2_encoder_probe_match(entry, &identity))
+			continue;
 
-	for (i = 0; i < buffers_count; i++)
-		v4l2_encoder_buffer_teardown(&encoder->capture_buffers[i]);
+		memcpy(encoder->driver, entry->driver, sizeof(encoder->driver));
+		memcpy(encoder->card, entry->card, sizeof(encoder->card));
+		encoder->driver[sizeof(encoder->driver) - 1] = '\0';
+		encoder->card[sizeof(encoder->card) - 1] = '\0';
 
-	v4l2_buffers_destroy(encoder->video_fd, encoder->capture_type,
-			     encoder->memory);
+		encoder->capabilities = entry->capabilities;
+		encoder->output_type = entry->output_type;
+		encoder->output_capabilities = entry->output_capabilities;
+		encoder->capture_type = entry->capture_type;
+		encoder->capture_capabilities = entry->capture_capabilities;
 
-complete:
-	return ret;
+		return 0;
+	}
+
+	return -ENOENT;
 }
 
-int v4l2_encoder_teardown(struct v4l2_encoder *encoder)
+/* Entries for the same device number are replaced, the first one goes when
+ * the cache is full. */
+static int v4l2_encoder_probe_cache_store(struct v4l2_encoder *encoder)
 {
-	unsigned int buffers_count;
+	struct v4l2_encoder_probe_entry entries[V4L2_ENCODER_PROBE_ENTRIES];
+	struct v4l2_encoder_probe_entry entry;
+	unsigned int count;
+	ssize_t length;
 	unsigned int i;
+	int fd;
+	int ret;
 
-	if (!encoder || !encoder->up)
-		return -EINVAL;
+	if (!encoder->probe_cache_path)
+		return 0;
 
-	buffers_count = ARRAY_SIZE(encoder->output_buffers);
+	ret = v4l2_encoder_probe_identity(encoder, &entry);
+	if (ret)
+		return ret;
 
-	for (i = 0; i < buffers_count; i++)
-		v4l2_encoder_buffer_teardown(&encoder->output_buffers[i]);
+	memcpy(entry.driver, encoder->driver, sizeof(entry.driver));
+	memcpy(entry.card, encoder->card, sizeof(entry.card));
 
-	v4l2_buffers_destroy(encoder->video_fd, encoder->output_type,
-			     encoder->memory);
+	entry.capabilities = encoder->capabilities;
+	entry.output_type = encoder->output_type;
+	entry.output_capabilities = encoder->output_capabilities;
+	entry.capture_type = encoder->capture_type;
+	entry.capture_capabilities = encoder->capture_capabilities;
 
-	buffers_count = ARRAY_SIZE(encoder->capture_buffers);
+	fd = open(encoder->probe_cache_path, O_RDWR | O_CREAT | O_CLOEXEC,
+		  0644);
+	if (fd < 0)
+		return -errno;
 
-	for (i = 0; i < buffers_count; i++)
-		v4l2_encoder_buffer_teardown(&encoder->capture_buffers[i]);
+	length = read(fd, entries, sizeof(entries));
+	if (length < 0) {
+		ret = -errno;
+		goto complete;
+	}
 
-	v4l2_buffers_destroy(encoder->video_fd, encoder->capture_type,
-			     encoder->memory);
+	count = length / sizeof(*entries);
 
-	h264_teardown(encoder);
+	for (i = 0; i < count; i++)
+		if (entries[i].magic != V4L2_ENCODER_PROBE_MAGIC ||
+		    entries[i].rdev == entry.rdev)
+			break;
 
-	encoder->up = false;
+	if (i == V4L2_ENCODER_PROBE_ENTRIES)
+		i = 0;
 
-	return 0;
+	/* A single write keeps concurrent readers from seeing half entries. */
+	length = pwrite(fd, &entry, sizeof(entry), i * sizeof(entry));
+	if (length != sizeof(entry)) {
+		ret = length < 0 ? -errno : -EIO;
+		goto complete;
+	}
+
+	ret = 0;
+
+complete:
+	close(fd);
+
+	return ret;
 }
 
 int v4l2_encoder_probe(struct v4l2_encoder *encoder)
@@ -742,6 +3186,18 @@ int v4l2_encoder_probe(struct v4l2_encoder *encoder)
 	if (!encoder || encoder->video_fd < 0)
 		return -EINVAL;
 
+	/* Results are only cached once the device was fully checked. */
+	ret = v4l2_encoder_probe_cache_load(encoder);
+	if (!ret) {
+		printf("Probed driver %s card %s (cached)\n", encoder->driver,
+		       encoder->card);
+
+		encoder->output_memory = V4L2_MEMORY_MMAP;
+		encoder->capture_memory = V4L2_MEMORY_MMAP;
+
+		return 0;
+	}
+
 	ret = v4l2_capabilities_probe(encoder->video_fd, &encoder->capabilities,
 				      (char *)&encoder->driver,
 				      (char *)&encoder->card);
@@ -786,7 +3242,8 @@ int v4l2_encoder_probe(struct v4l2_encoder *encoder)
 	if (ret)
 		return ret;
 
-	encoder->memory = V4L2_MEMORY_MMAP;
+	encoder->output_memory = V4L2_MEMORY_MMAP;
+	encoder->capture_memory = V4L2_MEMORY_MMAP;
 
 	check = v4l2_pixel_format_check(encoder->video_fd, encoder->capture_type,
 					V4L2_PIX_FMT_H264_SLICE);
@@ -795,11 +3252,16 @@ int v4l2_encoder_probe(struct v4l2_encoder *encoder)
 		return -EINVAL;
 	}
 
+	ret = v4l2_encoder_probe_cache_store(encoder);
+	if (ret)
+		fprintf(stderr, "Failed to store probe results\n");
+
 	return 0;
 }
 
 static int media_device_probe(struct v4l2_encoder *encoder, struct udev *udev,
-			      struct udev_device *device)
+			      struct udev_device *device,
+			      unsigned int entity_index)
 {
 	const char *path = udev_device_get_devnode(device);
 	struct media_device_info device_info = { 0 };
@@ -815,6 +3277,7 @@ static int media_device_probe(struct v4l2_encoder *encoder, struct udev *udev,
 	struct media_v2_pad *source_pad;
 	struct media_v2_link *source_link;
 	const char *driver = "hantro-vpu";
+	unsigned int i;
 	int media_fd = -1;
 	int video_fd = -1;
 	dev_t devnum;
@@ -878,11 +3341,18 @@ static int media_device_probe(struct v4l2_encoder *encoder, struct udev *udev,
 	if (ret)
 		goto error;
 
-	encoder_entity = media_topology_entity_find_by_function(&topology,
-								MEDIA_ENT_F_PROC_VIDEO_ENCODER);
-	if (!encoder_entity) {
-		ret = -ENODEV;
-		goto error;
+	encoder_entity = NULL;
+
+	/* Devices may expose several encoder cores. */
+	for (i = 0; i <= entity_index; i++) {
+		encoder_entity =
+			media_topology_entity_find_next_by_function(&topology,
+								    encoder_entity,
+								    MEDIA_ENT_F_PROC_VIDEO_ENCODER);
+		if (!encoder_entity) {
+			ret = -ENODEV;
+			goto error;
+		}
 	}
 
 	sink_pad = media_topology_pad_find_by_entity(&topology,
@@ -968,6 +3438,257 @@ complete:
 	return ret;
 }
 
+static int v4l2_encoder_bitstream_open(struct v4l2_encoder *encoder)
+{
+	if (!encoder->bitstream_path)
+		encoder->bitstream_path = "capture.h264";
+
+	encoder->bitstream_fd = open(encoder->bitstream_path,
+				     O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (encoder->bitstream_fd < 0) {
+		fprintf(stderr, "Failed to open bitstream file\n");
+		return -errno;
+	}
+
+	return 0;
+}
+
+int v4l2_encoder_devices_enumerate(struct v4l2_encoder_device **devices,
+				   unsigned int *devices_count)
+{
+	struct v4l2_encoder_device *devices_list = NULL;
+	struct v4l2_encoder_device *devices_resized;
+	unsigned int count = 0;
+	struct v4l2_encoder *encoder = NULL;
+	struct udev *udev = NULL;
+	struct udev_enumerate *enumerate = NULL;
+	struct udev_list_entry *entry;
+	int ret;
+
+	if (!devices || !devices_count)
+		return -EINVAL;
+
+	encoder = calloc(1, sizeof(*encoder));
+	if (!encoder) {
+		ret = -ENOMEM;
+		goto error;
+	}
+
+	udev = udev_new();
+	if (!udev) {
+		ret = -ENOMEM;
+		goto error;
+	}
+
+	enumerate = udev_enumerate_new(udev);
+	if (!enumerate) {
+		ret = -ENOMEM;
+		goto error;
+	}
+
+	udev_enumerate_add_match_subsystem(enumerate, "media");
+	udev_enumerate_scan_devices(enumerate);
+
+	udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+		struct udev_device *device;
+		unsigned int entity_index;
+		const char *path;
+
+		path = udev_list_entry_get_name(entry);
+		if (!path)
+			continue;
+
+		device = udev_device_new_from_syspath(udev, path);
+		if (!device)
+			continue;
+
+		/* Keep every encoder entity each media device exposes. */
+		for (entity_index = 0; ; entity_index++) {
+			ret = media_device_probe(encoder, udev, device,
+						 entity_index);
+			if (ret)
+				break;
+
+			close(encoder->video_fd);
+			close(encoder->media_fd);
+
+			devices_resized = realloc(devices_list, (count + 1) *
+						  sizeof(*devices_list));
+			if (!devices_resized) {
+				udev_device_unref(device);
+				ret = -ENOMEM;
+				goto error;
+			}
+
+			devices_list = devices_resized;
+
+			snprintf(devices_list[count].syspath,
+				 sizeof(devices_list[count].syspath), "%s",
+				 path);
+			devices_list[count].entity_index = entity_index;
+			count++;
+		}
+
+		udev_device_unref(device);
+	}
+
+	*devices = devices_list;
+	*devices_count = count;
+
+	ret = 0;
+	goto complete;
+
+error:
+	if (devices_list)
+		free(devices_list);
+
+complete:
+	if (enumerate)
+		udev_enumerate_unref(enumerate);
+
+	if (udev)
+		udev_unref(udev);
+
+	if (encoder)
+		free(encoder);
+
+	return ret;
+}
+
+int v4l2_encoder_open_loopback(struct v4l2_encoder *encoder,
+			       struct loopback_setup *setup)
+{
+	int ret;
+
+	if (!encoder || !setup)
+		return -EINVAL;
+
+	encoder->poll_fd = -1;
+	encoder->bitstream_fd = -1;
+
+	encoder->loopback = loopback_create(setup);
+	if (!encoder->loopback) {
+		fprintf(stderr, "Failed to create loopback encoder\n");
+		return -ENOMEM;
+	}
+
+	encoder->media_fd = encoder->loopback->media_fd;
+	encoder->video_fd = encoder->loopback->video_fd;
+
+	ret = v4l2_encoder_bitstream_open(encoder);
+	if (ret) {
+		loopback_destroy(encoder->loopback);
+		encoder->loopback = NULL;
+
+		encoder->media_fd = -1;
+		encoder->video_fd = -1;
+	}
+
+	return ret;
+}
+
+int v4l2_encoder_open_device(struct v4l2_encoder *encoder,
+			     struct v4l2_encoder_device *encoder_device)
+{
+	struct udev *udev = NULL;
+	struct udev_device *device = NULL;
+	int ret;
+
+	if (!encoder || !encoder_device)
+		return -EINVAL;
+
+	encoder->media_fd = -1;
+	encoder->video_fd = -1;
+	encoder->poll_fd = -1;
+	encoder->bitstream_fd = -1;
+
+	udev = udev_new();
+	if (!udev) {
+		ret = -ENOMEM;
+		goto complete;
+	}
+
+	device = udev_device_new_from_syspath(udev, encoder_device->syspath);
+	if (!device) {
+		ret = -ENODEV;
+		goto complete;
+	}
+
+	ret = media_device_probe(encoder, udev, device,
+				 encoder_device->entity_index);
+	if (ret) {
+		fprintf(stderr, "Failed to open encoder device %s\n",
+			encoder_device->syspath);
+		goto complete;
+	}
+
+	ret = v4l2_encoder_bitstream_open(encoder);
+	if (ret) {
+		close(encoder->video_fd);
+		encoder->video_fd = -1;
+
+		close(encoder->media_fd);
+		encoder->media_fd = -1;
+	}
+
+complete:
+	if (device)
+		udev_device_unref(device);
+
+	if (udev)
+		udev_unref(udev);
+
+	return ret;
+}
+
+/* Skip discovery altogether when the device nodes are known. */
+int v4l2_encoder_open_paths(struct v4l2_encoder *encoder,
+			    const char *media_path, const char *video_path)
+{
+	int ret;
+
+	if (!encoder || !media_path || !video_path)
+		return -EINVAL;
+
+	encoder->media_fd = -1;
+	encoder->video_fd = -1;
+	encoder->poll_fd = -1;
+	encoder->bitstream_fd = -1;
+
+	encoder->media_fd = open(media_path, O_RDWR);
+	if (encoder->media_fd < 0) {
+		fprintf(stderr, "Failed to open media device %s\n", media_path);
+		ret = -errno;
+		goto error;
+	}
+
+	encoder->video_fd = open(video_path, O_RDWR | O_NONBLOCK);
+	if (encoder->video_fd < 0) {
+		fprintf(stderr, "Failed to open video device %s\n", video_path);
+		ret = -errno;
+		goto error;
+	}
+
+	ret = v4l2_encoder_bitstream_open(encoder);
+	if (ret)
+		goto error;
+
+	return 0;
+
+error:
+	if (encoder->media_fd >= 0) {
+		close(encoder->media_fd);
+		encoder->media_fd = -1;
+	}
+
+	if (encoder->video_fd >= 0) {
+		close(encoder->video_fd);
+		encoder->video_fd = -1;
+	}
+
+	return ret;
+}
+
 int v4l2_encoder_open(struct v4l2_encoder *encoder)
 {
 	struct udev *udev = NULL;
@@ -981,6 +3702,7 @@ int v4l2_encoder_open(struct v4l2_encoder *encoder)
 
 	encoder->media_fd = -1;
 	encoder->video_fd = -1;
+	encoder->poll_fd = -1;
 
 	udev = udev_new();
 	if (!udev)
@@ -1007,7 +3729,7 @@ int v4l2_encoder_open(struct v4l2_encoder *encoder)
 		if (!device)
 			continue;
 
-		ret = media_device_probe(encoder, udev, device);
+		ret = media_device_probe(encoder, udev, device, 0);
 
 		udev_device_unref(device);
 
@@ -1025,13 +3747,9 @@ int v4l2_encoder_open(struct v4l2_encoder *encoder)
 		goto error;
 	}
 
-	encoder->bitstream_fd = open("capture.h264",
-				     O_WRONLY | O_CREAT | O_TRUNC, 0644);
-	if (encoder->bitstream_fd < 0) {
-		fprintf(stderr, "Failed to open bitstream file\n");
-		ret = -errno;
+	ret = v4l2_encoder_bitstream_open(encoder);
+	if (ret)
 		goto error;
-	}
 
 	ret = 0;
 	goto complete;
@@ -1069,6 +3787,26 @@ void v4l2_encoder_close(struct v4l2_encoder *encoder)
 		encoder->bitstream_fd = -1;
 	}
 
+	v4l2_encoder_poll_detach(encoder);
+
+	free(encoder->stats);
+	encoder->stats = NULL;
+
+	trace_destroy(encoder->trace);
+	encoder->trace = NULL;
+
+	metrics_destroy(encoder->metrics);
+	encoder->metrics = NULL;
+
+	/* The loopback instance owns its fds. */
+	if (encoder->loopback) {
+		loopback_destroy(encoder->loopback);
+		encoder->loopback = NULL;
+
+		encoder->media_fd = -1;
+		encoder->video_fd = -1;
+	}
+
 	if (encoder->media_fd > 0) {
 		close(encoder->media_fd);
 		encoder->media_fd = -1;
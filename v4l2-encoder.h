@@ -6,13 +6,55 @@
 #ifndef _V4L2_ENCODER_H_
 #define _V4L2_ENCODER_H_
 
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include <sys/types.h>
+
 #include <linux/videodev2.h>
 
 #include <h264-rate-control.h>
 #include <draw.h>
+#include <loopback.h>
+#include <histogram.h>
+#include <trace.h>
+#include <perf.h>
+#include <metrics.h>
 
 struct v4l2_encoder;
 
+enum v4l2_encoder_stage {
+	V4L2_ENCODER_STAGE_DRAW,
+	V4L2_ENCODER_STAGE_CSC,
+	V4L2_ENCODER_STAGE_QBUF,
+	V4L2_ENCODER_STAGE_CONTROLS,
+	V4L2_ENCODER_STAGE_REQUEST_QUEUE,
+	/* From the hardware taking a request, when queued or once the
+	 * previous one completed, until its completion event. */
+	V4L2_ENCODER_STAGE_HARDWARE,
+	V4L2_ENCODER_STAGE_DQBUF,
+	V4L2_ENCODER_STAGE_WRITE,
+	/* From drawing or submitting to feedback. */
+	V4L2_ENCODER_STAGE_TOTAL,
+	V4L2_ENCODER_STAGES,
+};
+
+struct v4l2_encoder_stats {
+	struct histogram stages[V4L2_ENCODER_STAGES];
+
+	uint64_t start_time;
+
+	/* Encoded slices, counted with the total stage. */
+	atomic_uint_fast64_t bytes;
+
+	/* Sum of the hardware stage, as of the last completion. */
+	atomic_uint_fast64_t busy_time;
+
+	/* Per-frame hardware counters, for the CPU stages only. */
+	bool perf;
+	struct histogram counters[V4L2_ENCODER_STAGES][PERF_COUNTERS];
+};
+
 struct v4l2_encoder_buffer {
 	struct v4l2_encoder *encoder;
 
@@ -23,6 +65,66 @@ struct v4l2_encoder_buffer {
 	unsigned int planes_count;
 
 	int request_fd;
+	bool request_queued;
+	bool queued;
+
+	unsigned int slice_type;
+	unsigned int frame_num;
+	uint64_t queue_time;
+	uint64_t start_time;
+	/* When the request completion event was seen. */
+	uint64_t complete_time;
+
+	/* Rate control budget the frame was queued with. */
+	unsigned int bits_target;
+	unsigned int bits_left;
+
+	/* Controls the frame was queued with, to encode it again. */
+	struct v4l2_ctrl_h264_encode_params encode_params;
+	struct v4l2_ctrl_h264_encode_rc encode_rc;
+
+	/* Capture buffers from before a resize are not used again, they are
+	 * released once idle and their slot is removed or reused. */
+	bool retired;
+	bool released;
+
+	/* Held by a consumer while lent, possibly as an exported dmabuf. */
+	int export_fd;
+	bool lent;
+
+	/* Imported dmabufs, kept to reuse the same slot for them. Inodes are
+	 * only unique within the same device. */
+	dev_t dmabuf_devs[4];
+	ino_t dmabuf_ids[4];
+	uint64_t dmabuf_time;
+};
+
+/*
+ * Submitted frames refer to the next output buffer, reaped frames also point
+ * to the encoded slice, which stays valid until the next reap or until the
+ * capture buffer is returned when it was lent. User planes given on submit
+ * must stay valid until the frame is reaped.
+ */
+struct v4l2_encoder_frame {
+	struct v4l2_encoder_buffer *output_buffer;
+	struct v4l2_encoder_buffer *capture_buffer;
+
+	void *planes[4];
+
+	void *data;
+	unsigned int size;
+	int fd;
+
+	unsigned int slice_type;
+	unsigned int frame_num;
+	uint64_t timestamp;
+	uint64_t queue_time;
+	uint64_t complete_time;
+};
+
+struct v4l2_encoder_device {
+	char syspath[256];
+	unsigned int entity_index;
 };
 
 struct v4l2_encoder_h264_src_controls {
@@ -68,18 +170,35 @@ struct v4l2_encoder_setup {
 	unsigned int qp_intra_delta;
 	unsigned int qp_min;
 	unsigned int qp_max;
-	
+
+	/* Pipeline */
+	unsigned int pipeline_depth;
+
+	/* Buffers */
+	unsigned int output_buffers_count;
+	unsigned int capture_buffers_count;
+	unsigned int buffers_max;
+
+	/* Memory */
+	unsigned int output_memory;
+	bool capture_export;
+	bool memory_lock;
 };
 
 struct v4l2_encoder {
 	int video_fd;
 	int media_fd;
+	struct loopback *loopback;
+	int poll_fd;
+	void *poll_data;
+	bool poll_shared;
 
 	char driver[32];
 	char card[32];
 
 	unsigned int capabilities;
-	unsigned int memory;
+	unsigned int output_memory;
+	unsigned int capture_memory;
 
 	bool up;
 	bool started;
@@ -89,16 +208,35 @@ struct v4l2_encoder {
 	unsigned int output_type;
 	unsigned int output_capabilities;
 	struct v4l2_format output_format;
-	struct v4l2_encoder_buffer output_buffers[3];
+	struct v4l2_encoder_buffer *output_buffers;
 	unsigned int output_buffers_count;
 	unsigned int output_buffers_index;
+	unsigned int output_buffers_done_index;
+	unsigned int *output_free;
+	unsigned int output_free_count;
 
 	unsigned int capture_type;
 	unsigned int capture_capabilities;
 	struct v4l2_format capture_format;
-	struct v4l2_encoder_buffer capture_buffers[3];
+	struct v4l2_encoder_buffer *capture_buffers;
 	unsigned int capture_buffers_count;
 	unsigned int capture_buffers_index;
+	unsigned int capture_buffers_done_index;
+	unsigned int *capture_free;
+	unsigned int capture_free_count;
+
+	/* Pools are allocated for the most buffers they can grow to. */
+	unsigned int buffers_max;
+
+	/* Buffers of pending requests, in queue order. */
+	unsigned int *output_pending;
+	unsigned int *capture_pending;
+	unsigned int pending_index;
+	unsigned int pending_count;
+	/* Completion of the last request, when the hardware moved on. */
+	uint64_t complete_time;
+
+	uint64_t dmabuf_sequence;
 
 	struct v4l2_encoder_h264_src_controls h264_src_controls;
 	struct v4l2_encoder_h264_dst_controls h264_dst_controls;
@@ -117,15 +255,60 @@ struct v4l2_encoder {
 	bool pattern_drawn;
 	bool direction;
 
+	const char *bitstream_path;
 	int bitstream_fd;
+
+	/* Probe results of known devices, skipped without a path. */
+	const char *probe_cache_path;
+
+	/* Stage latencies, only collected when allocated. */
+	struct v4l2_encoder_stats *stats;
+
+	/* Per-frame rate control trace, only written when open. */
+	struct trace *trace;
+	uint64_t trace_frame;
+
+	/* Live metrics in shared memory, only updated when open. */
+	struct metrics *metrics;
 };
 
-int v4l2_encoder_prepare(struct v4l2_encoder *encoder);
+uint64_t v4l2_encoder_time(void);
+int v4l2_encoder_stats_enable(struct v4l2_encoder *encoder);
+void v4l2_encoder_stats_dump(struct v4l2_encoder *encoder, FILE *file);
+int v4l2_encoder_perf_enable(struct v4l2_encoder *encoder);
+int v4l2_encoder_trace_open(struct v4l2_encoder *encoder, const char *path);
+int v4l2_encoder_metrics_open(struct v4l2_encoder *encoder, unsigned int index);
+int v4l2_encoder_feedback(struct v4l2_encoder *encoder);
 int v4l2_encoder_complete(struct v4l2_encoder *encoder);
+int v4l2_encoder_draw_planes(struct v4l2_encoder *encoder, void **planes);
+int v4l2_encoder_draw(struct v4l2_encoder *encoder,
+		      struct v4l2_encoder_buffer *output_buffer);
+int v4l2_encoder_prepare(struct v4l2_encoder *encoder);
+int v4l2_encoder_queue(struct v4l2_encoder *encoder);
+int v4l2_encoder_dequeue(struct v4l2_encoder *encoder);
 int v4l2_encoder_run(struct v4l2_encoder *encoder);
+bool v4l2_encoder_output_buffer_available(struct v4l2_encoder *encoder);
+struct v4l2_encoder_buffer *v4l2_encoder_output_buffer_next(struct v4l2_encoder *encoder);
+int v4l2_encoder_capture_lend(struct v4l2_encoder *encoder,
+			      struct v4l2_encoder_buffer *capture_buffer);
+int v4l2_encoder_capture_return(struct v4l2_encoder *encoder,
+				struct v4l2_encoder_buffer *capture_buffer);
+struct v4l2_encoder_buffer *v4l2_encoder_output_import(struct v4l2_encoder *encoder,
+						       const int *fds,
+						       unsigned int fds_count);
+int v4l2_encoder_submit(struct v4l2_encoder *encoder,
+			struct v4l2_encoder_frame *frame);
+int v4l2_encoder_reap(struct v4l2_encoder *encoder,
+		      struct v4l2_encoder_frame *frame);
+int v4l2_encoder_poll_fd(struct v4l2_encoder *encoder);
+int v4l2_encoder_poll_attach(struct v4l2_encoder *encoder, int poll_fd,
+			     void *data);
+void v4l2_encoder_poll_detach(struct v4l2_encoder *encoder);
+void v4l2_encoder_poll_event(struct v4l2_encoder *encoder, uint64_t time);
 int v4l2_encoder_start(struct v4l2_encoder *encoder);
 int v4l2_encoder_stop(struct v4l2_encoder *encoder);
 int v4l2_encoder_intra_request(struct v4l2_encoder *encoder);
+int v4l2_encoder_seek(struct v4l2_encoder *encoder, unsigned int frame);
 int v4l2_encoder_buffer_setup(struct v4l2_encoder_buffer *buffer,
 			     unsigned int type, unsigned int index);
 int v4l2_encoder_buffer_teardown(struct v4l2_encoder_buffer *buffer);
@@ -135,9 +318,39 @@ int v4l2_encoder_setup_dimensions(struct v4l2_encoder *encoder,
 int v4l2_encoder_setup_format(struct v4l2_encoder *encoder, uint32_t format);
 int v4l2_encoder_setup_fps(struct v4l2_encoder *encoder, float fps);
 int v4l2_encoder_setup_bitrate(struct v4l2_encoder *encoder, uint64_t bitrate);
+int v4l2_encoder_setup_gop_size(struct v4l2_encoder *encoder,
+				unsigned int gop_size);
+int v4l2_encoder_setup_qp(struct v4l2_encoder *encoder, unsigned int qp_min,
+			  unsigned int qp_max);
+int v4l2_encoder_setup_pipeline(struct v4l2_encoder *encoder,
+				unsigned int depth);
+int v4l2_encoder_setup_output_memory(struct v4l2_encoder *encoder,
+				     unsigned int memory);
+int v4l2_encoder_setup_capture_export(struct v4l2_encoder *encoder,
+				      bool export);
+int v4l2_encoder_setup_memory_lock(struct v4l2_encoder *encoder, bool lock);
+int v4l2_encoder_setup_buffers(struct v4l2_encoder *encoder,
+			       unsigned int output_count,
+			       unsigned int capture_count, unsigned int max);
+int v4l2_encoder_capture_resize(struct v4l2_encoder *encoder,
+				unsigned int size);
+int v4l2_encoder_capture_release(struct v4l2_encoder *encoder,
+				 unsigned int index);
+int v4l2_encoder_buffers_grow(struct v4l2_encoder *encoder, unsigned int type,
+			      unsigned int count);
 int v4l2_encoder_setup(struct v4l2_encoder *encoder);
 int v4l2_encoder_teardown(struct v4l2_encoder *encoder);
+int v4l2_encoder_reconfigure(struct v4l2_encoder *encoder, unsigned int width,
+			     unsigned int height, uint32_t format, float fps);
 int v4l2_encoder_probe(struct v4l2_encoder *encoder);
+int v4l2_encoder_devices_enumerate(struct v4l2_encoder_device **devices,
+				   unsigned int *devices_count);
+int v4l2_encoder_open_loopback(struct v4l2_encoder *encoder,
+			       struct loopback_setup *setup);
+int v4l2_encoder_open_device(struct v4l2_encoder *encoder,
+			     struct v4l2_encoder_device *encoder_device);
+int v4l2_encoder_open_paths(struct v4l2_encoder *encoder,
+			    const char *media_path, const char *video_path);
 int v4l2_encoder_open(struct v4l2_encoder *encoder);
 void v4l2_encoder_close(struct v4l2_encoder *encoder);
 
@@ -0,0 +1,457 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <v4l2-encoder.h>
+#include <h264-rate-control.h>
+#include <bitstream.h>
+#include <unit.h>
+#include <draw.h>
+#include <csc.h>
+
+struct bench_resolution {
+	const char *name;
+	unsigned int width;
+	unsigned int height;
+};
+
+static struct bench_resolution bench_resolutions[] = {
+	{ "qcif", 176, 144 },
+	{ "cif", 352, 288 },
+	{ "vga", 640, 480 },
+	{ "720p", 1280, 720 },
+	{ "1080p", 1920, 1080 },
+	{ "4k", 3840, 2160 },
+};
+
+struct bench_context {
+	struct bench_resolution *resolution;
+
+	struct draw_buffer *draw_buffer;
+	struct draw_mandelbrot mandelbrot;
+	void *planes[3];
+
+	struct bitstream *bitstream;
+	uint32_t value;
+
+	struct v4l2_encoder *encoder;
+	unsigned int bytes_used;
+};
+
+struct bench {
+	const char *name;
+	/* Per resolution or once. */
+	bool pixels;
+	/* Runs count calls, returning bytes processed by a single one. */
+	uint64_t (*run)(struct bench_context *context, unsigned int count);
+};
+
+struct bench_options {
+	uint64_t time_min;
+	unsigned int runs;
+	const char *filter;
+};
+
+static uint64_t bench_time(void)
+{
+	struct timespec timespec;
+
+	clock_gettime(CLOCK_MONOTONIC, &timespec);
+
+	return timespec.tv_sec * 1000000000ULL + timespec.tv_nsec;
+}
+
+static uint64_t bench_rgb2nv12(struct bench_context *context,
+			       unsigned int count)
+{
+	struct draw_buffer *buffer = context->draw_buffer;
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		rgb2nv12(buffer, context->planes[0], context->planes[1]);
+
+	/* XRGB read, luma and half-size chroma written. */
+	return buffer->width * buffer->height * (4 + 3 / 2.);
+}
+
+static uint64_t bench_rgb2yuv420(struct bench_context *context,
+				 unsigned int count)
+{
+	struct draw_buffer *buffer = context->draw_buffer;
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		rgb2yuv420(buffer, context->planes[0], context->planes[1],
+			   context->planes[2]);
+
+	return buffer->width * buffer->height * (4 + 3 / 2.);
+}
+
+static uint64_t bench_draw_mandelbrot(struct bench_context *context,
+				      unsigned int count)
+{
+	struct draw_buffer *buffer = context->draw_buffer;
+	unsigned int i;
+
+	/* Always the first frame, so that runs compare. */
+	for (i = 0; i < count; i++)
+		draw_mandelbrot(&context->mandelbrot, buffer);
+
+	return buffer->width * buffer->height * 4;
+}
+
+static uint64_t bench_draw_gradient(struct bench_context *context,
+				    unsigned int count)
+{
+	struct draw_buffer *buffer = context->draw_buffer;
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		draw_gradient(buffer);
+
+	return buffer->width * buffer->height * 4;
+}
+
+/* Values up to 1023 take at most 19 bits, so that 256 of them fit in the
+ * bitstream buffer between resets. */
+static uint64_t bench_bitstream_append_ue(struct bench_context *context,
+					  unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (!(i % 256))
+			bitstream_reset(context->bitstream);
+
+		bitstream_append_ue(context->bitstream, context->value);
+		context->value = (context->value + 7) % 1024;
+	}
+
+	return 0;
+}
+
+static uint64_t bench_bitstream_append_se(struct bench_context *context,
+					  unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (!(i % 256))
+			bitstream_reset(context->bitstream);
+
+		bitstream_append_se(context->bitstream,
+				    (int32_t)context->value - 512);
+		context->value = (context->value + 7) % 1024;
+	}
+
+	return 0;
+}
+
+static uint64_t bench_unit_pack(struct bench_context *context,
+				unsigned int count)
+{
+	struct bitstream *bitstream = context->bitstream;
+	struct unit *unit;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		unit = unit_pack(bitstream);
+		unit_destroy(unit);
+	}
+
+	return bitstream->offset_bytes;
+}
+
+static uint64_t bench_h264_rate_control_setup(struct bench_context *context,
+					      unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		h264_rate_control_setup(context->encoder);
+
+	return 0;
+}
+
+static uint64_t bench_h264_rate_control_step(struct bench_context *context,
+					     unsigned int count)
+{
+	struct v4l2_encoder *encoder = context->encoder;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		h264_rate_control_step(encoder);
+
+		encoder->gop_index++;
+		encoder->gop_index %= encoder->setup.gop_size;
+	}
+
+	return 0;
+}
+
+static uint64_t bench_h264_rate_control_feedback(struct bench_context *context,
+						 unsigned int count)
+{
+	struct v4l2_encoder *encoder = context->encoder;
+	unsigned int macroblocks;
+	unsigned int i;
+
+	macroblocks = encoder->setup.width_mbs * encoder->setup.height_mbs;
+
+	/* Alternate under and over the target, to go through all the QP
+	 * adjustments. */
+	for (i = 0; i < count; i++) {
+		encoder->rc.bits_left = encoder->rc.bits_per_gop;
+		encoder->rc.bits_target = encoder->rc.bits_per_frame;
+
+		h264_rate_control_feedback(encoder, context->bytes_used,
+					   macroblocks * 4,
+					   macroblocks * encoder->rc.qp);
+
+		context->bytes_used = (i & 1) ?
+				      encoder->rc.bits_per_frame / 16 :
+				      encoder->rc.bits_per_frame / 4;
+	}
+
+	return 0;
+}
+
+static uint64_t bench_h264_rate_control_update(struct bench_context *context,
+					       unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		h264_rate_control_update(context->encoder);
+
+	return 0;
+}
+
+static struct bench benches[] = {
+	{ "rgb2nv12", true, bench_rgb2nv12 },
+	{ "rgb2yuv420", true, bench_rgb2yuv420 },
+	{ "draw_mandelbrot", true, bench_draw_mandelbrot },
+	{ "draw_gradient", true, bench_draw_gradient },
+	{ "bitstream_append_ue", false, bench_bitstream_append_ue },
+	{ "bitstream_append_se", false, bench_bitstream_append_se },
+	{ "unit_pack", false, bench_unit_pack },
+	{ "h264_rate_control_setup", true, bench_h264_rate_control_setup },
+	{ "h264_rate_control_step", true, bench_h264_rate_control_step },
+	{ "h264_rate_control_feedback", true, bench_h264_rate_control_feedback },
+	{ "h264_rate_control_update", true, bench_h264_rate_control_update },
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-t min time ms] [-r runs] [-f filter]\n",
+		name);
+}
+
+static int bench_context_setup(struct bench_context *context,
+			       struct bench_resolution *resolution)
+{
+	struct v4l2_encoder_setup *setup;
+	unsigned int width, height;
+	unsigned int i;
+	uint8_t *data;
+
+	context->resolution = resolution;
+
+	if (!resolution)
+		goto bitstream;
+
+	width = resolution->width;
+	height = resolution->height;
+
+	context->draw_buffer = draw_buffer_create(width, height, false);
+	if (!context->draw_buffer)
+		return -ENOMEM;
+
+	context->planes[0] = malloc(width * height);
+	context->planes[1] = malloc(width * height / 2);
+	context->planes[2] = malloc(width * height / 4);
+	if (!context->planes[0] || !context->planes[1] || !context->planes[2])
+		return -ENOMEM;
+
+	/* Conversion runs on a filled frame, drawing stays at its first
+	 * zoom step. */
+	draw_gradient(context->draw_buffer);
+	draw_mandelbrot_init(&context->mandelbrot);
+	draw_mandelbrot_zoom(&context->mandelbrot);
+
+	context->encoder = calloc(1, sizeof(*context->encoder));
+	if (!context->encoder)
+		return -ENOMEM;
+
+	setup = &context->encoder->setup;
+	setup->width = width;
+	setup->width_mbs = (width + 15) / 16;
+	setup->height = height;
+	setup->height_mbs = (height + 15) / 16;
+	setup->fps_num = 25;
+	setup->fps_den = 1;
+	/* A tenth of a bit per pixel. */
+	setup->bitrate = (uint64_t)width * height * 25 / 10;
+	setup->gop_size = 10;
+	setup->qp_intra_delta = 2;
+	setup->qp_min = 11;
+	setup->qp_max = 51;
+
+	h264_rate_control_setup(context->encoder);
+	context->bytes_used = context->encoder->rc.bits_per_frame / 8;
+
+	return 0;
+
+bitstream:
+	context->bitstream = bitstream_create();
+	if (!context->bitstream)
+		return -ENOMEM;
+
+	/* Slice-like data with start code emulation to escape. */
+	data = context->bitstream->buffer;
+	for (i = 0; i < context->bitstream->length - 1; i++)
+		data[i] = (i % 64) < 3 ? 0 : (i * 131) & 0xff;
+
+	context->bitstream->offset_bytes = context->bitstream->length - 1;
+
+	return 0;
+}
+
+static void bench_context_cleanup(struct bench_context *context)
+{
+	unsigned int i;
+
+	draw_buffer_destroy(context->draw_buffer);
+
+	for (i = 0; i < 3; i++)
+		free(context->planes[i]);
+
+	bitstream_destroy(context->bitstream);
+	free(context->encoder);
+
+	memset(context, 0, sizeof(*context));
+}
+
+/* The call count doubles until a run lasts the minimum time, the fastest of
+ * the following runs is kept. */
+static void bench_measure(struct bench *bench, struct bench_context *context,
+			  struct bench_options *options)
+{
+	struct bench_resolution *resolution = context->resolution;
+	unsigned int count = 1;
+	uint64_t time, time_best = 0;
+	uint64_t bytes = 0;
+	double ns_per_call;
+	unsigned int i;
+
+	while (1) {
+		time = bench_time();
+		bytes = bench->run(context, count);
+		time = bench_time() - time;
+
+		if (time >= options->time_min || count >= (1U << 30))
+			break;
+
+		count *= 2;
+	}
+
+	for (i = 0; i < options->runs; i++) {
+		time = bench_time();
+		bench->run(context, count);
+		time = bench_time() - time;
+
+		if (!time_best || time < time_best)
+			time_best = time;
+	}
+
+	ns_per_call = (double)time_best / count;
+
+	printf("{\"bench\":\"%s\"", bench->name);
+
+	if (resolution)
+		printf(",\"resolution\":\"%s\",\"width\":%u,\"height\":%u",
+		       resolution->name, resolution->width,
+		       resolution->height);
+
+	printf(",\"calls\":%u,\"ns_per_call\":%.2f", count, ns_per_call);
+
+	/* Only the pixel kernels scale with the frame size. */
+	if (resolution && bytes)
+		printf(",\"ns_per_pixel\":%.4f", ns_per_call /
+		       (resolution->width * resolution->height));
+
+	if (bytes)
+		printf(",\"mb_per_s\":%.1f", bytes * 1000. / ns_per_call);
+
+	printf("}\n");
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_options options = {
+		.time_min = 100000000,
+		.runs = 3,
+	};
+	struct bench_context context = { 0 };
+	struct bench *bench;
+	unsigned int i, j;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:r:f:")) != -1) {
+		switch (opt) {
+		case 't':
+			options.time_min = strtoull(optarg, NULL, 0) * 1000000;
+			break;
+		case 'r':
+			options.runs = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			options.filter = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!options.runs) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		bench = &benches[i];
+
+		if (options.filter && !strstr(bench->name, options.filter))
+			continue;
+
+		for (j = 0; j < sizeof(bench_resolutions) /
+				sizeof(bench_resolutions[0]); j++) {
+			if (bench_context_setup(&context,
+						bench->pixels ?
+						&bench_resolutions[j] : NULL)) {
+				fprintf(stderr, "Failed to set up %s\n",
+					bench->name);
+				return 1;
+			}
+
+			bench_measure(bench, &context, &options);
+			bench_context_cleanup(&context);
+
+			if (!bench->pixels)
+				break;
+		}
+	}
+
+	return 0;
+}
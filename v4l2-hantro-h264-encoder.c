@@ -4,35 +4,761 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 
 #include <linux/videodev2.h>
 #include <linux/media.h>
 
 #include <v4l2.h>
 #include <v4l2-encoder.h>
+#include <pipeline.h>
+#include <reactor.h>
+#include <pool.h>
+#include <segment.h>
+#include <dmabuf.h>
+#include <draw.h>
+#include <session.h>
 
-int main(int argc, char *argv[])
+static void usage(const char *name)
 {
-	struct v4l2_encoder *encoder = NULL;
-	unsigned int width = 640;
-	unsigned int height = 480;
-	unsigned int frames = 10;
+	fprintf(stderr, "Usage: %s [-n frames] [-d pipeline depth] "
+		"[-s streams [-D device depth] [-W weights] [-P] | -c contexts] "
+		"[-p | -L latency us[,ns per mb[,cores]] | -M media,video] "
+		"[-C probe cache] [-m] [-S [-H]] [-T trace] [-O] [-w record|-r replay] "
+		"[-t|-e|-b|-u|-x|-R frame:widthxheight|-B frame:bitrate|-J benchmark]\n",
+		name);
+}
+
+struct stats_dump {
+	struct v4l2_encoder **encoders;
+	unsigned int encoders_count;
+};
+
+static void stats_dump(struct stats_dump *dump)
+{
+	unsigned int i;
+
+	for (i = 0; i < dump->encoders_count; i++) {
+		if (dump->encoders_count > 1)
+			printf("Encoder %u latency:\n", i);
+
+		v4l2_encoder_stats_dump(dump->encoders[i], stdout);
+	}
+
+	v4l2_ioctl_stats_dump(stdout);
+
+	fflush(stdout);
+}
+
+/* SIGUSR1 is blocked in all other threads and handled here, where it is
+ * safe to print. */
+static void *stats_signal(void *data)
+{
+	struct stats_dump *dump = data;
+	sigset_t set;
+	int signal;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+
+	while (!sigwait(&set, &signal))
+		stats_dump(dump);
+
+	return NULL;
+}
+
+/* Changes made while encoding, at the given frame when not zero. */
+struct encode_schedule {
+	unsigned int reconfigure_frame;
+	unsigned int reconfigure_width;
+	unsigned int reconfigure_height;
+	unsigned int bitrate_frame;
+	uint64_t bitrate;
+};
+
+static int encode_drain(struct v4l2_encoder *encoder)
+{
+	int ret;
+
+	while (encoder->pending_count) {
+		ret = v4l2_encoder_dequeue(encoder);
+		if (ret)
+			return ret;
+
+		ret = v4l2_encoder_complete(encoder);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int encode_run(struct v4l2_encoder *encoder, unsigned int frames,
+		      unsigned int depth, struct encode_schedule *schedule)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < frames; i++) {
+		/* Switch resolution in place once the pipeline is drained. */
+		if (schedule && schedule->reconfigure_frame &&
+		    i == schedule->reconfigure_frame) {
+			ret = encode_drain(encoder);
+			if (ret)
+				return ret;
+
+			ret = v4l2_encoder_reconfigure(encoder,
+						       schedule->reconfigure_width,
+						       schedule->reconfigure_height,
+						       encoder->setup.format,
+						       (float)encoder->setup.fps_num /
+						       encoder->setup.fps_den);
+			if (ret)
+				return ret;
+		}
+
+		/* Follow a new bitrate without restarting the GOP. */
+		if (schedule && schedule->bitrate_frame &&
+		    i == schedule->bitrate_frame) {
+			ret = v4l2_encoder_setup_bitrate(encoder,
+							 schedule->bitrate);
+			if (ret)
+				return ret;
+		}
+
+		ret = v4l2_encoder_prepare(encoder);
+		if (ret)
+			return ret;
+
+		ret = v4l2_encoder_queue(encoder);
+		if (ret)
+			return ret;
+
+		/* Keep up to depth requests in flight. */
+		if (encoder->pending_count < depth)
+			continue;
+
+		ret = v4l2_encoder_dequeue(encoder);
+		if (ret)
+			return ret;
+
+		ret = v4l2_encoder_complete(encoder);
+		if (ret)
+			return ret;
+	}
+
+	return encode_drain(encoder);
+}
+
+static int encode_poll(struct v4l2_encoder *encoder, unsigned int frames)
+{
+	struct v4l2_encoder_frame frame = { 0 };
+	struct pollfd pollfd = { 0 };
+	unsigned int submitted = 0;
+	unsigned int reaped = 0;
+	int ret;
+
+	ret = v4l2_encoder_poll_fd(encoder);
+	if (ret < 0)
+		return ret;
+
+	pollfd.fd = ret;
+	pollfd.events = POLLIN;
+
+	while (reaped < frames) {
+		while (submitted < frames) {
+			frame.output_buffer =
+				v4l2_encoder_output_buffer_next(encoder);
+			if (!frame.output_buffer)
+				break;
+
+			ret = v4l2_encoder_draw(encoder, frame.output_buffer);
+			if (ret)
+				return ret;
+
+			ret = v4l2_encoder_submit(encoder, &frame);
+			if (ret)
+				return ret;
+
+			submitted++;
+		}
+
+		/* Other fds of the application would be polled here too. */
+		ret = poll(&pollfd, 1, 300);
+		if (ret < 0)
+			return -errno;
+		else if (ret == 0)
+			return -ETIMEDOUT;
+
+		v4l2_encoder_poll_event(encoder, v4l2_encoder_time());
+
+		while (!(ret = v4l2_encoder_reap(encoder, &frame))) {
+			write(encoder->bitstream_fd, frame.data, frame.size);
+			reaped++;
+		}
+
+		if (ret != -EAGAIN)
+			return ret;
+	}
+
+	return 0;
+}
+
+struct export_message {
+	unsigned int index;
+	unsigned int size;
+};
+
+static int export_send(int socket_fd, struct export_message *message, int fd)
+{
+	char control[CMSG_SPACE(sizeof(int))] = { 0 };
+	struct iovec iovec = { message, sizeof(*message) };
+	struct msghdr msghdr = { 0 };
+	struct cmsghdr *cmsghdr;
+
+	msghdr.msg_iov = &iovec;
+	msghdr.msg_iovlen = 1;
+	msghdr.msg_control = control;
+	msghdr.msg_controllen = sizeof(control);
+
+	cmsghdr = CMSG_FIRSTHDR(&msghdr);
+	cmsghdr->cmsg_level = SOL_SOCKET;
+	cmsghdr->cmsg_type = SCM_RIGHTS;
+	cmsghdr->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsghdr), &fd, sizeof(int));
+
+	if (sendmsg(socket_fd, &msghdr, 0) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* Downstream process writing the bitstream straight from the dmabufs. */
+static int export_consume(int socket_fd, int bitstream_fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct export_message message;
+	struct iovec iovec = { &message, sizeof(message) };
+	struct msghdr msghdr = { 0 };
+	struct cmsghdr *cmsghdr;
+	void *data;
+	ssize_t count;
+	int fd;
+
+	while (1) {
+		msghdr.msg_iov = &iovec;
+		msghdr.msg_iovlen = 1;
+		msghdr.msg_control = control;
+		msghdr.msg_controllen = sizeof(control);
+
+		count = recvmsg(socket_fd, &msghdr, MSG_CMSG_CLOEXEC);
+		if (count < 0)
+			return -errno;
+		else if (count == 0)
+			return 0;
+		else if (count != sizeof(message))
+			return -EIO;
+
+		cmsghdr = CMSG_FIRSTHDR(&msghdr);
+		if (!cmsghdr || cmsghdr->cmsg_type != SCM_RIGHTS)
+			return -EIO;
+
+		memcpy(&fd, CMSG_DATA(cmsghdr), sizeof(int));
+
+		if (message.size) {
+			data = mmap(NULL, message.size, PROT_READ, MAP_SHARED,
+				    fd, 0);
+			if (data == MAP_FAILED) {
+				close(fd);
+				return -errno;
+			}
+
+			write(bitstream_fd, data, message.size);
+			munmap(data, message.size);
+		}
+
+		close(fd);
+
+		/* Hand the buffer back to the encoder. */
+		if (send(socket_fd, &message.index, sizeof(message.index),
+			 0) < 0)
+			return -errno;
+	}
+}
+
+static int encode_export(struct v4l2_encoder *encoder, unsigned int frames)
+{
+	struct v4l2_encoder_frame frame = { 0 };
+	struct export_message message;
+	struct pollfd pollfds[2] = { 0 };
+	unsigned int submitted = 0;
+	unsigned int returned = 0;
+	unsigned int index;
+	int socket_fds[2];
+	int status;
+	pid_t pid;
+	int ret;
+
+	ret = v4l2_encoder_poll_fd(encoder);
+	if (ret < 0)
+		return ret;
+
+	pollfds[0].fd = ret;
+	pollfds[0].events = POLLIN;
+
+	ret = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+			 socket_fds);
+	if (ret)
+		return -errno;
+
+	pid = fork();
+	if (pid < 0) {
+		ret = -errno;
+		close(socket_fds[0]);
+		close(socket_fds[1]);
+		return ret;
+	} else if (pid == 0) {
+		close(socket_fds[0]);
+		ret = export_consume(socket_fds[1], encoder->bitstream_fd);
+		_exit(ret ? 1 : 0);
+	}
+
+	close(socket_fds[1]);
+
+	pollfds[1].fd = socket_fds[0];
+	pollfds[1].events = POLLIN;
+
+	while (returned < frames) {
+		while (submitted < frames) {
+			/* Only capture buffers that were returned are used. */
+			frame.output_buffer =
+				v4l2_encoder_output_buffer_next(encoder);
+			if (!frame.output_buffer)
+				break;
+
+			ret = v4l2_encoder_draw(encoder, frame.output_buffer);
+			if (ret)
+				goto complete;
+
+			ret = v4l2_encoder_submit(encoder, &frame);
+			if (ret)
+				goto complete;
+
+			submitted++;
+		}
+
+		ret = poll(pollfds, 2, 300);
+		if (ret < 0) {
+			ret = -errno;
+			goto complete;
+		} else if (ret == 0) {
+			ret = -ETIMEDOUT;
+			goto complete;
+		}
+
+		if (pollfds[0].revents)
+			v4l2_encoder_poll_event(encoder, v4l2_encoder_time());
+
+		if (pollfds[1].revents & POLLIN) {
+			if (recv(socket_fds[0], &index, sizeof(index), 0) !=
+			    sizeof(index) ||
+			    index >= encoder->capture_buffers_count) {
+				ret = -EIO;
+				goto complete;
+			}
+
+			ret = v4l2_encoder_capture_return(encoder,
+					&encoder->capture_buffers[index]);
+			if (ret)
+				goto complete;
+
+			returned++;
+		} else if (pollfds[1].revents) {
+			ret = -EPIPE;
+			goto complete;
+		}
+
+		/* Slices are lent in place instead of being copied out. */
+		while (!(ret = v4l2_encoder_reap(encoder, &frame))) {
+			ret = v4l2_encoder_capture_lend(encoder,
+							frame.capture_buffer);
+			if (ret)
+				goto complete;
+
+			message.index = frame.capture_buffer->buffer.index;
+			message.size = frame.size;
+
+			ret = export_send(socket_fds[0], &message, frame.fd);
+			if (ret)
+				goto complete;
+		}
+
+		if (ret != -EAGAIN)
+			goto complete;
+	}
+
+	ret = 0;
+
+complete:
+	/* The consumer stops once it has seen everything sent so far. */
+	close(socket_fds[0]);
+
+	if (waitpid(pid, &status, 0) < 0)
+		return ret ? ret : -errno;
+
+	if (!ret && (!WIFEXITED(status) || WEXITSTATUS(status)))
+		ret = -EIO;
+
+	return ret;
+}
+
+static int encode_dmabuf(struct v4l2_encoder *encoder, unsigned int frames)
+{
+	struct v4l2_pix_format_mplane *pix_mp =
+		&encoder->output_format.fmt.pix_mp;
+	unsigned int buffers_count = encoder->output_buffers_count;
+	unsigned int planes_count = pix_mp->num_planes;
+	unsigned int depth = encoder->setup.pipeline_depth;
+	struct v4l2_encoder_frame frame = { 0 };
+	struct dmabuf (*dmabufs)[4];
+	struct dmabuf *dmabuf;
+	void *planes[4];
+	int fds[4];
+	unsigned int i, j;
+	int ret = 0;
+
+	if (planes_count > 4)
+		return -EINVAL;
+
+	dmabufs = calloc(buffers_count, sizeof(*dmabufs));
+	if (!dmabufs)
+		return -ENOMEM;
+
+	for (i = 0; i < buffers_count; i++) {
+		for (j = 0; j < planes_count; j++) {
+			dmabufs[i][j].fd = -1;
+			dmabufs[i][j].memfd = -1;
+			dmabufs[i][j].data = MAP_FAILED;
+		}
+	}
+
+	for (i = 0; i < buffers_count; i++) {
+		for (j = 0; j < planes_count; j++) {
+			ret = dmabuf_create(&dmabufs[i][j],
+					    pix_mp->plane_fmt[j].sizeimage);
+			if (ret)
+				goto complete;
+		}
+	}
+
+	for (i = 0; i < frames; i++) {
+		/* The buffer drawn next was used depth frames ago at most. */
+		if (encoder->pending_count >= depth) {
+			ret = v4l2_encoder_dequeue(encoder);
+			if (ret)
+				goto complete;
+
+			ret = v4l2_encoder_complete(encoder);
+			if (ret)
+				goto complete;
+		}
+
+		dmabuf = dmabufs[i % buffers_count];
+
+		for (j = 0; j < planes_count; j++) {
+			planes[j] = dmabuf[j].data;
+			fds[j] = dmabuf[j].fd;
+		}
+
+		/* Draw as another stage would, straight into its buffers. */
+		ret = v4l2_encoder_draw_planes(encoder, planes);
+		if (ret)
+			goto complete;
+
+		frame.output_buffer = v4l2_encoder_output_import(encoder, fds,
+								 planes_count);
+		if (!frame.output_buffer) {
+			ret = -EBUSY;
+			goto complete;
+		}
+
+		ret = v4l2_encoder_submit(encoder, &frame);
+		if (ret)
+			goto complete;
+	}
+
+	while (encoder->pending_count) {
+		ret = v4l2_encoder_dequeue(encoder);
+		if (ret)
+			goto complete;
+
+		ret = v4l2_encoder_complete(encoder);
+		if (ret)
+			goto complete;
+	}
+
+complete:
+	for (i = 0; i < buffers_count; i++)
+		for (j = 0; j < planes_count; j++)
+			dmabuf_destroy(&dmabufs[i][j]);
+
+	free(dmabufs);
+
+	return ret;
+}
+
+static int encode_userptr(struct v4l2_encoder *encoder, unsigned int frames)
+{
+	struct v4l2_pix_format_mplane *pix_mp =
+		&encoder->output_format.fmt.pix_mp;
+	unsigned int buffers_count = encoder->output_buffers_count;
+	unsigned int planes_count = pix_mp->num_planes;
+	unsigned int depth = encoder->setup.pipeline_depth;
+	struct v4l2_encoder_frame frame = { 0 };
+	bool pinned = encoder->setup.memory_lock;
+	void *(*buffers)[4];
+	unsigned int size;
+	unsigned int i, j;
+	int ret = 0;
+
+	if (planes_count > 4)
+		return -EINVAL;
+
+	buffers = calloc(buffers_count, sizeof(*buffers));
+	if (!buffers)
+		return -ENOMEM;
+
+	/* Application buffers, page aligned as drivers usually expect. */
+	for (i = 0; i < buffers_count; i++) {
+		for (j = 0; j < planes_count; j++) {
+			size = pix_mp->plane_fmt[j].sizeimage;
+
+			buffers[i][j] = draw_memory_alloc(size, pinned);
+			if (!buffers[i][j]) {
+				ret = -ENOMEM;
+				goto complete;
+			}
+		}
+	}
+
+	for (i = 0; i < frames; i++) {
+		/* The buffer drawn next was used depth frames ago at most. */
+		if (encoder->pending_count >= depth) {
+			ret = v4l2_encoder_dequeue(encoder);
+			if (ret)
+				goto complete;
+
+			ret = v4l2_encoder_complete(encoder);
+			if (ret)
+				goto complete;
+		}
+
+		for (j = 0; j < planes_count; j++)
+			frame.planes[j] = buffers[i % buffers_count][j];
+
+		ret = v4l2_encoder_draw_planes(encoder, frame.planes);
+		if (ret)
+			goto complete;
+
+		frame.output_buffer = v4l2_encoder_output_buffer_next(encoder);
+		if (!frame.output_buffer) {
+			ret = -EBUSY;
+			goto complete;
+		}
+
+		ret = v4l2_encoder_submit(encoder, &frame);
+		if (ret)
+			goto complete;
+	}
+
+	while (encoder->pending_count) {
+		ret = v4l2_encoder_dequeue(encoder);
+		if (ret)
+			goto complete;
+
+		ret = v4l2_encoder_complete(encoder);
+		if (ret)
+			goto complete;
+	}
+
+complete:
+	for (i = 0; i < buffers_count; i++)
+		for (j = 0; j < planes_count; j++)
+			draw_memory_free(buffers[i][j],
+					 pix_mp->plane_fmt[j].sizeimage,
+					 pinned);
+
+	free(buffers);
+
+	return ret;
+}
+
+static int stream_prepare(struct reactor_stream *stream,
+			  struct v4l2_encoder_buffer *output_buffer)
+{
+	unsigned int *frames_left = stream->data;
+
+	if (!*frames_left)
+		return 1;
+
+	(*frames_left)--;
+
+	return v4l2_encoder_draw(stream->encoder, output_buffer);
+}
+
+static int stream_complete(struct reactor_stream *stream,
+			   struct v4l2_encoder_frame *frame)
+{
+	write(stream->encoder->bitstream_fd, frame->data, frame->size);
+
+	return 0;
+}
+
+static int encode_reactor(struct v4l2_encoder **encoders,
+			  unsigned int streams, unsigned int frames,
+			  unsigned int device_depth, unsigned int *weights,
+			  bool paced, struct pool *pool, unsigned int *devices)
+{
+	struct reactor_stream *reactor_streams = NULL;
+	struct reactor *reactor = NULL;
+	unsigned int *frames_left = NULL;
+	uint64_t time_start;
+	uint64_t duration;
+	unsigned int i;
+	int ret;
+
+	reactor_streams = calloc(streams, sizeof(*reactor_streams));
+	frames_left = calloc(streams, sizeof(*frames_left));
+	reactor = reactor_create();
+
+	if (!reactor_streams || !frames_left || !reactor) {
+		ret = -ENOMEM;
+		goto complete;
+	}
+
+	reactor_setup_depth(reactor, device_depth);
+
+	for (i = 0; i < streams; i++) {
+		struct reactor_stream *stream = &reactor_streams[i];
+		struct v4l2_encoder_setup *setup = &encoders[i]->setup;
+
+		frames_left[i] = frames;
+
+		stream->encoder = encoders[i];
+		stream->prepare = stream_prepare;
+		stream->complete = stream_complete;
+		stream->data = &frames_left[i];
+		stream->weight = weights[i];
+		stream->device = devices[i];
+
+		/* Release frames at the stream rate, due one period later. */
+		if (paced) {
+			stream->period = 1000000000ULL * setup->fps_den /
+					 setup->fps_num;
+			stream->deadline = stream->period;
+		}
+
+		ret = reactor_stream_add(reactor, stream);
+		if (ret)
+			goto complete;
+	}
+
+	time_start = v4l2_encoder_time();
+
+	ret = reactor_run(reactor);
+
+	duration = v4l2_encoder_time() - time_start;
+
+	for (i = 0; i < streams; i++) {
+		struct reactor_stream *stream = &reactor_streams[i];
+
+		printf("Stream %u: %u frames, hardware time %.3f ms "
+		       "(%.3f ms per frame), %u deadline misses\n", i,
+		       stream->frames_completed, stream->hardware_time / 1e6,
+		       stream->frames_completed ?
+		       stream->hardware_time / 1e6 / stream->frames_completed : 0,
+		       stream->deadline_misses);
+	}
+
+	for (i = 0; pool && i < pool->devices_count; i++) {
+		struct reactor_device *device = &reactor->devices[i];
+
+		pool_device_measure(pool, i, device->macroblocks,
+				    device->hardware_time);
+
+		printf("Device %s (entity %u): %u streams, %.1f%% busy\n",
+		       pool->devices[i].device.syspath,
+		       pool->devices[i].device.entity_index,
+		       pool->devices[i].streams_count,
+		       duration ? 100.0 * device->hardware_time / duration : 0);
+	}
+
+complete:
+	reactor_destroy(reactor);
+
+	if (frames_left)
+		free(frames_left);
+
+	if (reactor_streams)
+		free(reactor_streams);
+
+	return ret;
+}
+
+static struct v4l2_encoder *encoder_create(unsigned int width,
+					   unsigned int height,
+					   uint32_t format, uint64_t bitrate,
+					   unsigned int gop_size,
+					   unsigned int depth,
+					   unsigned int output_memory,
+					   bool capture_export,
+					   bool memory_lock,
+					   const char *bitstream_path,
+					   struct pool *pool, uint64_t load,
+					   unsigned int *device_index,
+					   struct loopback_setup *loopback_setup,
+					   char **device_paths,
+					   const char *probe_cache_path)
+{
+	struct v4l2_encoder *encoder;
 	int ret;
 
 	encoder = calloc(1, sizeof(*encoder));
 	if (!encoder)
-		goto error;
+		return NULL;
 
-	ret = v4l2_encoder_open(encoder);
-	if (ret)
-		goto error;
+	encoder->bitstream_path = bitstream_path;
+	encoder->probe_cache_path = probe_cache_path;
+
+	/* Spread the streams over every encoder found on the system. */
+	if (loopback_setup)
+		ret = v4l2_encoder_open_loopback(encoder, loopback_setup);
+	else if (device_paths)
+		ret = v4l2_encoder_open_paths(encoder, device_paths[0],
+					      device_paths[1]);
+	else if (pool)
+		ret = pool_encoder_open(pool, encoder, load, device_index);
+	else
+		ret = v4l2_encoder_open(encoder);
+	if (ret) {
+		free(encoder);
+		return NULL;
+	}
 
 	ret = v4l2_encoder_probe(encoder);
 	if (ret)
@@ -44,7 +770,42 @@ int main(int argc, char *argv[])
 
 	ret = v4l2_encoder_setup_dimensions(encoder, width, height);
 	if (ret)
-		return ret;
+		goto error;
+
+	/* Zero keeps the default. */
+	if (format) {
+		ret = v4l2_encoder_setup_format(encoder, format);
+		if (ret)
+			goto error;
+	}
+
+	if (bitrate) {
+		ret = v4l2_encoder_setup_bitrate(encoder, bitrate);
+		if (ret)
+			goto error;
+	}
+
+	if (gop_size) {
+		ret = v4l2_encoder_setup_gop_size(encoder, gop_size);
+		if (ret)
+			goto error;
+	}
+
+	ret = v4l2_encoder_setup_pipeline(encoder, depth);
+	if (ret)
+		goto error;
+
+	ret = v4l2_encoder_setup_output_memory(encoder, output_memory);
+	if (ret)
+		goto error;
+
+	ret = v4l2_encoder_setup_capture_export(encoder, capture_export);
+	if (ret)
+		goto error;
+
+	ret = v4l2_encoder_setup_memory_lock(encoder, memory_lock);
+	if (ret)
+		goto error;
 
 	ret = v4l2_encoder_setup(encoder);
 	if (ret)
@@ -54,20 +815,757 @@ int main(int argc, char *argv[])
 	if (ret)
 		goto error;
 
-	while (frames--) {
-		ret = v4l2_encoder_prepare(encoder);
+	return encoder;
+
+error:
+	v4l2_encoder_teardown(encoder);
+	v4l2_encoder_close(encoder);
+	free(encoder);
+
+	if (pool && !loopback_setup)
+		pool_encoder_release(pool, load, *device_index);
+
+	return NULL;
+}
+
+static void encoder_destroy(struct v4l2_encoder *encoder)
+{
+	if (!encoder)
+		return;
+
+	v4l2_encoder_stop(encoder);
+	v4l2_encoder_teardown(encoder);
+	v4l2_encoder_close(encoder);
+
+	free(encoder);
+}
+
+#define BENCHMARK_VALUES_MAX	8
+
+/* Every combination of the listed values is run, each run on a new
+ * encoder. */
+struct benchmark {
+	unsigned int widths[BENCHMARK_VALUES_MAX];
+	unsigned int heights[BENCHMARK_VALUES_MAX];
+	unsigned int sizes_count;
+	uint32_t formats[BENCHMARK_VALUES_MAX];
+	unsigned int formats_count;
+	uint64_t bitrates[BENCHMARK_VALUES_MAX];
+	unsigned int bitrates_count;
+	unsigned int gop_sizes[BENCHMARK_VALUES_MAX];
+	unsigned int gop_sizes_count;
+	unsigned int depths[BENCHMARK_VALUES_MAX];
+	unsigned int depths_count;
+
+	unsigned int warmup;
+	unsigned int frames;
+	unsigned int runs;
+	const char *output_path;
+
+	struct loopback_setup *loopback_setup;
+	struct loopback_setup loopback_default;
+	char **device_paths;
+	const char *probe_cache_path;
+	bool memory_lock;
+
+	/* Applied to the measured frames of every run. */
+	struct encode_schedule *schedule;
+};
+
+static void benchmark_defaults(struct benchmark *benchmark, unsigned int width,
+			       unsigned int height, unsigned int depth,
+			       unsigned int frames)
+{
+	benchmark->widths[0] = width;
+	benchmark->heights[0] = height;
+	benchmark->sizes_count = 1;
+	benchmark->formats[0] = V4L2_PIX_FMT_NV12M;
+	benchmark->formats_count = 1;
+	benchmark->bitrates[0] = 500000;
+	benchmark->bitrates_count = 1;
+	benchmark->gop_sizes[0] = 10;
+	benchmark->gop_sizes_count = 1;
+	benchmark->depths[0] = depth;
+	benchmark->depths_count = 1;
+
+	benchmark->warmup = 10;
+	benchmark->frames = frames;
+	benchmark->runs = 3;
+	benchmark->output_path = "benchmark.json";
+
+	/* Roughly 60 fps at 1080p, for machines without an encoder. */
+	benchmark->loopback_default.latency = 1000000;
+	benchmark->loopback_default.latency_mb = 2000;
+	benchmark->loopback_default.intra_cost = 150;
+}
+
+/* Semicolon-separated keys with comma-separated values, such as
+ * size=640x480,1920x1080;format=nv12,yuv420;bitrate=1000000;gop=10,30;
+ * depth=1,3;warmup=10;frames=100;runs=3;output=benchmark.json */
+static int benchmark_parse(struct benchmark *benchmark, char *spec)
+{
+	char *entry, *entry_save;
+	char *value, *value_save;
+	char *key;
+	unsigned int count;
+
+	for (entry = strtok_r(spec, ";", &entry_save); entry;
+	     entry = strtok_r(NULL, ";", &entry_save)) {
+		key = entry;
+		value = strchr(entry, '=');
+		if (!value)
+			return -EINVAL;
+
+		*value++ = '\0';
+		count = 0;
+
+		if (!strcmp(key, "warmup")) {
+			benchmark->warmup = strtoul(value, NULL, 0);
+			continue;
+		} else if (!strcmp(key, "frames")) {
+			benchmark->frames = strtoul(value, NULL, 0);
+			continue;
+		} else if (!strcmp(key, "runs")) {
+			benchmark->runs = strtoul(value, NULL, 0);
+			continue;
+		} else if (!strcmp(key, "output")) {
+			benchmark->output_path = value;
+			continue;
+		}
+
+		for (value = strtok_r(value, ",", &value_save); value;
+		     value = strtok_r(NULL, ",", &value_save)) {
+			if (count == BENCHMARK_VALUES_MAX)
+				return -EINVAL;
+
+			if (!strcmp(key, "size")) {
+				benchmark->widths[count] =
+					strtoul(value, &value, 0);
+				if (*value != 'x')
+					return -EINVAL;
+
+				benchmark->heights[count] =
+					strtoul(value + 1, NULL, 0);
+				benchmark->sizes_count = ++count;
+			} else if (!strcmp(key, "format")) {
+				if (!strcmp(value, "nv12"))
+					benchmark->formats[count] =
+						V4L2_PIX_FMT_NV12M;
+				else if (!strcmp(value, "yuv420"))
+					benchmark->formats[count] =
+						V4L2_PIX_FMT_YUV420M;
+				else
+					return -EINVAL;
+
+				benchmark->formats_count = ++count;
+			} else if (!strcmp(key, "bitrate")) {
+				benchmark->bitrates[count] =
+					strtoull(value, NULL, 0);
+				benchmark->bitrates_count = ++count;
+			} else if (!strcmp(key, "gop")) {
+				benchmark->gop_sizes[count] =
+					strtoul(value, NULL, 0);
+				benchmark->gop_sizes_count = ++count;
+			} else if (!strcmp(key, "depth")) {
+				benchmark->depths[count] =
+					strtoul(value, NULL, 0);
+				benchmark->depths_count = ++count;
+			} else {
+				return -EINVAL;
+			}
+		}
+	}
+
+	if (!benchmark->frames || !benchmark->runs)
+		return -EINVAL;
+
+	return 0;
+}
+
+static uint64_t benchmark_cpu_time(void)
+{
+	struct timespec timespec;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &timespec);
+
+	return timespec.tv_sec * 1000000000ULL + timespec.tv_nsec;
+}
+
+/* Latency is only recorded once warmed up, from queueing or drawing to
+ * feedback. */
+static int benchmark_point(struct benchmark *benchmark, FILE *output,
+			   unsigned int width, unsigned int height,
+			   uint32_t format, uint64_t bitrate,
+			   unsigned int gop_size, unsigned int depth)
+{
+	struct v4l2_encoder *encoder;
+	struct histogram *latency;
+	uint64_t time, cpu_time;
+	uint64_t bytes;
+	double fps;
+	unsigned int run;
+	int ret;
+
+	for (run = 0; run < benchmark->runs; run++) {
+		encoder = encoder_create(width, height, format, bitrate,
+					 gop_size, depth, V4L2_MEMORY_MMAP,
+					 false, benchmark->memory_lock,
+					 "/dev/null", NULL, 0, NULL,
+					 benchmark->loopback_setup,
+					 benchmark->device_paths,
+					 benchmark->probe_cache_path);
+		if (!encoder)
+			return -ENODEV;
+
+		ret = encode_run(encoder, benchmark->warmup, depth, NULL);
+		if (ret)
+			goto complete;
+
+		ret = v4l2_encoder_stats_enable(encoder);
+		if (ret)
+			goto complete;
+
+		time = v4l2_encoder_time();
+		cpu_time = benchmark_cpu_time();
+
+		ret = encode_run(encoder, benchmark->frames, depth,
+				 benchmark->schedule);
+		if (ret)
+			goto complete;
+
+		time = v4l2_encoder_time() - time;
+		cpu_time = benchmark_cpu_time() - cpu_time;
+
+		latency = &encoder->stats->stages[V4L2_ENCODER_STAGE_TOTAL];
+		bytes = atomic_load(&encoder->stats->bytes);
+		fps = time ? benchmark->frames * 1e9 / time : 0;
+
+		fprintf(output, "{\"device\":\"%s\",\"width\":%u,\"height\":%u,"
+			"\"format\":\"%s\",\"bitrate\":%llu,\"gop\":%u,"
+			"\"depth\":%u,\"run\":%u,\"frames\":%u,\"fps\":%.2f,"
+			"\"latency_p50_us\":%.1f,\"latency_p99_us\":%.1f,"
+			"\"latency_p999_us\":%.1f,\"latency_max_us\":%.1f,"
+			"\"cpu_us_per_frame\":%.1f,\"bitrate_achieved\":%.0f}\n",
+			encoder->loopback ? "loopback" : "hardware", width,
+			height, format == V4L2_PIX_FMT_YUV420M ? "yuv420" : "nv12",
+			(unsigned long long)bitrate, gop_size, depth, run,
+			benchmark->frames, fps,
+			histogram_percentile(latency, 50) / 1000.0,
+			histogram_percentile(latency, 99) / 1000.0,
+			histogram_percentile(latency, 99.9) / 1000.0,
+			histogram_max(latency) / 1000.0,
+			cpu_time / 1000.0 / benchmark->frames,
+			bytes * 8.0 * encoder->setup.fps_num /
+			encoder->setup.fps_den / benchmark->frames);
+		fflush(output);
+
+complete:
+		encoder_destroy(encoder);
+
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int benchmark_run(struct benchmark *benchmark)
+{
+	struct v4l2_encoder *encoder;
+	unsigned int points, index, i;
+	unsigned int s, f, b, g, d;
+	FILE *output;
+	int ret = 0;
+
+	/* Fall back to a stand-in for the hardware when there is none. */
+	if (!benchmark->loopback_setup && !benchmark->device_paths) {
+		encoder = encoder_create(benchmark->widths[0],
+					 benchmark->heights[0], 0, 0, 0, 1,
+					 V4L2_MEMORY_MMAP, false, false,
+					 "/dev/null", NULL, 0, NULL, NULL,
+					 NULL, benchmark->probe_cache_path);
+		if (encoder) {
+			encoder_destroy(encoder);
+		} else {
+			fprintf(stderr, "No encoder found, benchmarking "
+				"the loopback device\n");
+			benchmark->loopback_setup =
+				&benchmark->loopback_default;
+		}
+	}
+
+	output = fopen(benchmark->output_path, "w");
+	if (!output) {
+		fprintf(stderr, "Failed to open benchmark output\n");
+		return -errno;
+	}
+
+	points = benchmark->sizes_count * benchmark->formats_count *
+		 benchmark->bitrates_count * benchmark->gop_sizes_count *
+		 benchmark->depths_count;
+
+	/* Depths vary first, sizes last. */
+	for (i = 0; i < points; i++) {
+		index = i;
+		d = index % benchmark->depths_count;
+		index /= benchmark->depths_count;
+		g = index % benchmark->gop_sizes_count;
+		index /= benchmark->gop_sizes_count;
+		b = index % benchmark->bitrates_count;
+		index /= benchmark->bitrates_count;
+		f = index % benchmark->formats_count;
+		s = index / benchmark->formats_count;
+
+		ret = benchmark_point(benchmark, output, benchmark->widths[s],
+				      benchmark->heights[s],
+				      benchmark->formats[f],
+				      benchmark->bitrates[b],
+				      benchmark->gop_sizes[g],
+				      benchmark->depths[d]);
+		if (ret) {
+			fprintf(stderr, "Failed to run benchmark\n");
+			goto complete;
+		}
+	}
+
+	printf("Benchmark results written to %s\n", benchmark->output_path);
+
+complete:
+	fclose(output);
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	struct v4l2_encoder **encoders = NULL;
+	struct v4l2_encoder *encoder;
+	struct pool *pool = NULL;
+	struct timespec time_start, time_stop;
+	char **bitstream_paths = NULL;
+	unsigned int width = 640;
+	unsigned int height = 480;
+	unsigned int frames = 10;
+	unsigned int depth = 1;
+	unsigned int streams = 1;
+	unsigned int contexts = 1;
+	unsigned int encoders_count;
+	unsigned int device_depth = 0;
+	unsigned int *weights = NULL;
+	unsigned int *devices = NULL;
+	uint64_t load = 0;
+	char *weights_list = NULL;
+	bool paced = false;
+	bool pooled = false;
+	struct loopback_setup loopback_setup = { 0 };
+	unsigned int loopback_cores = 1;
+	bool loopback = false;
+	char *loopback_list;
+	bool threaded = false;
+	bool event = false;
+	bool dmabuf = false;
+	char *device_paths[2] = { NULL, NULL };
+	const char *probe_cache_path = NULL;
+	bool memory_lock = false;
+	struct stats_dump dump = { 0 };
+	pthread_t stats_thread;
+	bool stats = false;
+	bool perf = false;
+	bool metrics = false;
+	struct benchmark benchmark = { 0 };
+	char *benchmark_spec = NULL;
+	const char *trace_path = NULL;
+	const char *record_path = NULL;
+	const char *replay_path = NULL;
+	sigset_t stats_set;
+	bool userptr = false;
+	bool export = false;
+	struct encode_schedule schedule = { 0 };
+	char *reconfigure_list;
+	char *bitrate_list;
+	unsigned int output_memory;
+	unsigned int i;
+	double duration;
+	int opt;
+	int ret;
+
+	while ((opt = getopt(argc, argv, "n:d:tes:D:W:Ppc:L:buxM:C:mR:B:SHT:OJ:w:r:")) != -1) {
+		switch (opt) {
+		case 'n':
+			frames = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			depth = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			threaded = true;
+			break;
+		case 'e':
+			event = true;
+			break;
+		case 'b':
+			dmabuf = true;
+			break;
+		case 'u':
+			userptr = true;
+			break;
+		case 'x':
+			export = true;
+			break;
+		case 'M':
+			device_paths[0] = strtok(optarg, ",");
+			device_paths[1] = strtok(NULL, ",");
+			if (!device_paths[1]) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'C':
+			probe_cache_path = optarg;
+			break;
+		case 'm':
+			memory_lock = true;
+			break;
+		case 'S':
+			stats = true;
+			break;
+		case 'H':
+			perf = true;
+			break;
+		case 'O':
+			metrics = true;
+			break;
+		case 'J':
+			benchmark_spec = optarg;
+			break;
+		case 'T':
+			trace_path = optarg;
+			break;
+		case 'w':
+			record_path = optarg;
+			break;
+		case 'r':
+			replay_path = optarg;
+			break;
+		case 'R':
+			reconfigure_list = optarg;
+			schedule.reconfigure_frame =
+				strtoul(reconfigure_list, &reconfigure_list, 0);
+			if (*reconfigure_list == ':')
+				schedule.reconfigure_width =
+					strtoul(reconfigure_list + 1,
+						&reconfigure_list, 0);
+			if (*reconfigure_list == 'x')
+				schedule.reconfigure_height =
+					strtoul(reconfigure_list + 1, NULL, 0);
+			if (!schedule.reconfigure_frame ||
+			    !schedule.reconfigure_width ||
+			    !schedule.reconfigure_height) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'B':
+			bitrate_list = optarg;
+			schedule.bitrate_frame = strtoul(bitrate_list,
+							 &bitrate_list, 0);
+			if (*bitrate_list == ':')
+				schedule.bitrate = strtoull(bitrate_list + 1,
+							    NULL, 0);
+			if (!schedule.bitrate_frame || !schedule.bitrate) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 's':
+			streams = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			device_depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'W':
+			weights_list = optarg;
+			break;
+		case 'P':
+			paced = true;
+			break;
+		case 'p':
+			pooled = true;
+			break;
+		case 'c':
+			contexts = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			/* Stand in for the hardware with a latency model. */
+			loopback_list = optarg;
+			loopback_setup.latency =
+				strtoul(loopback_list, &loopback_list, 0) * 1000;
+			if (*loopback_list == ',')
+				loopback_setup.latency_mb =
+					strtoul(loopback_list + 1,
+						&loopback_list, 0);
+			if (*loopback_list == ',')
+				loopback_cores = strtoul(loopback_list + 1,
+							 NULL, 0);
+			loopback_setup.intra_cost = 150;
+			loopback = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!streams || !contexts || (streams > 1 && contexts > 1) ||
+	    (dmabuf && (streams > 1 || contexts > 1 || threaded || event)) ||
+	    (userptr && (streams > 1 || contexts > 1 || threaded || event ||
+			 dmabuf)) ||
+	    (export && (streams > 1 || contexts > 1 || threaded || event ||
+			dmabuf || userptr)) ||
+	    (device_paths[0] && (pooled || loopback)) ||
+	    (perf && !stats) ||
+	    (benchmark_spec && (streams > 1 || contexts > 1 || threaded ||
+				event || dmabuf || userptr || export ||
+				pooled || stats || trace_path || metrics ||
+				record_path || replay_path)) ||
+	    ((schedule.reconfigure_frame || schedule.bitrate_frame) &&
+	     (streams > 1 || contexts > 1 || threaded || event || dmabuf ||
+	      userptr || export)) ||
+	    (record_path && (streams > 1 || contexts > 1)) ||
+	    (replay_path && (record_path || streams > 1 || contexts > 1 ||
+			     pooled || device_paths[0])) ||
+	    (loopback && (pooled || !loopback_cores ||
+			  loopback_cores > LOOPBACK_CORES_MAX))) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* Run the whole matrix on the default encode loop instead. */
+	if (benchmark_spec) {
+		benchmark_defaults(&benchmark, width, height, depth, frames);
+
+		benchmark.loopback_setup = loopback ? &loopback_setup : NULL;
+		benchmark.device_paths = device_paths[0] ? device_paths : NULL;
+		benchmark.probe_cache_path = probe_cache_path;
+		benchmark.memory_lock = memory_lock;
+		benchmark.schedule = &schedule;
+
+		if (benchmark_parse(&benchmark, benchmark_spec)) {
+			usage(argv[0]);
+			return 1;
+		}
+
+		return benchmark_run(&benchmark) ? 1 : 0;
+	}
+
+	encoders_count = streams > 1 ? streams : contexts;
+
+	/* Replays run on the loopback device, fed from the recording. */
+	if (replay_path && !loopback) {
+		loopback_setup.intra_cost = 150;
+		loopback = true;
+	}
+
+	if (record_path && session_record_open(record_path)) {
+		fprintf(stderr, "Failed to open session record\n");
+		return 1;
+	}
+
+	if (replay_path && session_replay_open(replay_path)) {
+		fprintf(stderr, "Failed to open session replay\n");
+		return 1;
+	}
+
+	/* Threads created from now on leave the signal to the stats one. */
+	if (stats) {
+		sigemptyset(&stats_set);
+		sigaddset(&stats_set, SIGUSR1);
+		pthread_sigmask(SIG_BLOCK, &stats_set, NULL);
+
+		if (v4l2_ioctl_stats_enable())
+			goto error;
+	}
+
+	if (dmabuf)
+		output_memory = V4L2_MEMORY_DMABUF;
+	else if (userptr)
+		output_memory = V4L2_MEMORY_USERPTR;
+	else
+		output_memory = V4L2_MEMORY_MMAP;
+
+	encoders = calloc(encoders_count, sizeof(*encoders));
+	bitstream_paths = calloc(encoders_count, sizeof(*bitstream_paths));
+	weights = calloc(encoders_count, sizeof(*weights));
+	devices = calloc(encoders_count, sizeof(*devices));
+	if (!encoders || !bitstream_paths || !weights || !devices)
+		goto error;
+
+	if (pooled) {
+		pool = pool_create();
+		if (!pool)
+			goto error;
+
+		if (pool_calibrate(pool, width, height)) {
+			fprintf(stderr, "Failed to calibrate encoder devices\n");
+			goto error;
+		}
+	}
+
+	/* All the streams share the same rate, macroblocks are the load. */
+	load = ((width + 15) / 16) * ((height + 15) / 16);
+
+	/* Comma-separated stream weights, the last one is repeated. */
+	for (i = 0; i < streams; i++) {
+		weights[i] = i ? weights[i - 1] : 1;
+
+		if (weights_list && *weights_list) {
+			weights[i] = strtoul(weights_list, &weights_list, 0);
+			if (*weights_list == ',')
+				weights_list++;
+		}
+	}
+
+	for (i = 0; i < encoders_count; i++) {
+		bitstream_paths[i] = malloc(32);
+		if (!bitstream_paths[i])
+			goto error;
+
+		/* Segments are stitched into the first context bitstream. */
+		if (streams > 1)
+			snprintf(bitstream_paths[i], 32, "capture-%u.h264", i);
+		else if (i)
+			snprintf(bitstream_paths[i], 32, "/dev/null");
+		else
+			snprintf(bitstream_paths[i], 32, "capture.h264");
+
+		loopback_setup.core = i % loopback_cores;
+
+		encoders[i] = encoder_create(width, height, 0, 0, 0, depth,
+					     output_memory, export, memory_lock,
+					     bitstream_paths[i], pool, load,
+					     &devices[i],
+					     loopback ? &loopback_setup : NULL,
+					     device_paths[0] ? device_paths : NULL,
+					     probe_cache_path);
+		if (!encoders[i])
+			goto error;
+
+		if (stats && v4l2_encoder_stats_enable(encoders[i]))
+			goto error;
+
+		if (perf && v4l2_encoder_perf_enable(encoders[i])) {
+			fprintf(stderr, "Failed to open performance counters\n");
+			goto error;
+		}
+
+		if (metrics && v4l2_encoder_metrics_open(encoders[i], i)) {
+			fprintf(stderr, "Failed to publish metrics\n");
+			goto error;
+		}
+	}
+
+	encoder = encoders[0];
+
+	/* Rate control is traced for the first encoder only. */
+	if (trace_path && v4l2_encoder_trace_open(encoder, trace_path)) {
+		fprintf(stderr, "Failed to open trace\n");
+		goto error;
+	}
+
+	if (stats) {
+		dump.encoders = encoders;
+		dump.encoders_count = encoders_count;
+
+		if (pthread_create(&stats_thread, NULL, stats_signal, &dump)) {
+			stats = false;
+			goto error;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &time_start);
+
+	/* Serve all the streams from a single thread. */
+	if (streams > 1) {
+		ret = encode_reactor(encoders, streams, frames, device_depth,
+				     weights, paced, pool, devices);
+		if (ret)
+			goto error;
+
+		goto report;
+	}
+
+	/* Encode closed GOP segments on all the contexts at once. */
+	if (contexts > 1) {
+		ret = segment_run(encoders, contexts, frames,
+				  encoder->bitstream_fd);
 		if (ret)
 			goto error;
 
-		ret = v4l2_encoder_run(encoder);
+		goto report;
+	}
+
+	/* Draw, encode and write from separate threads. */
+	if (threaded) {
+		ret = pipeline_run(encoder, frames);
 		if (ret)
 			goto error;
 
-		ret = v4l2_encoder_complete(encoder);
+		goto report;
+	}
+
+	/* Import frames drawn into separately allocated dmabufs. */
+	if (dmabuf) {
+		ret = encode_dmabuf(encoder, frames);
 		if (ret)
 			goto error;
+
+		goto report;
+	}
+
+	/* Encode from application buffers, copied only without USERPTR. */
+	if (userptr) {
+		ret = encode_userptr(encoder, frames);
+		if (ret)
+			goto error;
+
+		goto report;
 	}
 
+	/* Hand encoded slices to another process without copying. */
+	if (export) {
+		ret = encode_export(encoder, frames);
+		if (ret)
+			goto error;
+
+		goto report;
+	}
+
+	/* Drive the encoder from a poll loop without blocking. */
+	if (event) {
+		ret = encode_poll(encoder, frames);
+		if (ret)
+			goto error;
+
+		goto report;
+	}
+
+	ret = encode_run(encoder, frames, depth, &schedule);
+	if (ret)
+		goto error;
+
+report:
+	clock_gettime(CLOCK_MONOTONIC, &time_stop);
+
+	duration = (time_stop.tv_sec - time_start.tv_sec) +
+		   (time_stop.tv_nsec - time_start.tv_nsec) / 1000000000.0;
+
+	printf("Encoded %u frames in %.3f s (%.2f fps) with depth %u\n",
+	       frames * streams, duration,
+	       duration > 0 ? frames * streams / duration : 0, depth);
+
+	if (stats)
+		stats_dump(&dump);
+
 	ret = 0;
 	goto complete;
 
@@ -75,13 +1573,37 @@ error:
 	ret = 1;
 
 complete:
-	if (encoder) {
-		v4l2_encoder_stop(encoder);
-		v4l2_encoder_teardown(encoder);
-		v4l2_encoder_close(encoder);
+	if (stats && dump.encoders) {
+		pthread_cancel(stats_thread);
+		pthread_join(stats_thread, NULL);
+	}
 
-		free(encoder);
+	for (i = 0; encoders && i < encoders_count; i++) {
+		if (pool && encoders[i])
+			pool_encoder_release(pool, load, devices[i]);
+
+		encoder_destroy(encoders[i]);
 	}
 
+	pool_destroy(pool);
+
+	for (i = 0; bitstream_paths && i < encoders_count; i++)
+		if (bitstream_paths[i])
+			free(bitstream_paths[i]);
+
+	if (bitstream_paths)
+		free(bitstream_paths);
+
+	if (weights)
+		free(weights);
+
+	if (devices)
+		free(devices);
+
+	if (encoders)
+		free(encoders);
+
+	session_close();
+
 	return ret;
 }
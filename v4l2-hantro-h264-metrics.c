@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <metrics.h>
+
+#define INSTANCES_MAX	256
+
+struct instance {
+	char name[NAME_MAX + 2];
+	struct metrics_data *data;
+
+	struct metrics_data previous;
+	struct metrics_data current;
+	bool valid;
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-i interval ms] [-n count]\n", name);
+}
+
+static uint64_t time_now(void)
+{
+	struct timespec timespec;
+
+	clock_gettime(CLOCK_MONOTONIC, &timespec);
+
+	return timespec.tv_sec * 1000000000ULL + timespec.tv_nsec;
+}
+
+/* Segments left behind by processes that are gone are skipped. */
+static unsigned int instances_scan(struct instance *instances)
+{
+	struct metrics_data *data;
+	struct dirent *entry;
+	unsigned int count = 0;
+	DIR *dir;
+
+	dir = opendir("/dev/shm");
+	if (!dir)
+		return 0;
+
+	while ((entry = readdir(dir)) && count < INSTANCES_MAX) {
+		if (strncmp(entry->d_name, METRICS_PREFIX,
+			    strlen(METRICS_PREFIX)))
+			continue;
+
+		snprintf(instances[count].name, sizeof(instances[count].name),
+			 "/%s", entry->d_name);
+
+		data = metrics_map(instances[count].name);
+		if (!data)
+			continue;
+
+		if (kill(data->pid, 0) && errno == ESRCH) {
+			metrics_unmap(data);
+			continue;
+		}
+
+		instances[count].data = data;
+		instances[count].valid =
+			metrics_read(data, &instances[count].previous);
+		count++;
+	}
+
+	closedir(dir);
+
+	return count;
+}
+
+static uint64_t latency_percentile(uint64_t *buckets, double percentile)
+{
+	uint64_t total = 0;
+	uint64_t count = 0;
+	unsigned int i;
+
+	for (i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+		total += buckets[i];
+
+	if (!total)
+		return 0;
+
+	/* Upper bound of the bucket holding the percentile, in us. */
+	for (i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+		count += buckets[i];
+		if (count * 100.0 >= total * percentile)
+			break;
+	}
+
+	return 1ULL << i;
+}
+
+static void instances_report(struct instance *instances, unsigned int count,
+			     double interval)
+{
+	struct metrics_data *previous, *current;
+	uint64_t latency[METRICS_LATENCY_BUCKETS];
+	uint64_t latency_total[METRICS_LATENCY_BUCKETS] = { 0 };
+	double fps, fps_total = 0;
+	double bitrate, bitrate_total = 0;
+	unsigned int reported = 0;
+	unsigned int i, j;
+
+	printf("%8s %5s %10s %8s %10s %4s %6s %10s %10s %10s %10s\n", "pid",
+	       "index", "size", "fps", "kbps", "qp", "qp avg", "bits tgt",
+	       "bits left", "p50 us", "p99 us");
+
+	for (i = 0; i < count; i++) {
+		if (!instances[i].valid)
+			continue;
+
+		previous = &instances[i].previous;
+		current = &instances[i].current;
+
+		fps = (current->frames - previous->frames) / interval;
+		bitrate = (current->bytes - previous->bytes) * 8 / interval;
+
+		for (j = 0; j < METRICS_LATENCY_BUCKETS; j++) {
+			latency[j] = current->latency[j] - previous->latency[j];
+			latency_total[j] += latency[j];
+		}
+
+		printf("%8d %5u %5ux%-4u %8.1f %10.0f %4u %6u %10u %10u %10llu %10llu\n",
+		       current->pid, current->index, current->width,
+		       current->height, fps, bitrate / 1000, current->qp,
+		       current->qp_average, current->bits_target,
+		       current->bits_left,
+		       (unsigned long long)latency_percentile(latency, 50),
+		       (unsigned long long)latency_percentile(latency, 99));
+
+		fps_total += fps;
+		bitrate_total += bitrate;
+		reported++;
+	}
+
+	printf("%8s %5u %10s %8.1f %10.0f %4s %6s %10s %10s %10llu %10llu\n",
+	       "total", reported, "", fps_total, bitrate_total / 1000, "", "",
+	       "", "",
+	       (unsigned long long)latency_percentile(latency_total, 50),
+	       (unsigned long long)latency_percentile(latency_total, 99));
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	struct instance *instances;
+	unsigned int instances_count;
+	unsigned int interval = 1000;
+	unsigned int count = 0;
+	uint64_t start, end;
+	unsigned int i, n;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!interval) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	instances = calloc(INSTANCES_MAX, sizeof(*instances));
+	if (!instances)
+		return 1;
+
+	/* Rates are taken between two snapshots, an interval apart. */
+	for (n = 0; !count || n < count; n++) {
+		start = time_now();
+		instances_count = instances_scan(instances);
+
+		usleep(interval * 1000);
+
+		end = time_now();
+
+		for (i = 0; i < instances_count; i++) {
+			if (instances[i].valid)
+				instances[i].valid =
+					metrics_read(instances[i].data,
+						     &instances[i].current);
+
+			metrics_unmap(instances[i].data);
+			instances[i].data = NULL;
+		}
+
+		instances_report(instances, instances_count,
+				 (end - start) / 1000000000.0);
+	}
+
+	free(instances);
+
+	return 0;
+}
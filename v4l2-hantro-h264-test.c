@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2020 Bootlin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include <v4l2-encoder.h>
+#include <h264-rate-control.h>
+
+struct test {
+	const char *name;
+	int (*run)(struct v4l2_encoder *encoder);
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-f filter]\n", name);
+}
+
+/* VGA at a tenth of a bit per pixel. */
+static void test_encoder_setup(struct v4l2_encoder *encoder)
+{
+	struct v4l2_encoder_setup *setup = &encoder->setup;
+
+	memset(encoder, 0, sizeof(*encoder));
+
+	setup->width = 640;
+	setup->width_mbs = (setup->width + 15) / 16;
+	setup->height = 480;
+	setup->height_mbs = (setup->height + 15) / 16;
+	setup->fps_num = 25;
+	setup->fps_den = 1;
+	setup->bitrate = (uint64_t)setup->width * setup->height * 25 / 10;
+	setup->gop_size = 10;
+	setup->qp_intra_delta = 2;
+	setup->qp_min = 11;
+	setup->qp_max = 51;
+
+	h264_rate_control_setup(encoder);
+}
+
+/* Shrinking the GOP below the current position ends it, the next one must
+ * start from the average QP of the frames actually encoded. */
+static int test_h264_rate_control_gop_shrink(struct v4l2_encoder *encoder)
+{
+	struct h264_rate_control *rc = &encoder->rc;
+	unsigned int macroblocks;
+	unsigned int qp_sum = 0;
+	unsigned int qp_average;
+	unsigned int qp;
+	unsigned int i;
+
+	macroblocks = encoder->setup.width_mbs * encoder->setup.height_mbs;
+
+	encoder->setup.gop_size = 60;
+	h264_rate_control_setup(encoder);
+
+	for (i = 0; i < 40; i++) {
+		h264_rate_control_step(encoder);
+
+		if (i)
+			qp_sum += rc->qp;
+
+		/* On target, alternating slightly over and under it. */
+		h264_rate_control_feedback(encoder, rc->bits_target *
+					   (i & 1 ? 10 : 6) / 64,
+					   macroblocks * 4, macroblocks * rc->qp);
+
+		encoder->gop_index++;
+	}
+
+	/* Intra frames have their own QP, only inter ones are averaged. */
+	qp_average = qp_sum / (i - 1);
+
+	encoder->setup.gop_size = 20;
+	h264_rate_control_update(encoder);
+
+	h264_rate_control_step(encoder);
+
+	qp = rc->qp + encoder->setup.qp_intra_delta;
+	if (qp + 2 < qp_average || qp > qp_average + 2) {
+		fprintf(stderr, "GOP shrink moved QP from %u to %u\n",
+			qp_average, qp);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static struct test tests[] = {
+	{ "h264_rate_control_gop_shrink", test_h264_rate_control_gop_shrink },
+};
+
+int main(int argc, char *argv[])
+{
+	struct v4l2_encoder *encoder;
+	const char *filter = NULL;
+	unsigned int failed = 0;
+	unsigned int i;
+	int opt;
+	int ret;
+
+	while ((opt = getopt(argc, argv, "f:")) != -1) {
+		switch (opt) {
+		case 'f':
+			filter = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	encoder = malloc(sizeof(*encoder));
+	if (!encoder)
+		return 1;
+
+	/* Each test starts from a fresh rate control state. */
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		if (filter && !strstr(tests[i].name, filter))
+			continue;
+
+		test_encoder_setup(encoder);
+
+		ret = tests[i].run(encoder);
+		printf("%s: %s\n", tests[i].name, ret ? "FAIL" : "PASS");
+
+		if (ret)
+			failed++;
+	}
+
+	free(encoder);
+
+	return failed ? 1 : 0;
+}
@@ -13,11 +13,216 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <time.h>
+#include <stdatomic.h>
 
 #include <linux/videodev2.h>
 #include <linux/media.h>
 
 #include <v4l2.h>
+#include <loopback.h>
+#include <histogram.h>
+#include <session.h>
+
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
+
+#define V4L2_IOCTL_ERRNO_MAX	134
+
+struct v4l2_ioctl_stats {
+	struct histogram latency;
+	atomic_uint_fast64_t errors[V4L2_IOCTL_ERRNO_MAX];
+};
+
+#define V4L2_IOCTL(request)	{ request, #request }
+
+static const struct {
+	unsigned long request;
+	const char *name;
+} v4l2_ioctl_names[] = {
+	V4L2_IOCTL(VIDIOC_QBUF),
+	V4L2_IOCTL(VIDIOC_DQBUF),
+	V4L2_IOCTL(VIDIOC_S_EXT_CTRLS),
+	V4L2_IOCTL(VIDIOC_G_EXT_CTRLS),
+	V4L2_IOCTL(VIDIOC_TRY_EXT_CTRLS),
+	V4L2_IOCTL(MEDIA_REQUEST_IOC_QUEUE),
+	V4L2_IOCTL(MEDIA_REQUEST_IOC_REINIT),
+	{ V4L2_IOCTL_REQUEST_POLL, "request poll" },
+	V4L2_IOCTL(VIDIOC_STREAMON),
+	V4L2_IOCTL(VIDIOC_STREAMOFF),
+	V4L2_IOCTL(VIDIOC_REQBUFS),
+	V4L2_IOCTL(VIDIOC_CREATE_BUFS),
+	V4L2_IOCTL(VIDIOC_REMOVE_BUFS),
+	V4L2_IOCTL(VIDIOC_QUERYBUF),
+	V4L2_IOCTL(VIDIOC_EXPBUF),
+	V4L2_IOCTL(VIDIOC_G_FMT),
+	V4L2_IOCTL(VIDIOC_S_FMT),
+	V4L2_IOCTL(VIDIOC_TRY_FMT),
+	V4L2_IOCTL(VIDIOC_ENUM_FMT),
+	V4L2_IOCTL(VIDIOC_QUERYCAP),
+	V4L2_IOCTL(MEDIA_IOC_DEVICE_INFO),
+	V4L2_IOCTL(MEDIA_IOC_G_TOPOLOGY),
+	V4L2_IOCTL(MEDIA_IOC_REQUEST_ALLOC),
+	/* Anything else. */
+	{ 0, "other" },
+};
+
+/* Only allocated once enabled, which must happen before other threads use
+ * the wrappers. */
+static struct v4l2_ioctl_stats *v4l2_ioctl_stats;
+
+static uint64_t v4l2_ioctl_time(void)
+{
+	struct timespec timespec;
+
+	clock_gettime(CLOCK_MONOTONIC, &timespec);
+
+	return timespec.tv_sec * 1000000000ULL + timespec.tv_nsec;
+}
+
+int v4l2_ioctl_stats_enable(void)
+{
+	if (v4l2_ioctl_stats)
+		return 0;
+
+	v4l2_ioctl_stats = calloc(ARRAY_SIZE(v4l2_ioctl_names),
+				  sizeof(*v4l2_ioctl_stats));
+	if (!v4l2_ioctl_stats)
+		return -ENOMEM;
+
+	return 0;
+}
+
+uint64_t v4l2_ioctl_stats_start(void)
+{
+	if (!v4l2_ioctl_stats && !session_active())
+		return 0;
+
+	return v4l2_ioctl_time();
+}
+
+void v4l2_ioctl_stats_record(unsigned long request, uint64_t start, int error)
+{
+	struct v4l2_ioctl_stats *stats;
+	unsigned int i;
+
+	if (!v4l2_ioctl_stats)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(v4l2_ioctl_names) - 1; i++)
+		if (v4l2_ioctl_names[i].request == request)
+			break;
+
+	stats = &v4l2_ioctl_stats[i];
+
+	histogram_record(&stats->latency, v4l2_ioctl_time() - start);
+
+	if (error <= 0)
+		return;
+
+	if (error >= V4L2_IOCTL_ERRNO_MAX)
+		error = V4L2_IOCTL_ERRNO_MAX - 1;
+
+	atomic_fetch_add_explicit(&stats->errors[error], 1,
+				  memory_order_relaxed);
+}
+
+static const char *v4l2_ioctl_errno_name(unsigned int error)
+{
+	switch (error) {
+	case EAGAIN:
+		return "EAGAIN";
+	case EBUSY:
+		return "EBUSY";
+	case EINVAL:
+		return "EINVAL";
+	case EIO:
+		return "EIO";
+	case ENOMEM:
+		return "ENOMEM";
+	case ENOSPC:
+		return "ENOSPC";
+	case EPIPE:
+		return "EPIPE";
+	default:
+		return NULL;
+	}
+}
+
+void v4l2_ioctl_stats_dump(FILE *file)
+{
+	struct v4l2_ioctl_stats *stats;
+	struct histogram *histogram;
+	const char *name;
+	uint64_t count;
+	unsigned int i, j;
+
+	if (!v4l2_ioctl_stats)
+		return;
+
+	fprintf(file, "%-26s %8s %10s %10s %10s %10s %10s %s\n", "ioctl",
+		"count", "mean us", "p50 us", "p99 us", "p999 us", "max us",
+		"errors");
+
+	for (i = 0; i < ARRAY_SIZE(v4l2_ioctl_names); i++) {
+		stats = &v4l2_ioctl_stats[i];
+		histogram = &stats->latency;
+
+		if (!histogram_count(histogram))
+			continue;
+
+		fprintf(file,
+			"%-26s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f",
+			v4l2_ioctl_names[i].name,
+			(unsigned long long)histogram_count(histogram),
+			histogram_mean(histogram) / 1000.0,
+			histogram_percentile(histogram, 50) / 1000.0,
+			histogram_percentile(histogram, 99) / 1000.0,
+			histogram_percentile(histogram, 99.9) / 1000.0,
+			histogram_max(histogram) / 1000.0);
+
+		for (j = 1; j < V4L2_IOCTL_ERRNO_MAX; j++) {
+			count = atomic_load_explicit(&stats->errors[j],
+						     memory_order_relaxed);
+			if (!count)
+				continue;
+
+			name = v4l2_ioctl_errno_name(j);
+			if (name)
+				fprintf(file, " %s:%llu", name,
+					(unsigned long long)count);
+			else
+				fprintf(file, " %u:%llu", j,
+					(unsigned long long)count);
+		}
+
+		fprintf(file, "\n");
+	}
+}
+
+/* All the V4L2 and media ioctls go through here. */
+int v4l2_ioctl(int fd, unsigned long request, void *data)
+{
+	uint64_t start;
+	int ret;
+
+	if (!v4l2_ioctl_stats && !session_active())
+		return loopback_ioctl(fd, request, data);
+
+	start = v4l2_ioctl_time();
+
+	ret = loopback_ioctl(fd, request, data);
+
+	v4l2_ioctl_stats_record(request, start, ret < 0 ? errno : 0);
+
+	/* Sessions record the call or substitute recorded results. */
+	ret = session_ioctl(request, data, ret < 0 ? -errno : ret, start);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	return ret;
+}
 
 bool v4l2_type_mplane_check(unsigned int type)
 {
@@ -43,7 +248,8 @@ int v4l2_stream_set(int video_fd, unsigned int type, bool on)
 {
 	int ret;
 
-	ret = ioctl(video_fd, on ? VIDIOC_STREAMON : VIDIOC_STREAMOFF, &type);
+	ret = v4l2_ioctl(video_fd, on ? VIDIOC_STREAMON : VIDIOC_STREAMOFF,
+			     &type);
 	if (ret)
 		return -errno;
 
@@ -67,7 +273,7 @@ int v4l2_ext_controls_set(int video_fd, struct v4l2_ext_controls *ext_controls)
 	if (!ext_controls)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_S_EXT_CTRLS, ext_controls);
+	ret = v4l2_ioctl(video_fd, VIDIOC_S_EXT_CTRLS, ext_controls);
 	if (ret)
 		return -errno;
 
@@ -81,7 +287,7 @@ int v4l2_ext_controls_get(int video_fd, struct v4l2_ext_controls *ext_controls)
 	if (!ext_controls)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_G_EXT_CTRLS, ext_controls);
+	ret = v4l2_ioctl(video_fd, VIDIOC_G_EXT_CTRLS, ext_controls);
 	if (ret)
 		return -errno;
 
@@ -95,7 +301,7 @@ int v4l2_ext_controls_try(int video_fd, struct v4l2_ext_controls *ext_controls)
 	if (!ext_controls)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_TRY_EXT_CTRLS, ext_controls);
+	ret = v4l2_ioctl(video_fd, VIDIOC_TRY_EXT_CTRLS, ext_controls);
 	if (ret)
 		return -errno;
 
@@ -156,28 +362,35 @@ void v4l2_ext_control_setup_base(struct v4l2_ext_control *control,
 }
 
 int v4l2_buffers_create(int video_fd, unsigned int type, unsigned int memory,
-			struct v4l2_format *format, unsigned int count,
+			struct v4l2_format *format, unsigned int *count,
 			unsigned int *index)
 {
 	struct v4l2_create_buffers create_buffers = { 0 };
 	int ret;
 
+	if (!count)
+		return -EINVAL;
+
 	if (format) {
 		create_buffers.format = *format;
 	} else {
-		ret = ioctl(video_fd, VIDIOC_G_FMT, &create_buffers.format);
+		ret = v4l2_ioctl(video_fd, VIDIOC_G_FMT,
+				     &create_buffers.format);
 		if (ret)
 			return -errno;
 	}
 
 	create_buffers.format.type = type;
 	create_buffers.memory = memory;
-	create_buffers.count = count;
+	create_buffers.count = *count;
 
-	ret = ioctl(video_fd, VIDIOC_CREATE_BUFS, &create_buffers);
+	ret = v4l2_ioctl(video_fd, VIDIOC_CREATE_BUFS, &create_buffers);
 	if (ret)
 		return -errno;
 
+	/* Drivers may allocate fewer buffers than requested. */
+	*count = create_buffers.count;
+
 	if (index)
 		*index = create_buffers.index;
 
@@ -194,7 +407,7 @@ int v4l2_buffers_request(int video_fd, unsigned int type, unsigned int memory,
 	requestbuffers.memory = memory;
 	requestbuffers.count = count;
 
-	ret = ioctl(video_fd, VIDIOC_REQBUFS, &requestbuffers);
+	ret = v4l2_ioctl(video_fd, VIDIOC_REQBUFS, &requestbuffers);
 	if (ret)
 		return -errno;
 
@@ -211,7 +424,24 @@ int v4l2_buffers_destroy(int video_fd, unsigned int type, unsigned int memory)
 	requestbuffers.memory = memory;
 	requestbuffers.count = 0;
 
-	ret = ioctl(video_fd, VIDIOC_REQBUFS, &requestbuffers);
+	ret = v4l2_ioctl(video_fd, VIDIOC_REQBUFS, &requestbuffers);
+	if (ret)
+		return -errno;
+
+	return 0;
+}
+
+int v4l2_buffers_remove(int video_fd, unsigned int type, unsigned int index,
+			unsigned int count)
+{
+	struct v4l2_remove_buffers remove_buffers = { 0 };
+	int ret;
+
+	remove_buffers.type = type;
+	remove_buffers.index = index;
+	remove_buffers.count = count;
+
+	ret = v4l2_ioctl(video_fd, VIDIOC_REMOVE_BUFS, &remove_buffers);
 	if (ret)
 		return -errno;
 
@@ -231,7 +461,7 @@ int v4l2_buffers_capabilities_probe(int video_fd, unsigned int type,
 	create_buffers.memory = V4L2_MEMORY_MMAP;
 	create_buffers.count = 0;
 
-	ret = ioctl(video_fd, VIDIOC_CREATE_BUFS, &create_buffers);
+	ret = v4l2_ioctl(video_fd, VIDIOC_CREATE_BUFS, &create_buffers);
 	if (ret)
 		return -errno;
 
@@ -250,7 +480,7 @@ int v4l2_buffer_query(int video_fd, struct v4l2_buffer *buffer)
 	if (!buffer)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_QUERYBUF, buffer);
+	ret = v4l2_ioctl(video_fd, VIDIOC_QUERYBUF, buffer);
 	if (ret)
 		return -errno;
 
@@ -264,7 +494,7 @@ int v4l2_buffer_queue(int video_fd, struct v4l2_buffer *buffer)
 	if (!buffer)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_QBUF, buffer);
+	ret = v4l2_ioctl(video_fd, VIDIOC_QBUF, buffer);
 	if (ret)
 		return -errno;
 
@@ -278,13 +508,32 @@ int v4l2_buffer_dequeue(int video_fd, struct v4l2_buffer *buffer)
 	if (!buffer)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_DQBUF, buffer);
+	ret = v4l2_ioctl(video_fd, VIDIOC_DQBUF, buffer);
 	if (ret)
 		return -errno;
 
 	return 0;
 }
 
+int v4l2_buffer_export(int video_fd, unsigned int type, unsigned int index,
+		       unsigned int plane_index, unsigned int flags)
+{
+	struct v4l2_exportbuffer exportbuffer;
+	int ret;
+
+	memset(&exportbuffer, 0, sizeof(exportbuffer));
+	exportbuffer.type = type;
+	exportbuffer.index = index;
+	exportbuffer.plane = plane_index;
+	exportbuffer.flags = flags;
+
+	ret = v4l2_ioctl(video_fd, VIDIOC_EXPBUF, &exportbuffer);
+	if (ret)
+		return -errno;
+
+	return exportbuffer.fd;
+}
+
 int v4l2_buffer_plane_offset(struct v4l2_buffer *buffer,
 			     unsigned int plane_index, unsigned int *offset)
 {
@@ -411,7 +660,7 @@ int v4l2_pixel_format_enum(int video_fd, unsigned int type, unsigned int index,
 	fmtdesc.type = type;
 	fmtdesc.index = index;
 
-	ret = ioctl(video_fd, VIDIOC_ENUM_FMT, &fmtdesc);
+	ret = v4l2_ioctl(video_fd, VIDIOC_ENUM_FMT, &fmtdesc);
 	if (ret)
 		return -errno;
 
@@ -454,7 +703,7 @@ int v4l2_format_try(int video_fd, struct v4l2_format *format)
 	if (!format)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_TRY_FMT, format);
+	ret = v4l2_ioctl(video_fd, VIDIOC_TRY_FMT, format);
 	if (ret)
 		return -errno;
 
@@ -468,7 +717,7 @@ int v4l2_format_set(int video_fd, struct v4l2_format *format)
 	if (!format)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_S_FMT, format);
+	ret = v4l2_ioctl(video_fd, VIDIOC_S_FMT, format);
 	if (ret)
 		return -errno;
 
@@ -482,7 +731,7 @@ int v4l2_format_get(int video_fd, struct v4l2_format *format)
 	if (!format)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_G_FMT, format);
+	ret = v4l2_ioctl(video_fd, VIDIOC_G_FMT, format);
 	if (ret)
 		return -errno;
 
@@ -523,7 +772,7 @@ int v4l2_capabilities_probe(int video_fd, unsigned int *capabilities,
 	if (!capabilities)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_QUERYCAP, &capability);
+	ret = v4l2_ioctl(video_fd, VIDIOC_QUERYCAP, &capability);
 	if (ret < 0)
 		return -errno;
 
@@ -6,10 +6,37 @@
 #ifndef _V4L2_H_
 #define _V4L2_H_
 
+#include <stdio.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 #include <linux/videodev2.h>
 
+/* Buffer removal is only in recent kernel headers. */
+#ifndef VIDIOC_REMOVE_BUFS
+struct v4l2_remove_buffers {
+	__u32 index;
+	__u32 count;
+	__u32 type;
+	__u32 reserved[13];
+};
+
+#define VIDIOC_REMOVE_BUFS	_IOWR('V', 104, struct v4l2_remove_buffers)
+#endif
+
+#ifndef V4L2_BUF_CAP_SUPPORTS_REMOVE_BUFS
+#define V4L2_BUF_CAP_SUPPORTS_REMOVE_BUFS	(1 << 8)
+#endif
+
+/* Not an ioctl, request polls are accounted along with them. */
+#define V4L2_IOCTL_REQUEST_POLL	(~0UL)
+
+int v4l2_ioctl_stats_enable(void);
+uint64_t v4l2_ioctl_stats_start(void);
+void v4l2_ioctl_stats_record(unsigned long request, uint64_t start, int error);
+void v4l2_ioctl_stats_dump(FILE *file);
+int v4l2_ioctl(int fd, unsigned long request, void *data);
+
 bool v4l2_type_mplane_check(unsigned int type);
 bool v4l2_capabilities_check(unsigned int capabilities_probed,
 			     unsigned int capabilities);
@@ -33,17 +60,21 @@ void v4l2_ext_controls_setup(struct v4l2_ext_controls *ext_controls,
 			     unsigned int controls_count);
 
 int v4l2_buffers_create(int video_fd, unsigned int type, unsigned int memory,
-			struct v4l2_format *format, unsigned int count,
+			struct v4l2_format *format, unsigned int *count,
 			unsigned int *index);
 int v4l2_buffers_request(int video_fd, unsigned int type, unsigned int memory,
 			 unsigned int count);
 int v4l2_buffers_destroy(int video_fd, unsigned int type, unsigned int memory);
+int v4l2_buffers_remove(int video_fd, unsigned int type, unsigned int index,
+			unsigned int count);
 int v4l2_buffers_capabilities_probe(int video_fd, unsigned int type,
 				    unsigned int *capabilities);
 
 int v4l2_buffer_query(int video_fd, struct v4l2_buffer *buffer);
 int v4l2_buffer_queue(int video_fd, struct v4l2_buffer *buffer);
 int v4l2_buffer_dequeue(int video_fd, struct v4l2_buffer *buffer);
+int v4l2_buffer_export(int video_fd, unsigned int type, unsigned int index,
+		       unsigned int plane_index, unsigned int flags);
 bool v4l2_buffer_error_check(struct v4l2_buffer *buffer);
 int v4l2_buffer_plane_offset(struct v4l2_buffer *buffer,
 			     unsigned int plane_index, unsigned int *offset);